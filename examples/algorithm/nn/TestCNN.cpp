@@ -5,18 +5,66 @@
 * Filename: TestCNN.cpp
 * Description: 
 **********************************************/
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 #include <algorithm/cnn/CNN.h>
 #include <utils/MnistHelper.h>
 
 int main(int argc, char** argv){
-    auto cnn = new ccma::algorithm::cnn::CNN();
-    if(!(cnn->add_layer(new ccma::algorithm::cnn::DataLayer(28, 28)) &&
+    /*
+     * ./CNN_test              sigmoid output, squared error
+     * ./CNN_test softmax      softmax output, cross entropy
+     * ./CNN_test batch [size] [eta]
+     *                          softmax output, mini batches of size
+     *                          (default 32) at learning rate eta(default 0.3)
+     * ./CNN_test threads [max_threads]
+     *                          training time of one epoch on 10000 rows in
+     *                          mini batches of 32 with 1, 2, 4 .. max_threads
+     *                          (default all cores) worker threads
+     * ./CNN_test fused         max pooling fused into the convolutions,
+     *                          mini batches of 32 at learning rate 0.3
+     * ./CNN_test pooling [mean|max|l2]
+     *                          fused mini batches of 32 at learning rate 0.3
+     *                          with the given pooling(default max)
+     * ./CNN_test predict      one fused epoch as above, then accuracy and
+     *                          latency of the exported InferenceEngine on
+     *                          one image per call and on the whole test set
+     * ./CNN_test resume [path]
+     *                          5 fused epochs checkpointed to path(default
+     *                          data/cnn.model) after every epoch, a rerun
+     *                          loads it and trains the epochs left
+     */
+    std::string mode = argc > 1 ? argv[1] : "";
+    bool softmax = mode == "softmax" || mode == "batch" || mode == "threads" || mode == "fused" || mode == "pooling" || mode == "predict" || mode == "resume";
+    std::string pooling_type = (mode == "pooling" && argc > 2) ? argv[2] : "max";
+    auto pooling = [&]() -> ccma::algorithm::cnn::Pooling* {
+        if(mode == "fused" || mode == "pooling" || mode == "predict" || mode == "resume"){
+            if(pooling_type == "mean"){
+                return new ccma::algorithm::cnn::MeanPooling();
+            }else if(pooling_type == "l2"){
+                return new ccma::algorithm::cnn::L2Pooling();
+            }
+            return new ccma::algorithm::cnn::MaxPooling();
+        }
+        return new ccma::algorithm::cnn::MeanPooling();
+    };
+    uint mini_batch_size = 1;
+
+    std::string model_path = (mode == "resume") ? (argc > 2 ? argv[2] : "data/cnn.model") : "";
+    auto cnn = new ccma::algorithm::cnn::CNN(model_path);
+    bool is_loaded = mode == "resume" && cnn->load_model(model_path);
+    if(is_loaded){
+        printf("resume from %s after %u epochs\n", model_path.c_str(), cnn->get_num_epochs());
+    }else if(!(cnn->add_layer(new ccma::algorithm::cnn::DataLayer(28, 28)) &&
         cnn->add_layer(new ccma::algorithm::cnn::ConvolutionLayer(5, 1, 6)) &&
-        cnn->add_layer(new ccma::algorithm::cnn::SubSamplingLayer(2, new ccma::algorithm::cnn::MeanPooling())) &&
+        cnn->add_layer(new ccma::algorithm::cnn::SubSamplingLayer(2, pooling())) &&
         cnn->add_layer(new ccma::algorithm::cnn::ConvolutionLayer(5, 1, 12)) &&
-        cnn->add_layer(new ccma::algorithm::cnn::SubSamplingLayer(2, new ccma::algorithm::cnn::MeanPooling())) &&
-        cnn->add_layer(new ccma::algorithm::cnn::FullConnectionLayer(10)))){
+        cnn->add_layer(new ccma::algorithm::cnn::SubSamplingLayer(2, pooling())) &&
+        cnn->add_layer(new ccma::algorithm::cnn::FullConnectionLayer(10, softmax)))){
         delete cnn;
         return -1;
     }
@@ -34,7 +82,60 @@ int main(int argc, char** argv){
 
     auto test_label     = new ccma::algebra::DenseMatrixT<real>();
     helper.read_label("data/mnist/t10k-labels-idx1-ubyte", test_label, test_cnt);
-    cnn->train(train_data, train_label, 500, test_data, test_label);
+    if(mode == "batch"){
+        mini_batch_size = argc > 2 ? atoi(argv[2]) : 32;
+        cnn->set_learning_rate(argc > 3 ? atof(argv[3]) : 0.3);
+    }else if(mode == "fused" || mode == "pooling" || mode == "predict" || mode == "resume"){
+        mini_batch_size = 32;
+        if(!is_loaded){
+            //a loaded model keeps its own learning rate
+            cnn->set_learning_rate(0.3);
+        }
+        cnn->set_fuse_pooling(true);
+    }
+    if(mode == "threads"){
+        uint max_thread = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+        ccma::algebra::DenseMatrixViewT<real> data(train_data->get_data(), 10000, train_data->get_cols());
+        ccma::algebra::DenseMatrixViewT<real> label(train_label->get_data(), 10000, train_label->get_cols());
+        long base_ms = 0;
+        for(uint num_thread = 1; num_thread <= max_thread; num_thread = (num_thread == max_thread) ? max_thread + 1 : std::min(2 * num_thread, max_thread)){
+            cnn->set_num_thread(num_thread);
+            auto start_time = std::chrono::system_clock::now();
+            cnn->train(&data, &label, 1, nullptr, nullptr, 32);
+            long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start_time).count();
+            base_ms = (num_thread == 1) ? ms : base_ms;
+            printf("threads %u: %ld ms speedup %.2f\n", num_thread, ms, (double)base_ms / ms);
+        }
+    }else if(mode == "resume"){
+        const uint num_epochs = 5;
+        cnn->train(train_data, train_label, num_epochs - std::min(num_epochs, cnn->get_num_epochs()), test_data, test_label, mini_batch_size);
+    }else if(mode == "predict"){
+        cnn->train(train_data, train_label, 1, nullptr, nullptr, mini_batch_size);
+        auto engine = cnn->export_engine();
+        uint out_size = engine->get_output_size();
+        std::vector<real> probability(test_cnt * out_size);
+        std::vector<uint> label(test_cnt);
+
+        auto now = []{return std::chrono::steady_clock::now();};
+        auto start_time = now();
+        for(uint i = 0; i != test_cnt; i++){
+            engine->predict_batch(&test_data->get_data()[i * test_data->get_cols()], 1, &probability[i * out_size], &label[i]);
+        }
+        double single_us = std::chrono::duration<double, std::micro>(now() - start_time).count() / test_cnt;
+        start_time = now();
+        engine->predict_batch(test_data->get_data(), test_cnt, probability.data(), label.data());
+        double batch_us = std::chrono::duration<double, std::micro>(now() - start_time).count() / test_cnt;
+
+        uint cnt = 0;
+        for(uint i = 0; i != test_cnt; i++){
+            cnt += (label[i] == (uint)test_label->get_data(i));
+        }
+        printf("engine %u/%u ops %u arena %u elements, %.1f us per image single, %.1f us per image batch\n",
+               cnt, test_cnt, engine->get_num_ops(), engine->get_arena_size(), single_us, batch_us);
+        delete engine;
+    }else{
+        cnn->train(train_data, train_label, 500, test_data, test_label, mini_batch_size);
+    }
 //    cnn->train(train_data, train_label, 1);
 
     delete cnn;
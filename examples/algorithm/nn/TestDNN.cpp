@@ -6,10 +6,44 @@
 * Description: DNN test
 **********************************************/
 
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <thread>
 #include "algorithm/nn/DNN.h"
+#include "algorithm/nn/InferenceSession.h"
+#include "utils/Communicator.h"
 #include "utils/MnistHelper.h"
 
+/*
+ * accuracy, predict_batch latency and model file size of dnn on the
+ * test data
+ */
+void benchmark(ccma::algorithm::nn::DNN* dnn,
+               ccma::algebra::BaseMatrixT<real>* test_data,
+               ccma::algebra::BaseMatrixT<real>* test_label,
+               const std::string& name){
+    auto probability = new ccma::algebra::DenseMatrixT<real>();
+    dnn->predict_batch(test_data, probability);
+
+    const uint num_runs = 10;
+    auto start_time = std::chrono::system_clock::now();
+    for(uint i = 0; i != num_runs; i++){
+        dnn->predict_batch(test_data, probability);
+    }
+    long predict_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - start_time).count() / num_runs;
+    delete probability;
+
+    const std::string path = "data/dnn_" + name + ".model";
+    dnn->write_model(path);
+    std::ifstream model_file(path, std::ios::binary | std::ios::ate);
+
+    printf("%s: sparsity %.2f accuracy %d / %d predict %ld us model %ld bytes\n",
+           name.c_str(), dnn->get_sparsity(), dnn->evaluate(test_data, test_label),
+           test_data->get_rows(), predict_us, (long)model_file.tellg());
+}
+
 int main(int argc, char** argv){
 
     auto dnn = new ccma::algorithm::nn::DNN("data/dnn.model");
@@ -32,7 +66,218 @@ int main(int argc, char** argv){
     auto test_label     = new ccma::algebra::DenseMatrixT<real>();
     helper.read_label("data/mnist/t10k-labels-idx1-ubyte", test_label, -1);
 
-    dnn->sgd(train_data, train_label, 30, 3, 0.1, 30, test_data, test_label);
+    /*
+     * ./DNN_test              synchronous mini batch sgd
+     * ./DNN_test async [threads] [staleness]
+     *                          Hogwild! asynchronous sgd,
+     *                          eta is per sample(3 / mini_batch_size)
+     * ./DNN_test momentum|nesterov|adagrad|rmsprop|adam
+     *                          mini batch training with the given optimizer
+     * ./DNN_test relu          784-100(relu, batch norm, dropout)-10(softmax)
+     *                          trained with adam
+     * ./DNN_test checkpoint [budget]
+     *                          784-8x100(relu)-10(softmax) trained with
+     *                          gradient checkpointing under an activation
+     *                          memory budget in bytes(default 1.5MB)
+     * ./DNN_test schedule      cosine learning rate, validation on 2000
+     *                          test rows and early stopping after 3
+     *                          validations without improvement
+     * ./DNN_test sparse        the images as sparse rows of their nonzero
+     *                          pixels, sparse first layer
+     * ./DNN_test prune [sparsity]
+     *                          784-300-100-10 trained with adam, then
+     *                          magnitude pruned(default 0.9) and fine
+     *                          tuned, then 2:4 pruned from the dense model,
+     *                          reports accuracy, latency and model size
+     * ./DNN_test dist [workers]
+     *                          data parallel sgd in workers(default 4)
+     *                          processes, each on 1 / workers of the
+     *                          train data with mini batch 30 / workers
+     * ./DNN_test clip [max_norm]
+     *                          sgd with a diverging learning rate, the
+     *                          gradient clipped to max_norm(default 1)
+     * ./DNN_test serve [threads]
+     *                          trains the default network, then threads
+     *                          (default 4) serve the test data from one
+     *                          InferenceSession while the model is
+     *                          reloaded from data/dnn.model
+     * ./DNN_test distill [temperature] [alpha]
+     *                          784-300(relu)-10(softmax) teacher trained
+     *                          with adam, then distilled(default T 4,
+     *                          alpha 0.7) into a 784-30-10(softmax)
+     *                          student, soft targets cached in
+     *                          data/dnn_soft.model. prints weights,
+     *                          accuracy and predict latency of both
+     */
+    std::string mode = argc > 1 ? argv[1] : "";
+    if(mode == "async"){
+        uint num_thread = argc > 2 ? atoi(argv[2]) : 0;
+        uint staleness  = argc > 3 ? atoi(argv[3]) : 1;
+        dnn->train_async(train_data, train_label, 30, 0.1, 0.1, num_thread, staleness, test_data, test_label);
+    }else if(mode == "momentum"){
+        dnn->set_optimizer(new ccma::algorithm::nn::MomentumOptimizer(0.9));
+        dnn->sgd(train_data, train_label, 30, 0.3, 0.1, 30, test_data, test_label);
+    }else if(mode == "nesterov"){
+        dnn->set_optimizer(new ccma::algorithm::nn::NesterovOptimizer(0.9));
+        dnn->sgd(train_data, train_label, 30, 0.3, 0.1, 30, test_data, test_label);
+    }else if(mode == "adagrad"){
+        dnn->set_optimizer(new ccma::algorithm::nn::AdaGradOptimizer());
+        dnn->sgd(train_data, train_label, 30, 0.1, 0.1, 30, test_data, test_label);
+    }else if(mode == "rmsprop"){
+        dnn->set_optimizer(new ccma::algorithm::nn::RMSPropOptimizer());
+        dnn->sgd(train_data, train_label, 30, 0.001, 0.1, 30, test_data, test_label);
+    }else if(mode == "relu"){
+        delete dnn;
+        dnn = new ccma::algorithm::nn::DNN("data/dnn.model");
+        dnn->add_layer(784);
+        dnn->add_layer(100, ccma::algebra::Activation::RELU, 0.2, true);
+        dnn->add_layer(10, ccma::algebra::Activation::SOFTMAX);
+        dnn->init_networks_weights();
+        dnn->set_shard_size(32);
+        dnn->set_optimizer(new ccma::algorithm::nn::AdamOptimizer());
+        dnn->sgd(train_data, train_label, 30, 0.001, 0.1, 64, test_data, test_label);
+    }else if(mode == "checkpoint"){
+        delete dnn;
+        dnn = new ccma::algorithm::nn::DNN("data/dnn.model");
+        dnn->add_layer(784);
+        for(uint i = 0; i != 8; i++){
+            dnn->add_layer(100, ccma::algebra::Activation::RELU);
+        }
+        dnn->add_layer(10, ccma::algebra::Activation::SOFTMAX);
+        dnn->init_networks_weights();
+        dnn->set_shard_size(32);
+        dnn->set_memory_budget(argc > 2 ? atol(argv[2]) : (3 << 19));
+        dnn->set_optimizer(new ccma::algorithm::nn::AdamOptimizer());
+        dnn->sgd(train_data, train_label, 30, 0.001, 0.1, 256, test_data, test_label);
+    }else if(mode == "schedule"){
+        dnn->set_optimizer(new ccma::algorithm::nn::MomentumOptimizer(0.9));
+        dnn->set_schedule(new ccma::algorithm::nn::CosineSchedule(30, 0.01));
+        dnn->set_validation(2000);
+        dnn->set_early_stopping(3, 0.001);
+        dnn->sgd(train_data, train_label, 30, 0.3, 0.1, 30, test_data, test_label);
+    }else if(mode == "sparse"){
+        ccma::algebra::SparseMatrixT<real> sparse_train_data;
+        ccma::algebra::SparseMatrixT<real> sparse_test_data;
+        sparse_train_data.from_dense(train_data);
+        sparse_test_data.from_dense(test_data);
+        dnn->sgd(&sparse_train_data, train_label, 30, 3, 0.1, 30, &sparse_test_data, test_label);
+    }else if(mode == "prune"){
+        delete dnn;
+        dnn = new ccma::algorithm::nn::DNN();
+        dnn->add_layer(784);
+        dnn->add_layer(300, ccma::algebra::Activation::RELU);
+        dnn->add_layer(100, ccma::algebra::Activation::RELU);
+        dnn->add_layer(10, ccma::algebra::Activation::SOFTMAX);
+        dnn->init_networks_weights();
+        dnn->set_optimizer(new ccma::algorithm::nn::AdamOptimizer());
+        dnn->sgd(train_data, train_label, 10, 0.001, 0.1, 64);
+        benchmark(dnn, test_data, test_label, "dense");
+        //the dense weights again for the N:M run below
+        dnn->write_model("data/dnn_dense.model");
+
+        dnn->prune(argc > 2 ? atof(argv[2]) : 0.9);
+        benchmark(dnn, test_data, test_label, "pruned");
+        dnn->sgd(train_data, train_label, 3, 0.0003, 0.1, 64);
+        benchmark(dnn, test_data, test_label, "fine_tuned");
+
+        if(dnn->load_model("data/dnn_dense.model")){
+            dnn->prune_n_m(2, 4);
+            dnn->sgd(train_data, train_label, 3, 0.0003, 0.1, 64);
+            benchmark(dnn, test_data, test_label, "2_4");
+        }else{
+            printf("load data/dnn_dense.model failed, 2:4 pruning skipped.\n");
+        }
+    }else if(mode == "dist"){
+        uint num_workers = argc > 2 ? atoi(argv[2]) : 4;
+        if(num_workers == 0){
+            num_workers = 1;
+        }
+        //threads do not survive fork, every worker builds its own dnn
+        bool is_ok = ccma::utils::launch_local(num_workers, [&](ccma::utils::Communicator* communicator){
+            ccma::algorithm::nn::DNN worker_dnn("data/dnn.model");
+            worker_dnn.add_layer(784);
+            worker_dnn.add_layer(30);
+            worker_dnn.add_layer(10);
+            worker_dnn.init_networks_weights();
+            worker_dnn.set_seed(1);
+            worker_dnn.set_communicator(communicator);
+            return worker_dnn.sgd(train_data, train_label, 30, 3, 0.1, std::max(30 / num_workers, 1u), test_data, test_label) ? 0 : 1;
+        });
+        printf("dist training with %u workers: %s\n", num_workers, is_ok ? "ok" : "failed");
+    }else if(mode == "clip"){
+        //a learning rate that diverges without clipping
+        dnn->set_clip_norm(argc > 2 ? atof(argv[2]) : 1.0);
+        dnn->sgd(train_data, train_label, 30, 30, 0.1, 30, test_data, test_label);
+        printf("skipped steps: %llu\n", dnn->get_num_skipped());
+    }else if(mode == "serve"){
+        uint num_thread = argc > 2 ? atoi(argv[2]) : 4;
+        dnn->sgd(train_data, train_label, 3, 3, 0.1, 30);
+        ccma::algorithm::nn::InferenceSession session(dnn);
+
+        std::vector<int> num_correct(num_thread, 0);
+        std::vector<std::thread> threads;
+        for(uint i = 0; i != num_thread; i++){
+            threads.push_back(std::thread([&, i]{
+                ccma::algebra::DenseMatrixT<real> probability;
+                std::vector<uint> label;
+                for(uint k = 0; k != 10; k++){
+                    session.predict(test_data, &probability, &label);
+                }
+                for(uint k = 0; k != label.size(); k++){
+                    num_correct[i] += (label[k] == test_label->get_data(k));
+                }
+            }));
+        }
+        for(uint k = 0; k != 10; k++){
+            session.reload("data/dnn.model");
+        }
+        for(auto&& thread : threads){
+            thread.join();
+        }
+        for(uint i = 0; i != num_thread; i++){
+            printf("serving thread %u: %d / %d\n", i, num_correct[i], test_data->get_rows());
+        }
+    }else if(mode == "distill"){
+        ccma::algorithm::nn::DNN teacher("data/dnn_teacher.model");
+        teacher.add_layer(784);
+        teacher.add_layer(300, ccma::algebra::Activation::RELU);
+        teacher.add_layer(10, ccma::algebra::Activation::SOFTMAX);
+        teacher.init_networks_weights();
+        teacher.set_optimizer(new ccma::algorithm::nn::AdamOptimizer());
+        teacher.sgd(train_data, train_label, 10, 0.001, 0.1, 30, test_data, test_label);
+
+        delete dnn;
+        dnn = new ccma::algorithm::nn::DNN("data/dnn.model");
+        dnn->add_layer(784);
+        dnn->add_layer(30);
+        dnn->add_layer(10, ccma::algebra::Activation::SOFTMAX);
+        dnn->init_networks_weights();
+        dnn->set_optimizer(new ccma::algorithm::nn::AdamOptimizer());
+        dnn->distill(&teacher, train_data, train_label, 30, 0.001, 0.1, 30,
+                     argc > 2 ? atof(argv[2]) : 4.0, argc > 3 ? atof(argv[3]) : 0.7,
+                     test_data, test_label, "data/dnn_soft.model");
+
+        //size, accuracy and batched predict latency of both networks
+        auto report = [&](ccma::algorithm::nn::DNN* net, const char* name, uint num_weights){
+            ccma::algebra::DenseMatrixT<real> probability;
+            net->predict_batch(test_data, &probability);
+            const uint num_runs = 10;
+            auto start_time = std::chrono::system_clock::now();
+            for(uint i = 0; i != num_runs; i++){
+                net->predict_batch(test_data, &probability);
+            }
+            long predict_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - start_time).count() / num_runs;
+            printf("%s: %u weights accuracy %d / %d predict %ld us\n",
+                   name, num_weights, net->evaluate(test_data, test_label), test_data->get_rows(), predict_us);
+        };
+        report(&teacher, "teacher", 784 * 300 + 300 * 10);
+        report(dnn, "student", 784 * 30 + 30 * 10);
+    }else if(mode == "adam"){
+        dnn->set_optimizer(new ccma::algorithm::nn::AdamOptimizer());
+        dnn->sgd(train_data, train_label, 30, 0.001, 0.1, 30, test_data, test_label);
+    }else{
+        dnn->sgd(train_data, train_label, 30, 3, 0.1, 30, test_data, test_label);
+    }
 
     delete train_data;
     delete train_label;
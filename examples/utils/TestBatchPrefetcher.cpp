@@ -0,0 +1,63 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 17:50
+ * Last modified : 2026-10-18 17:50
+ * Filename      : TestBatchPrefetcher.cpp
+ * Description   : 
+ **********************************************/
+#include <stdio.h>
+#include <vector>
+#include "utils/BatchPrefetcher.h"
+
+/*
+ * rows of data are their own index, every epoch must visit each row
+ * exactly once and two prefetchers with the same seed must produce
+ * the same batches.
+ */
+int main(int argc, char** argv){
+    const uint rows = 1000;
+    const uint epochs = 3;
+    const uint batch_size = 64;
+
+    auto data = new ccma::algebra::DenseMatrixT<real>(rows, 1);
+    auto label = new ccma::algebra::DenseMatrixT<real>(rows, 1);
+    for(uint i = 0; i != rows; i++){
+        data->set_data(i, i, 0);
+        label->set_data(i, i, 0);
+    }
+
+    std::vector<std::vector<uint> > sequences;
+    for(uint depth = 2; depth <= 3; depth++){
+        ccma::utils::Shuffler shuffler(rows, 7);
+        ccma::utils::BatchPrefetcher<real> prefetcher(data, label, batch_size, epochs, &shuffler, depth);
+
+        std::vector<uint> sequence;
+        std::vector<uint> visits(rows, 0);
+        ccma::algebra::BaseMatrixT<real>* batch_data = nullptr;
+        ccma::algebra::BaseMatrixT<real>* batch_label = nullptr;
+        uint num_batch = 0;
+        bool label_ok = true;
+        while(prefetcher.next(&batch_data, &batch_label)){
+            for(uint i = 0; i != batch_data->get_rows(); i++){
+                uint row = (uint)batch_data->get_data(i, 0);
+                label_ok = label_ok && (batch_label->get_data(i, 0) == row);
+                visits[row]++;
+                sequence.push_back(row);
+            }
+            num_batch++;
+        }
+
+        bool visit_ok = true;
+        for(auto visit : visits){
+            visit_ok = visit_ok && (visit == epochs);
+        }
+        printf("depth[%d] batches[%d] expected[%d] every row once per epoch[%d] label ok[%d]\n",
+               depth, num_batch, prefetcher.get_num_batches() * epochs, visit_ok, label_ok);
+        sequences.push_back(sequence);
+    }
+    printf("same batches for the same seed[%d]\n", sequences[0] == sequences[1]);
+
+    delete data;
+    delete label;
+    return 0;
+}
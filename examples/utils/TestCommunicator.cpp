@@ -0,0 +1,45 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 23:40
+ * Last modified : 2026-10-18 23:40
+ * Filename      : TestCommunicator.cpp
+ * Description   : 
+ **********************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "utils/Communicator.h"
+
+int main(int argc, char** argv){
+    uint num_workers = argc > 1 ? atoi(argv[1]) : 4;
+    const uint size = 1000003;
+
+    //rank r holds (r + 1) * i, the sum is i * n * (n + 1) / 2
+    auto worker = [size](ccma::utils::Communicator* communicator){
+        uint rank = communicator->get_rank();
+        uint n = communicator->get_size();
+        std::vector<double> data(size);
+        for(uint i = 0; i != size; i++){
+            data[i] = (double)(rank + 1) * i;
+        }
+        for(uint k = 0; k != 3; k++){
+            if(!communicator->all_reduce(data.data(), size)){
+                return 1;
+            }
+            for(uint i = 0; i != size; i++){
+                data[i] /= n;
+            }
+        }
+
+        uint num_wrong = 0;
+        for(uint i = 0; i != size; i++){
+            if(data[i] != (double)i * (n + 1) / 2){
+                num_wrong++;
+            }
+        }
+        printf("rank[%d/%d] wrong[%d]\n", rank, n, num_wrong);
+        return num_wrong == 0 ? 0 : 1;
+    };
+
+    printf("all workers ok[%d]\n", ccma::utils::launch_local(num_workers, worker));
+}
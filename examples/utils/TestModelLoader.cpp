@@ -6,6 +6,7 @@
  * Description   : 
  **********************************************/
 #include <string>
+#include <string.h>
 #include "utils/ModelLoader.h"
 
 int main(int argc, char** argv){
@@ -31,4 +32,28 @@ int main(int argc, char** argv){
         m->display();
         delete m;
     }
+
+    //nonzeros only, every 10th element of m2 is kept
+    for(uint i = 0; i != m2.get_size(); i++){
+        if(i % 10 != 0){
+            m2.get_data()[i] = 0;
+        }
+    }
+    const std::string sparse_path = "data/test_sparse.model";
+    loader.write<real>(&m2, sparse_path, false, "testmode", true);
+    loader.read<real>(sparse_path, &ms, "testmode");
+    printf("sparse read equal: %d\n", ms.size() == 1 && ms[0]->get_size() == m2.get_size()
+            && memcmp(ms[0]->get_data(), m2.get_data(), sizeof(real) * m2.get_size()) == 0);
+    for(auto&& m : ms){
+        delete m;
+    }
+
+    //dense matrices of the mapped file are used in place
+    std::shared_ptr<ccma::utils::MappedFile> mapping;
+    loader.map<real>(path, &ms, &mapping, "testmode");
+    printf("mapped read equal: %d\n", ms.size() == 2 && ms[0]->get_size() == m1.get_size()
+            && memcmp(ms[0]->get_data(), m1.get_data(), sizeof(real) * m1.get_size()) == 0);
+    for(auto&& m : ms){
+        delete m;
+    }
 }
@@ -0,0 +1,44 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 10:40
+ * Last modified : 2026-10-18 10:40
+ * Filename      : TestThreadPool.cpp
+ * Description   : 
+ **********************************************/
+#include <stdio.h>
+#include <vector>
+#include "utils/ThreadPool.h"
+
+int main(int argc, char** argv){
+    ccma::utils::ThreadPool pool(4);
+    printf("threads[%d]\n", pool.get_num_thread());
+
+    const uint num_task = 100;
+    std::vector<uint> values(num_task, 0);
+
+    auto task = [&values](uint task_id){
+        values[task_id] = task_id * task_id;
+    };
+    for(uint k = 0; k != 1000; k++){
+        pool.parallel_for(num_task, task);
+    }
+
+    uint sum = 0;
+    for(auto v : values){
+        sum += v;
+    }
+    printf("sum[%d] expected[%d]\n", sum, 328350);
+
+    //parallel_for inside a task runs serially
+    std::vector<uint> counts(4, 0);
+    auto outer_task = [&pool, &counts](uint task_id){
+        auto inner_task = [&counts, task_id](uint){
+            counts[task_id]++;
+        };
+        pool.parallel_for(10, inner_task);
+    };
+    pool.parallel_for(4, outer_task);
+    for(uint i = 0; i != counts.size(); i++){
+        printf("nested[%d][%d]\n", i, counts[i]);
+    }
+}
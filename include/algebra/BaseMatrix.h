@@ -417,6 +417,25 @@ public:
     explicit DenseZeroMatrixT(uint rows):DenseMatrixMNT<T>(rows, 1, 0){}
 };//class DenseZeroMatrixT
 
+/*
+ * rows x cols window on a buffer owned elsewhere, e.g. one layer of a
+ * flat parameter buffer. the buffer is not freed and must outlive the
+ * view. values may be written(set_data of the same size copies), but
+ * the view must not be resized.
+ */
+template<class T>
+class DenseMatrixViewT : public DenseMatrixT<T>{
+public:
+    DenseMatrixViewT(T* data, uint rows, uint cols):DenseMatrixT<T>(){
+        this->_data = data;
+        this->_rows = rows;
+        this->_cols = cols;
+    }
+    ~DenseMatrixViewT(){
+        this->_data = nullptr;
+    }
+};//class DenseMatrixViewT
+
 template<class T>
 class DenseEyeMatrixT : public DenseMatrixT<T>{
 public:
@@ -0,0 +1,255 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 11:05
+ * Last modified : 2026-10-18 11:05
+ * Filename      : MatrixKernel.h
+ * Description   : allocation free kernels on raw row major buffers
+ **********************************************/
+
+#ifndef _CCMA_ALGEBRA_MATRIXKERNEL_H_
+#define _CCMA_ALGEBRA_MATRIXKERNEL_H_
+
+#include "utils/TypeDef.h"
+
+namespace ccma{
+namespace algebra{
+
+/*
+ * activation applied by the fused dense layer kernels.
+ * SOFTMAX is row wise and only meant for the output layer, its
+ * jacobian is folded into the cross entropy cost, so the backward
+ * kernel treats its derivative as 1.
+ * LEAKY_RELU uses a slope of LEAKY_RELU_SLOPE for negative inputs.
+ */
+enum class Activation{
+    SIGMOID,
+    TANH,
+    RELU,
+    SOFTMAX,
+    LINEAR,
+    LEAKY_RELU
+};
+
+#define LEAKY_RELU_SLOPE 0.01
+
+/*
+ * All buffers are row major and owned by the caller.
+ * Output buffers are overwritten and must not alias the inputs.
+ * None of these kernels allocates memory, they are meant for
+ * training loops running on preallocated workspaces.
+ */
+
+/*
+ * C(m,n) = A(m,k) * B(k,n)
+ */
+template<class T>
+void gemm(const T* a, const T* b, T* c, uint m, uint k, uint n);
+
+/*
+ * C(k,n) = A(m,k).T * B(m,n)
+ */
+template<class T>
+void gemm_tn(const T* a, const T* b, T* c, uint m, uint k, uint n);
+
+/*
+ * C(m,k) = A(m,n) * B(k,n).T
+ */
+template<class T>
+void gemm_nt(const T* a, const T* b, T* c, uint m, uint n, uint k);
+
+/*
+ * add row vector(1,n) to every row of A(m,n)
+ */
+template<class T>
+void add_row(T* a, const T* row, uint m, uint n);
+
+/*
+ * out(1,n) = sum of the rows of A(m,n)
+ */
+template<class T>
+void col_sum(const T* a, T* out, uint m, uint n);
+
+template<class T>
+void sigmoid(T* a, uint size);
+
+/*
+ * a(m,n) = act(a) in place
+ */
+template<class T>
+void activate(T* a, uint m, uint n, Activation act);
+
+/*
+ * fused dense layer forward, one pass over the output:
+ * z(m,n) = A(m,k) * W(k,n) + b(1,n)
+ * out(m,n) = act(z)
+ * bias and activation are applied to each output row while it is
+ * still in L1. z may be nullptr when the pre-activation is not
+ * needed(inference).
+ */
+template<class T>
+void dense_forward(const T* a,
+                   const T* w,
+                   const T* b,
+                   T* z,
+                   T* out,
+                   uint m,
+                   uint k,
+                   uint n,
+                   Activation act);
+
+/*
+ * dense_forward of a CSR input a(m, k): row_ptr(m + 1 absolute offsets),
+ * col_idx and values. out row i is the bias plus the weight rows of
+ * the nonzeros of a row i, the cost scales with nnz instead of k.
+ */
+template<class T>
+void sparse_dense_forward(const uint* row_ptr,
+                          const uint* col_idx,
+                          const T* values,
+                          const T* w,
+                          const T* b,
+                          T* z,
+                          T* out,
+                          uint m,
+                          uint n,
+                          Activation act);
+
+/*
+ * c(k, n) += a.T * b(m, n) for a CSR a(m, k), only the rows of c
+ * matching a column with a nonzero are touched.
+ */
+template<class T>
+void sparse_gemm_tn(const uint* row_ptr, const uint* col_idx, const T* values, const T* b, T* c, uint m, uint n);
+
+/*
+ * dense_forward with a sparse weight w(k, n), e.g. a pruned layer.
+ * w is given by column: col_ptr(n + 1 offsets), row_idx and values
+ * list the nonzero weights of every output unit, i.e. w.T as CSR.
+ * the rows of a are taken SPARSE_FORWARD_BLOCK at a time and
+ * transposed into buffer(k * SPARSE_FORWARD_BLOCK), so every nonzero
+ * weight meets the inputs of the whole block in one contiguous run.
+ * the cost scales with the nonzero weights.
+ */
+#define SPARSE_FORWARD_BLOCK 8
+
+template<class T>
+void dense_sparse_forward(const T* a,
+                          const uint* col_ptr,
+                          const uint* row_idx,
+                          const T* values,
+                          const T* b,
+                          T* z,
+                          T* out,
+                          T* buffer,
+                          uint m,
+                          uint k,
+                          uint n,
+                          Activation act);
+
+/*
+ * fused dense layer backward:
+ * pre_delta(m,k) = (delta(m,n) * W(k,n).T) ⊙ mask ⊙ act'(a_in)
+ * a_in(m,k) is the activation of the layer below, the derivative is
+ * taken from it, act'(z) is never materialized.
+ * mask(m,k) is the dropout mask applied to a_in, nullptr if none.
+ */
+template<class T>
+void dense_backward(const T* delta,
+                    const T* w,
+                    const T* a_in,
+                    T* pre_delta,
+                    uint m,
+                    uint n,
+                    uint k,
+                    Activation act,
+                    const T* mask = nullptr);
+
+/*
+ * delta(size) *= act'(a), the derivative taken from the activation
+ * a = act(z) like dense_backward
+ */
+template<class T>
+void derivative(T* delta, const T* a, uint size, Activation act);
+
+/*
+ * convolution windows of an image a(rows, cols, channels), channels
+ * innermost(NHWC), as the rows of a matrix so a convolution is a gemm:
+ * out(out_rows * out_cols, size * size * channels), row y * out_cols + x
+ * is the size x size window at (y * stride, x * stride) in
+ * (row, col, channel) order. pixels past the image read 0.
+ */
+template<class T>
+void im2row(const T* a, T* out, uint rows, uint cols, uint channels, uint size, uint stride, uint out_rows, uint out_cols);
+
+/*
+ * adjoint of im2row: every window element of patches is added to its
+ * pixel of a(rows, cols, channels), which is not cleared first.
+ */
+template<class T>
+void row2im(const T* patches, T* a, uint rows, uint cols, uint channels, uint size, uint stride, uint out_rows, uint out_cols);
+
+/*
+ * batch normalization over the m rows of z(m,n):
+ * z_hat = (z - mean) / sqrt(var + epsilon), written back to z
+ * out = gamma * z_hat + beta
+ * the batch mean, var and inv_std = 1 / sqrt(var + epsilon) of every
+ * column are written to mean(n), var(n) and inv_std(n).
+ */
+template<class T>
+void batch_norm_forward(T* z,
+                        T* out,
+                        const T* gamma,
+                        const T* beta,
+                        T* mean,
+                        T* var,
+                        T* inv_std,
+                        uint m,
+                        uint n,
+                        T epsilon);
+
+/*
+ * backward of batch_norm_forward, delta(m,n) holds dC/dout on input
+ * and dC/dz on output. grad_gamma(n) and grad_beta(n) are overwritten.
+ */
+template<class T>
+void batch_norm_backward(T* delta,
+                         const T* z_hat,
+                         const T* gamma,
+                         const T* inv_std,
+                         T* grad_gamma,
+                         T* grad_beta,
+                         uint m,
+                         uint n);
+
+/*
+ * inverted dropout of size elements:
+ * mask = 0 with probability rate else 1 / (1 - rate), out = a * mask
+ * the random numbers are a hash of seed and the element index, the
+ * mask only depends on seed, never on the thread running it.
+ */
+template<class T>
+void dropout(const T* a, T* out, T* mask, uint size, T rate, unsigned long long seed);
+
+/*
+ * fused softmax and cross entropy of the logits z(m, n) and targets
+ * y(m, n) row by row:
+ * a = softmax(z), delta = a - y, returns -sum(y * log_softmax(z))
+ * log_softmax = z - max - log(sum(exp(z - max))) never takes the log
+ * of a probability, so the loss stays finite for any logits.
+ * a and delta are optional and may alias z, nothing is allocated.
+ */
+template<class T>
+T softmax_cross_entropy(const T* z, const T* y, T* a, T* delta, uint m, uint n);
+
+/*
+ * sum of x[i]^2 in one read only pass, accumulated in double over
+ * four independent lanes. a NaN or Inf in x makes the result NaN or
+ * Inf, so the squared norm doubles as a finiteness check.
+ */
+template<class T>
+double sum_square(const T* x, uint size);
+
+}//namespace algebra
+}//namespace ccma
+
+#endif //_CCMA_ALGEBRA_MATRIXKERNEL_H_
@@ -0,0 +1,106 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 20:10
+ * Last modified : 2026-10-18 20:10
+ * Filename      : SparseMatrix.h
+ * Description   : compressed sparse row matrix
+ **********************************************/
+
+#ifndef _CCMA_ALGEBRA_SPARSEMATRIX_H_
+#define _CCMA_ALGEBRA_SPARSEMATRIX_H_
+
+#include <vector>
+#include "algebra/BaseMatrix.h"
+
+namespace ccma{
+namespace algebra{
+
+/*
+ * CSR matrix, the entries of row i are
+ *     col_idx[row_ptr[i], row_ptr[i + 1]) and values[...]
+ * with ascending column indices. rows are only appended, e.g. one
+ * index/value list per sample of one-hot or categorical features.
+ * row_ptr holds absolute offsets, so &row_ptr[i] is a valid CSR view
+ * of the rows from i on.
+ */
+template<class T>
+class SparseMatrixT{
+public:
+    explicit SparseMatrixT(uint cols = 0) : _cols(cols), _row_ptr(1, 0){}
+
+    inline uint get_rows() const { return _row_ptr.size() - 1;}
+    inline uint get_cols() const { return _cols;}
+    inline uint get_nnz() const { return _col_idx.size();}
+    inline uint get_row_nnz(uint row) const { return _row_ptr[row + 1] - _row_ptr[row];}
+
+    inline const uint* get_row_ptr() const { return _row_ptr.data();}
+    inline const uint* get_col_idx() const { return _col_idx.data();}
+    inline const T* get_values() const { return _values.data();}
+
+    /*
+     * drop all rows, the buffers keep their capacity
+     */
+    inline void clear(uint cols){
+        _cols = cols;
+        _row_ptr.resize(1);
+        _col_idx.clear();
+        _values.clear();
+    }
+
+    inline void reserve(uint rows, uint nnz){
+        _row_ptr.reserve(rows + 1);
+        _col_idx.reserve(nnz);
+        _values.reserve(nnz);
+    }
+
+    /*
+     * append a row of nnz entries, idx ascending
+     */
+    inline void add_row(const uint* idx, const T* value, uint nnz){
+        _col_idx.insert(_col_idx.end(), idx, idx + nnz);
+        _values.insert(_values.end(), value, value + nnz);
+        _row_ptr.push_back(_col_idx.size());
+    }
+
+    /*
+     * append row of src
+     */
+    inline void add_row(const SparseMatrixT<T>* src, uint row){
+        uint start = src->_row_ptr[row];
+        add_row(&src->_col_idx[start], &src->_values[start], src->get_row_nnz(row));
+    }
+
+    /*
+     * the nonzeros of a dense matrix, or of its transpose if is_transpose
+     */
+    void from_dense(BaseMatrixT<T>* mat, bool is_transpose = false){
+        uint rows = mat->get_rows();
+        uint cols = mat->get_cols();
+        const T* data = mat->get_data();
+        clear(is_transpose ? rows : cols);
+
+        uint outer = is_transpose ? cols : rows;
+        uint inner = is_transpose ? rows : cols;
+        for(uint i = 0; i != outer; i++){
+            for(uint j = 0; j != inner; j++){
+                T value = is_transpose ? data[j * cols + i] : data[i * cols + j];
+                if(value != 0){
+                    _col_idx.push_back(j);
+                    _values.push_back(value);
+                }
+            }
+            _row_ptr.push_back(_col_idx.size());
+        }
+    }
+
+private:
+    uint _cols;
+    std::vector<uint> _row_ptr;
+    std::vector<uint> _col_idx;
+    std::vector<T> _values;
+};//class SparseMatrixT
+
+}//namespace algebra
+}//namespace ccma
+
+#endif //_CCMA_ALGEBRA_SPARSEMATRIX_H_
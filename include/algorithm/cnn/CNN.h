@@ -9,39 +9,135 @@
 #ifndef _CCMA_ALGORITHM_CNN_CNN_H_
 #define _CCMA_ALGORITHM_CNN_CNN_H_
 
+#include <memory>
+#include <string>
 #include "algebra/BaseMatrix.h"
+#include "algorithm/cnn/InferenceEngine.h"
 #include "algorithm/cnn/Layer.h"
+#include "algorithm/nn/GradientClip.h"
+#include "utils/MappedFile.h"
+#include "utils/ModelLoader.h"
+#include "utils/ThreadPool.h"
 
 namespace ccma{
 namespace algorithm{
 namespace cnn{
 class CNN{
 public:
-    CNN(){}
+    /*
+     * path(optional) is the checkpoint of train: the model is written
+     * there after every epoch, load_model(path) resumes from it.
+     */
+    CNN(const std::string& path = ""){
+        _path = path;
+        _pool = new ccma::utils::ThreadPool();
+    }
     ~CNN(){
         for(auto layer : _layers){
             delete layer;
         }
         _layers.clear();
+        delete _pool;
     }
 
     bool add_layer(Layer* layer);
+
+    /*
+     * mini batch gradient descent: every mini_batch_size rows run
+     * through the layers together and the weights take one step along
+     * the mean gradient of the batch. mini_batch_size 1 is online
+     * learning. epoch more epochs are run, numbered on from
+     * get_num_epochs(), e.g. after load_model of a checkpoint.
+     */
     void train(ccma::algebra::BaseMatrixT<real>* train_data,
                ccma::algebra::BaseMatrixT<real>* train_label,
                uint epoch = 1,
                ccma::algebra::BaseMatrixT<real>* test_data = nullptr,
-               ccma::algebra::BaseMatrixT<real>* test_label = nullptr);
-    //void predict(ccma::algebra::BaseMatrixT<real>* predict_data);
+               ccma::algebra::BaseMatrixT<real>* test_label = nullptr,
+               uint mini_batch_size = 1);
+
+    /*
+     * frozen copy of the current weights for prediction, owned by the
+     * caller: conv -> bias -> activation -> pooling fused and all
+     * intermediates in one preplanned arena(InferenceEngine). the cnn
+     * can go on training afterwards. nullptr if the network is
+     * incomplete.
+     */
+    InferenceEngine* export_engine();
+
+    /*
+     * step size of every layer(default 0.1), a larger mini batch
+     * usually wants a larger one.
+     */
+    void set_learning_rate(real eta);
+
+    /*
+     * number of worker threads of the layers(default all cores). the
+     * results do not depend on it, the work is split by fixed blocks
+     * of rows and reduced in block order.
+     */
+    void set_num_thread(uint num_thread);
+
+    /*
+     * fuse every ConvolutionLayer with a SubSamplingLayer right above
+     * it(ConvolutionLayer::fuse_pooling): the same results without the
+     * full resolution activation, faster and smaller in inference and
+     * with max pooling.
+     */
+    void set_fuse_pooling(bool fuse_pooling);
+
+    /*
+     * clip the mean gradient of every batch to a global L2 norm of
+     * max_norm(0 no clipping), and skip the batches with a NaN/Inf
+     * gradient instead of applying them.
+     */
+    inline void set_clip_norm(real max_norm, bool skip_nonfinite = true){
+        _clip.set_max_norm(max_norm);
+        _clip.set_skip_nonfinite(skip_nonfinite);
+    }
+    inline unsigned long long get_num_skipped() const { return _clip.get_num_skipped();}
+
+    /*
+     * epochs trained so far, saved with the model
+     */
+    inline uint get_num_epochs() const { return _num_epochs;}
+
+    /*
+     * "CNNMODEL": a (num_layers, 5) matrix of type/size/stride or
+     * scale/channels/pooling per layer, a (1, 4) training state of
+     * epochs/learning rate/clip norm/skip nonfinite, then weight and
+     * bias of every convolution and full connection layer.
+     * load_model replaces the layers by the ones of the file and
+     * restores the training state, so train goes on where the writer
+     * stopped. the weights are used in place from a copy-on-write
+     * mapping of the file(ModelLoader::map).
+     */
+    bool load_model(const std::string& path);
+    bool write_model(const std::string& path);
 protected:
     void feed_forward(ccma::algebra::BaseMatrixT<real>* mat, bool debug = false);
     void back_propagation(ccma::algebra::BaseMatrixT<real>* mat, bool debug = false);
 
 private:
-    bool check(uint size);
-    bool evaluate(ccma::algebra::BaseMatrixT<real>* data, ccma::algebra::BaseMatrixT<real>* label, bool debug = false);
+    bool check(uint size, uint label_size);
+    /*
+     * number of rows of data whose argmax output equals label
+     */
+    uint evaluate(ccma::algebra::BaseMatrixT<real>* data,
+                  ccma::algebra::BaseMatrixT<real>* label,
+                  uint mini_batch_size,
+                  bool debug = false);
 
 private:
     std::vector<Layer*> _layers;
+    ccma::algorithm::nn::GradientClip _clip;
+    ccma::utils::ThreadPool* _pool;
+    bool _fuse_pooling = false;
+
+    std::string _path;
+    uint _num_epochs = 0;
+    ccma::utils::ModelLoader loader;
+    std::shared_ptr<ccma::utils::MappedFile> _mapping;
 
 };//class CNN
 
@@ -0,0 +1,154 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-19 10:30
+ * Last modified : 2026-10-19 10:30
+ * Filename      : InferenceEngine.h
+ * Description   : inference only cnn with a preplanned arena
+ **********************************************/
+
+#ifndef _CCMA_ALGORITHM_CNN_INFERENCEENGINE_H_
+#define _CCMA_ALGORITHM_CNN_INFERENCEENGINE_H_
+
+#include <vector>
+#include "algebra/BaseMatrix.h"
+#include "algebra/MatrixKernel.h"
+#include "algorithm/cnn/Layer.h"
+
+namespace ccma{
+namespace algorithm{
+namespace cnn{
+
+/*
+ * frozen copy of a trained cnn for prediction(CNN::export_engine).
+ * the layers are compiled into a list of ops:
+ *     convolution    im2row + bias + activation of one image, with the
+ *                    pooling right above fused in(band by band, the
+ *                    full resolution map is never written)
+ *     pooling        a pooling not above a convolution
+ *     full connection
+ * every intermediate of a block of _block images has a fixed place in
+ * one arena, planned once from the liveness of the tensors: two
+ * tensors share memory whenever no op needs both of them. the arena
+ * belongs to the calling thread and only grows, so after the first
+ * call predict_batch allocates nothing, and any number of threads can
+ * run it at the same time.
+ */
+class InferenceEngine{
+public:
+    /*
+     * input images of rows * cols, one channel
+     */
+    InferenceEngine(uint rows, uint cols) : _rows(rows), _cols(cols), _channels(1), _input_size(rows * cols){}
+    ~InferenceEngine();
+
+    InferenceEngine(const InferenceEngine&) = delete;
+    InferenceEngine& operator=(const InferenceEngine&) = delete;
+
+    /*
+     * weight(kernal_size^2 * channels, out_channel_size) and bias
+     * (out_channel_size) as in ConvolutionLayer, both copied.
+     */
+    bool add_convolution(ccma::algebra::BaseMatrixT<real>* weight,
+                         ccma::algebra::BaseMatrixT<real>* bias,
+                         uint kernal_size,
+                         uint stride,
+                         ccma::algebra::Activation activation);
+    /*
+     * fused into the convolution before it if there is one. the
+     * pooling is copied(Pooling::clone).
+     */
+    bool add_pooling(const Pooling* pooling, uint scale);
+    /*
+     * weight(current size, size) and bias(size), copied
+     */
+    bool add_full_connection(ccma::algebra::BaseMatrixT<real>* weight,
+                             ccma::algebra::BaseMatrixT<real>* bias,
+                             ccma::algebra::Activation activation);
+
+    inline uint get_input_size() const { return _input_size;}
+    inline uint get_output_size() const { return _rows * _cols * _channels;}
+    inline uint get_num_ops() const { return _ops.size();}
+    //elements of the arena of one thread
+    inline uint get_arena_size() const { return _arena_size;}
+
+    /*
+     * rows of data(rows, input size) to out_probability(rows, output
+     * size), out_label(optional, rows) the argmax of every row. runs on
+     * the calling thread.
+     */
+    bool predict_batch(const real* data,
+                       uint rows,
+                       real* out_probability,
+                       uint* out_label = nullptr) const;
+    /*
+     * out_probability is resized to (rows, output size) if needed
+     */
+    bool predict_batch(ccma::algebra::BaseMatrixT<real>* data,
+                       ccma::algebra::BaseMatrixT<real>* out_probability,
+                       std::vector<uint>* out_label = nullptr) const;
+
+private:
+    enum OpType{
+        CONVOLUTION,
+        POOLING,
+        FULL_CONNECTION
+    };
+
+    /*
+     * shapes are (rows, cols, channels) of one image, channels
+     * innermost. a convolution computes (rows, cols, channels), which
+     * its pooling reduces to (out_rows, out_cols, channels).
+     */
+    struct Op{
+        OpType type;
+        uint in_rows, in_cols, in_channels;
+        uint rows, cols, channels;
+        uint out_rows, out_cols;
+        uint kernal_size = 0;
+        uint stride = 0;
+        ccma::algebra::Activation activation = ccma::algebra::Activation::LINEAR;
+        //offsets of the weight and the bias in _params
+        uint weight = 0;
+        uint bias = 0;
+        Pooling* pooling = nullptr;
+        uint scale = 1;
+        //offsets in the arena, set by plan
+        uint in_offset = 0;
+        uint out_offset = 0;
+        uint patch_offset = 0;
+        uint tile_offset = 0;
+
+        inline uint get_in_size() const { return in_rows * in_cols * in_channels;}
+        inline uint get_out_size() const { return out_rows * out_cols * channels;}
+    };
+
+    uint add_params(ccma::algebra::BaseMatrixT<real>* mat);
+    /*
+     * places every intermediate of a block in the arena, greedy by
+     * size: a tensor takes the lowest offset that does not overlap a
+     * placed tensor live at the same time. rerun after every op added.
+     */
+    void plan();
+    void run(const Op& op, const real* in, real* out, real* arena, uint block_rows) const;
+
+private:
+    //shape of the last op output
+    uint _rows;
+    uint _cols;
+    uint _channels;
+    uint _input_size;
+
+    std::vector<Op> _ops;
+    std::vector<real> _params;
+    uint _arena_size = 0;
+
+    const uint _block = 64;
+    //arena offsets are aligned to a cache line
+    const uint _align = 64 / sizeof(real);
+};//class InferenceEngine
+
+}//namespace cnn
+}//namespace algorithm
+}//namespace ccma
+
+#endif
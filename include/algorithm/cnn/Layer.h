@@ -11,45 +11,121 @@
 
 #include <vector>
 #include "algebra/BaseMatrix.h"
+#include "algebra/MatrixKernel.h"
+#include "utils/ThreadPool.h"
 
 namespace ccma{
 namespace algorithm{
 namespace cnn{
 
+/*
+ * pools one image a(rows * scale, cols * scale, channels), channels
+ * innermost, into out(rows, cols, channels) over scale x scale
+ * windows of every channel.
+ * a pooling that selects one element of every window(has_argmax)
+ * writes its index in a to argmax(rows * cols * channels) if given,
+ * the backward pass routes the whole error of an output there.
+ * backward writes pre_delta = dC/da(rows * scale, cols * scale,
+ * channels) from delta = dC/dout, a and out of the forward pass. a is
+ * not read by the poolings with argmax and may be nullptr for them.
+ * the loops run over the channels of a pixel innermost, which are
+ * contiguous and vectorize, 2x2 and 3x3 windows are unrolled.
+ */
 class Pooling{
 public:
     virtual ~Pooling(){}
-    virtual void pool(ccma::algebra::BaseMatrixT<real>* mat,
+    virtual void pool(const real* a,
                       uint rows,
                       uint cols,
+                      uint channels,
                       uint scale,
-                      ccma::algebra::BaseMatrixT<real>* pooling_mat) = 0;
+                      real* out,
+                      uint* argmax = nullptr) = 0;
+    virtual void backward(const real* a,
+                          const real* out,
+                          const real* delta,
+                          const uint* argmax,
+                          uint rows,
+                          uint cols,
+                          uint channels,
+                          uint scale,
+                          real* pre_delta) = 0;
+    virtual bool has_argmax() const { return false;}
+    //a new pooling of the same type
+    virtual Pooling* clone() const = 0;
 };//class Pooling
 class MeanPooling : public Pooling{
 public:
-    void pool(ccma::algebra::BaseMatrixT<real>* mat,
+    void pool(const real* a,
               uint rows,
               uint cols,
+              uint channels,
               uint scale,
-              ccma::algebra::BaseMatrixT<real>* pooling_mat);
+              real* out,
+              uint* argmax = nullptr);
+    void backward(const real* a,
+                  const real* out,
+                  const real* delta,
+                  const uint* argmax,
+                  uint rows,
+                  uint cols,
+                  uint channels,
+                  uint scale,
+                  real* pre_delta);
+    Pooling* clone() const { return new MeanPooling();}
 };//class MeanPooling
 class MaxPooling : public Pooling{
 public:
-    void pool(ccma::algebra::BaseMatrixT<real>* mat,
+    void pool(const real* a,
               uint rows,
               uint cols,
+              uint channels,
               uint scale,
-              ccma::algebra::BaseMatrixT<real>* pooling_mat);
+              real* out,
+              uint* argmax = nullptr);
+    void backward(const real* a,
+                  const real* out,
+                  const real* delta,
+                  const uint* argmax,
+                  uint rows,
+                  uint cols,
+                  uint channels,
+                  uint scale,
+                  real* pre_delta);
+    bool has_argmax() const { return true;}
+    Pooling* clone() const { return new MaxPooling();}
 };//class MaxPooling
 class L2Pooling : public Pooling{
 public:
-    void pool(ccma::algebra::BaseMatrixT<real>* mat,
+    void pool(const real* a,
               uint rows,
               uint cols,
+              uint channels,
               uint scale,
-              ccma::algebra::BaseMatrixT<real>* pooling_mat);
+              real* out,
+              uint* argmax = nullptr);
+    void backward(const real* a,
+                  const real* out,
+                  const real* delta,
+                  const uint* argmax,
+                  uint rows,
+                  uint cols,
+                  uint channels,
+                  uint scale,
+                  real* pre_delta);
+    Pooling* clone() const { return new L2Pooling();}
 };//class L2Pooling
 
+/*
+ * a layer runs a whole mini batch at once. its activation and delta
+ * are (batch size, get_size()) matrices, a row holds the feature maps
+ * of one sample with the channels innermost(NHWC), so the rows of the
+ * layer before FullConnectionLayer are its input vectors as they are.
+ * the delta of a layer is dC/d(activation) times the derivative of its
+ * activation function(dC/dz for convolution and full connection).
+ * back_propagation keeps the gradients of the weights summed over the
+ * batch and writes the delta of pre_layer.
+ */
 class Layer{
 public:
     Layer(uint rows,
@@ -67,9 +143,15 @@ public:
             _bias = nullptr;
         }
 
+        if(_grad_bias != nullptr){
+            delete _grad_bias;
+            _grad_bias = nullptr;
+        }
+
         clear_vector_matrix(&_weights);
-        clear_vector_matrix(&_activations);
-        clear_vector_matrix(&_deltas);
+        clear_vector_matrix(&_grad_weights);
+        delete _activation;
+        delete _delta;
     }
 
     virtual bool initialize(Layer* pre_layer = nullptr) = 0;
@@ -96,21 +178,23 @@ public:
     inline void set_out_channel_size(uint out_channel_size){_out_channel_size = out_channel_size;}
     inline uint get_out_channel_size(){return _out_channel_size;}
 
-    //activation size equal out_channel_size
-    inline void set_activation(uint out_channel_id, ccma::algebra::BaseMatrixT<real>* activation){
-        set_vec_mat(&_activations, out_channel_id, activation);
-    }
-    inline ccma::algebra::BaseMatrixT<real>* get_activation(uint out_channel_id){
-        return _activations[out_channel_id];
-    }
+    /*
+     * activation columns of one sample
+     */
+    virtual uint get_size(){ return _rows * _cols * _out_channel_size;}
 
-    //delta size equal out_channel_size
-    inline void set_delta(uint out_channel_id, ccma::algebra::BaseMatrixT<real>* delta){
-        set_vec_mat(&_deltas, out_channel_id, delta);
-    }
-    inline ccma::algebra::BaseMatrixT<real>* get_delta(uint out_channel_id){
-        return _deltas[out_channel_id];
-    }
+    /*
+     * (batch size, get_size()) of the last mini batch
+     */
+    inline ccma::algebra::BaseMatrixT<real>* get_activation(){ return _activation;}
+    inline ccma::algebra::BaseMatrixT<real>* get_delta(){ return _delta;}
+    inline uint get_batch_size(){ return _batch_size;}
+
+    /*
+     * activation function of the outputs, the layer above multiplies
+     * the delta it passes down by its derivative.
+     */
+    inline ccma::algebra::Activation get_activation_type(){ return _activation_type;}
 
     //weight size equal in_channel_size * out_channel_size
     inline void set_weight(uint in_channel_id,
@@ -130,6 +214,50 @@ public:
     }
     inline ccma::algebra::BaseMatrixT<real>* get_bias(){ return _bias;}
 
+    /*
+     * worker threads of the layer, owned by the network. nullptr runs
+     * everything on the calling thread.
+     */
+    inline void set_pool(ccma::utils::ThreadPool* pool){ _pool = pool;}
+
+    inline void set_alpha(real alpha){ _alpha = alpha;}
+    inline real get_alpha() const { return _alpha;}
+
+    /*
+     * back_propagation only keeps the gradients of the weights and the
+     * bias, so the network can check all of them(norm, NaN/Inf) before
+     * any layer changes. apply_gradients does w -= alpha * ratio * grad,
+     * ratio is 1 / batch size for the mean gradient of a mini batch.
+     */
+    double grad_square_sum();
+    void apply_gradients(real ratio = 1.0);
+
+protected:
+    /*
+     * gradient buffers shaped like the weight and the bias, allocated
+     * on first use, the kernels overwrite them.
+     */
+    ccma::algebra::BaseMatrixT<real>* get_grad_weight(uint in_channel_id, uint out_channel_id);
+    ccma::algebra::BaseMatrixT<real>* get_grad_bias();
+
+    /*
+     * activation and delta to batch_size rows, only reallocated when
+     * the batch size changes(the last batch of an epoch).
+     */
+    void resize(uint batch_size);
+    static void resize(ccma::algebra::BaseMatrixT<real>* mat, uint rows, uint cols);
+
+    template<class F>
+    void parallel_for(uint num_task, F& func){
+        if(_pool == nullptr){
+            for(uint i = 0; i != num_task; i++){
+                func(i);
+            }
+            return;
+        }
+        _pool->parallel_for(num_task, func);
+    }
+
 private:
     inline void clear_vector_matrix(std::vector<ccma::algebra::BaseMatrixT<real>*>* vec_mat){
         for(auto mat : *vec_mat){
@@ -159,16 +287,25 @@ protected:
     /* current_layer feature channel size*/
     uint _out_channel_size;
     std::vector<ccma::algebra::BaseMatrixT<real>*> _weights;
-    ccma::algebra::BaseMatrixT<real>* _bias;
+    ccma::algebra::BaseMatrixT<real>* _bias = nullptr;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _grad_weights;
+    ccma::algebra::BaseMatrixT<real>* _grad_bias = nullptr;
+
+    ccma::algebra::BaseMatrixT<real>* _activation = new ccma::algebra::DenseMatrixT<real>();
+    ccma::algebra::BaseMatrixT<real>* _delta = new ccma::algebra::DenseMatrixT<real>();
+    ccma::algebra::Activation _activation_type = ccma::algebra::Activation::LINEAR;
+    ccma::utils::ThreadPool* _pool = nullptr;
+    uint _batch_size = 0;
 
     real _alpha = 0.1;
 private:
-    std::vector<ccma::algebra::BaseMatrixT<real>*> _activations;
-    std::vector<ccma::algebra::BaseMatrixT<real>*> _deltas;
-
     bool _is_last_layer = true;
 };//class Layer
 
+/*
+ * input of the network, a mini batch of (batch size, rows * cols)
+ * images, one sample per row.
+ */
 class DataLayer:public Layer{
 public:
     DataLayer(uint rows, uint cols):Layer(rows, cols, 1, 1){}
@@ -180,7 +317,7 @@ public:
     void back_propagation(Layer* pre_layer, Layer* back_layer = nullptr, bool debug = false);
 
     bool set_x(ccma::algebra::BaseMatrixT<real>* x){
-        if(x->get_rows() == this->_rows && x->get_cols() == this->_cols){
+        if(x->get_cols() == this->_rows * this->_cols){
             _x = x;
             return true;
         }
@@ -188,7 +325,7 @@ public:
         return false;
     }
 private:
-    ccma::algebra::BaseMatrixT<real>* _x;
+    ccma::algebra::BaseMatrixT<real>* _x = nullptr;
 };//class DataLayer
 
 class SubSamplingLayer:public Layer{
@@ -205,41 +342,112 @@ public:
     void back_propagation(Layer* pre_layer, Layer* back_layer = nullptr, bool debug = false);
 
     uint get_scale(){return _scale;}
+    inline Pooling* get_pooling(){ return _pooling;}
+
+    /*
+     * set by ConvolutionLayer::fuse_pooling, the convolution below
+     * writes the activation of this layer and feed_forward is a no-op.
+     */
+    inline void set_fused(bool is_fused){ _is_fused = is_fused;}
+    inline bool is_fused() const { return _is_fused;}
+
+    /*
+     * activation, delta and argmax to batch_size rows
+     */
+    void prepare(uint batch_size);
+
+    //(batch size, get_size()) window index of every max pooled output
+    inline uint* get_argmax(){ return _argmax.data();}
 
 protected:
     uint _scale;
 private:
     Pooling* _pooling;
+    std::vector<uint> _argmax;
+    bool _is_fused = false;
 };//class SubsamplingLayer
 
 
+/*
+ * sigmoid convolution, every output channel sums the kernels over all
+ * input channels. the weight is one (kernal_size * kernal_size *
+ * in_channel_size, out_channel_size) matrix and the windows of the
+ * whole batch are unrolled into the rows of _patches(im2row), so the
+ * forward pass and both gradients are each one gemm over the batch.
+ * the gemms run on the pool in blocks of _block_rows window rows(all
+ * output positions of all samples, so even one sample keeps every
+ * core busy). every block sums its weight gradient into its own row
+ * of _grad_partials, the rows are added in block order afterwards:
+ * the gradient only depends on _block_rows, never on the threads.
+ *
+ * fuse_pooling(the SubSamplingLayer above) makes feed_forward pool
+ * every band of scale output rows while the conv -> bias -> activation
+ * tile is still in L1, straight into the activation of the pooling
+ * layer. the full resolution activation is never written: the max
+ * pooling backward only needs the pooled value at the argmax, the
+ * other poolings recompute it from the patches(materialize).
+ */
 class ConvolutionLayer:public Layer{
 public:
      ConvolutionLayer(uint kernal_size, uint stride, uint out_channel_size):Layer(0, 0, 1, out_channel_size){
         _kernal_size = kernal_size;
         _stride = stride;
+        _activation_type = ccma::algebra::Activation::SIGMOID;
+    }
+    ~ConvolutionLayer(){
+        delete _patches;
+        delete _grad_partials;
     }
     inline uint get_stride()const {return _stride;}
+    inline uint get_kernal_size()const {return _kernal_size;}
 
     bool initialize(Layer* pre_layer = nullptr);
     void feed_forward(Layer* pre_layer = nullptr, bool debug = false);
     void back_propagation(Layer* pre_layer, Layer* back_layer = nullptr, bool debug = false);
+
+    /*
+     * pool into pooling_layer(the layer above) during feed_forward,
+     * nullptr back to separate passes.
+     */
+    void fuse_pooling(SubSamplingLayer* pooling_layer);
+    inline bool is_fused() const { return _pooling_layer != nullptr;}
+
+    /*
+     * computes the activation of the last fused feed_forward
+     */
+    void materialize();
 protected:
     uint _stride;
     uint _kernal_size;
+private:
+    void feed_forward_pooled(uint batch_size);
+
+private:
+    SubSamplingLayer* _pooling_layer = nullptr;
+    //(batch size * rows * cols, kernal_size^2 * in_channel_size)
+    ccma::algebra::BaseMatrixT<real>* _patches = new ccma::algebra::DenseMatrixT<real>();
+    //(number of blocks, weight size + out_channel_size)
+    ccma::algebra::BaseMatrixT<real>* _grad_partials = new ccma::algebra::DenseMatrixT<real>();
+
+    const uint _block_rows = 256;
 };//class ConvolutionLayer
 
+/*
+ * output layer, sigmoid outputs trained on the squared error by
+ * default. with softmax the outputs are a softmax over the rows and
+ * the loss is the cross entropy, computed from the logits by the
+ * fused softmax_cross_entropy kernel.
+ * the weight is (pre_layer size, rows), activation(batch size, rows).
+ */
 class FullConnectionLayer:public Layer{
 public:
-    FullConnectionLayer(uint rows):Layer(rows, 0, 0, 1){}
+    FullConnectionLayer(uint rows, bool softmax = false):Layer(rows, 0, 0, 1), _softmax(softmax){
+        _activation_type = softmax ? ccma::algebra::Activation::SOFTMAX : ccma::algebra::Activation::SIGMOID;
+    }
     ~FullConnectionLayer(){
-        if(_av != nullptr){
-            delete _av;
-            _av = nullptr;
-        }
-        if(_error != nullptr){
-            delete _error;
-            _error = nullptr;
+        if(_logits != nullptr){
+            delete _logits;
+            _logits = nullptr;
         }
 
         _y = nullptr;//out pointer, not delete data.
@@ -248,22 +456,31 @@ public:
     void feed_forward(Layer* pre_layer = nullptr, bool debug = false);
     void back_propagation(Layer* pre_layer, Layer* back_layer = nullptr, bool debug = false);
 
+    uint get_size(){ return _rows;}
+
+    /*
+     * y(batch size, rows), the targets of the last feed_forward
+     */
     bool set_y(ccma::algebra::BaseMatrixT<real>* y){
-        if(y->get_rows() == _rows){
+        if(y->get_rows() == get_batch_size() && y->get_cols() == _rows){
             _y = y;
             return true;
         }
+        printf("FullConnectionLayer label dim error\n");
         return false;
     }
 
+    /*
+     * mean loss per sample of the last mini batch
+     */
     real get_loss() const{
         return _loss;
     }
 private:
-    ccma::algebra::BaseMatrixT<real>* _y;
-    ccma::algebra::BaseMatrixT<real>* _av;//pre_layer activations' vector
-    ccma::algebra::BaseMatrixT<real>* _error;
-    real _loss;
+    bool _softmax;
+    ccma::algebra::BaseMatrixT<real>* _y = nullptr;
+    ccma::algebra::BaseMatrixT<real>* _logits = nullptr;//av * w + b of the softmax output
+    real _loss = 0;
 };//class FullConnectionLayer
 
 }//namespace cnn
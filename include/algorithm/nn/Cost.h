@@ -23,6 +23,32 @@ public:
                        ccma::algebra::BaseMatrixT<real>* y,
                        ccma::algebra::BaseMatrixT<real>* out_cost) = 0;
 
+    /*
+     * same as above on raw buffers of size elements, writes out_cost
+     * in place without temporaries. a is sigmoid(z).
+     */
+    virtual void delta(const real* z,
+                       const real* a,
+                       const real* y,
+                       uint size,
+                       real* out_cost) = 0;
+
+    /*
+     * softmax output layer of rows samples: a = softmax(logits) row by
+     * row and out_cost = dC/dlogits. a may alias logits.
+     * the default applies softmax and then delta.
+     */
+    virtual void softmax_delta(const real* logits,
+                               const real* y,
+                               uint rows,
+                               uint cols,
+                               real* a,
+                               real* out_cost);
+
+    /*
+     * columns of a label row for an output layer of cols units
+     */
+    virtual uint label_cols(uint cols){ return cols;}
     void derivative_sigmoid(ccma::algebra::BaseMatrixT<real>* mat);
 };//class Cost
 
@@ -39,6 +65,11 @@ public:
                ccma::algebra::BaseMatrixT<real>* a,
                ccma::algebra::BaseMatrixT<real>* y,
                ccma::algebra::BaseMatrixT<real>* out_cost);
+    void delta(const real* z,
+               const real* a,
+               const real* y,
+               uint size,
+               real* out_cost);
 };//class QuadraticCost
 
 /*
@@ -53,8 +84,49 @@ public:
                ccma::algebra::BaseMatrixT<real>* a,
                ccma::algebra::BaseMatrixT<real>* y,
                ccma::algebra::BaseMatrixT<real>* out_cost);
+    void delta(const real* z,
+               const real* a,
+               const real* y,
+               uint size,
+               real* out_cost);
+
+    /*
+     * fused log softmax and cross entropy, a - y in one pass per row
+     */
+    void softmax_delta(const real* logits,
+                       const real* y,
+                       uint rows,
+                       uint cols,
+                       real* a,
+                       real* out_cost);
 };//class CrossEntropyCost
 
+/*
+ * knowledge distillation on a softmax output, a label row is the hard
+ * label y followed by the soft target q = softmax(z_teacher / T):
+ * C = (1 - alpha) * CE(y, softmax(z)) + alpha * T^2 * KL(q || softmax(z / T))
+ * the T^2 keeps the soft gradient on the scale of the hard one.
+ */
+class DistillationCost:public CrossEntropyCost{
+public:
+    DistillationCost(real temperature, real alpha) : _temperature(temperature), _alpha(alpha){}
+
+    uint label_cols(uint cols){ return 2 * cols;}
+
+    /*
+     * dC/dz = (1 - alpha) * (softmax(z) - y) + alpha * T * (softmax(z / T) - q)
+     */
+    void softmax_delta(const real* logits,
+                       const real* y,
+                       uint rows,
+                       uint cols,
+                       real* a,
+                       real* out_cost);
+private:
+    real _temperature;
+    real _alpha;
+};//class DistillationCost
+
 }//namespace
 }//namespace algorithm
 }//namespace ccma
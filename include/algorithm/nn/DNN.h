@@ -10,12 +10,22 @@
 #ifndef _CCMA_ALGORITHM_NN_DNN_H_
 #define _CCMA_ALGORITHM_NN_DNN_H_
 
+#include <functional>
 #include <vector>
 #include <thread>
 #include "Cost.h"
+#include "DNNLayer.h"
+#include "DNNWorkspace.h"
+#include "GradientClip.h"
+#include "InferenceSession.h"
+#include "Optimizer.h"
+#include "TrainController.h"
 #include "algebra/BaseMatrix.h"
+#include "algebra/SparseMatrix.h"
 #include "utils/MatrixHelper.h"
+#include "utils/Communicator.h"
 #include "utils/ModelLoader.h"
+#include "utils/ThreadPool.h"
 
 namespace ccma{
 namespace algorithm{
@@ -28,21 +38,38 @@ public:
          _num_layers = 0;
          _path = path;
          _cost = new CrossEntropyCost();
+         _optimizer = new SGDOptimizer();
+         _pool = new ccma::utils::ThreadPool(_num_hardware_concurrency);
     }
 
     ~DNN(){
         _sizes.clear();
 
-        clear_parameter(&_weights);
-        _weights.clear();
+        clear_parameters();
+        clear_sparse_weights();
 
-        clear_parameter(&_biases);
-        _biases.clear();
+        clear_workspaces();
 
         delete _cost;
+        delete _optimizer;
+        delete _pool;
     }
 
-    int add_layer(int neural_size);
+    /*
+     * append a layer, the first one is the input.
+     * activation: SIGMOID, TANH, RELU, LEAKY_RELU, LINEAR, or SOFTMAX
+     * for the output layer only. with SOFTMAX or SIGMOID output the
+     * cross entropy delta is a - y, QuadraticCost assumes SIGMOID.
+     * dropout: probability of dropping each output of the layer
+     * while training, the output layer is never dropped.
+     * batch_norm: normalize z over the rows of a shard(set_shard_size)
+     * while training, running statistics are folded into the weights
+     * for inference.
+     */
+    int add_layer(int neural_size,
+                  ccma::algebra::Activation activation = ccma::algebra::Activation::SIGMOID,
+                  real dropout = 0.0,
+                  bool batch_norm = false);
 
     void init_networks_weights();
 
@@ -55,42 +82,438 @@ public:
              ccma::algebra::BaseMatrixT<real>* test_data = nullptr,
              ccma::algebra::BaseMatrixT<real>* test_label = nullptr);
 
+    /*
+     * sgd on sparse inputs, row i of train_data lists the nonzero inputs
+     * of sample i, e.g. one-hot or categorical features.
+     * the first layer is a gather-sum of the weight rows of the nonzeros
+     * and its gradient and update only touch those rows, so its cost
+     * scales with the nonzeros rather than the input width. the first
+     * layer update is lazy: a weight row only sees decay and optimizer
+     * steps in the batches that hit it.
+     * the input layer can not have dropout.
+     */
+    bool sgd(ccma::algebra::SparseMatrixT<real>* train_data,
+             ccma::algebra::BaseMatrixT<real>* train_label,
+             uint epochs,
+             real eta,
+             real lamda = 0.0,
+             uint mini_batch_size = 1,
+             ccma::algebra::SparseMatrixT<real>* test_data = nullptr,
+             ccma::algebra::BaseMatrixT<real>* test_label = nullptr);
+
+    /*
+     * Hogwild! style asynchronous sgd.
+     * every worker walks its own slice of the shuffled rows and applies
+     * each sample's update straight to the shared weights with relaxed
+     * atomic stores, no lock and no barrier per mini batch.
+     * a worker computes gradients on a local copy of the weights which
+     * is refreshed from the shared ones every `staleness` samples.
+     * num_thread = 0 uses all hardware threads.
+     */
+    bool train_async(ccma::algebra::BaseMatrixT<real>* train_data,
+                     ccma::algebra::BaseMatrixT<real>* train_label,
+                     uint epochs,
+                     real eta,
+                     real lamda = 0.0,
+                     uint num_thread = 0,
+                     uint staleness = 1,
+                     ccma::algebra::BaseMatrixT<real>* test_data = nullptr,
+                     ccma::algebra::BaseMatrixT<real>* test_label = nullptr);
+
+    /*
+     * knowledge distillation, trains this(usually narrower) dnn on the
+     * one-hot train_label mixed with the soft targets of teacher by
+     * DistillationCost: alpha weighs the soft part, temperature softens
+     * both distributions. both dnns need a softmax output.
+     * the teacher probabilities come from one batched predict over
+     * train_data, or from soft_target_path if it holds them for the same
+     * rows; a fresh pass is written there. they do not depend on the
+     * temperature, so one file serves every run.
+     * other arguments as sgd.
+     */
+    bool distill(DNN* teacher,
+                 ccma::algebra::BaseMatrixT<real>* train_data,
+                 ccma::algebra::BaseMatrixT<real>* train_label,
+                 uint epochs,
+                 real eta,
+                 real lamda = 0.0,
+                 uint mini_batch_size = 1,
+                 real temperature = 4.0,
+                 real alpha = 0.7,
+                 ccma::algebra::BaseMatrixT<real>* test_data = nullptr,
+                 ccma::algebra::BaseMatrixT<real>* test_label = nullptr,
+                 const std::string& soft_target_path = "");
 
     void feedforward(ccma::algebra::BaseMatrixT<real>* mat);
 
+    /*
+     * batched inference of data(rows, sizes[0]).
+     * out_probability is resized to (rows, sizes[-1]) and gets the output
+     * layer activation, out_label(optional) the argmax class of each row.
+     * rows run through all layers in blocks small enough to stay in
+     * cache, the blocks are spread over the worker threads.
+     */
+    bool predict_batch(ccma::algebra::BaseMatrixT<real>* data,
+                       ccma::algebra::BaseMatrixT<real>* out_probability,
+                       std::vector<uint>* out_label = nullptr);
+    bool predict_batch(ccma::algebra::SparseMatrixT<real>* data,
+                       ccma::algebra::BaseMatrixT<real>* out_probability,
+                       std::vector<uint>* out_label = nullptr);
+
+    /*
+     * immutable copy of the inference weights(batch norm folded, sparse
+     * layers as CSR) for InferenceSession, owned by the caller.
+     * nullptr if the dnn has no weights.
+     */
+    InferenceModel* export_model();
+
+    /*
+     * the InferenceModel of a model file without building a dnn: the
+     * file is mapped and the dense weights are used in place, so it
+     * opens in O(1) and serving processes share one page cache copy.
+     * only batch norm layers(folded) and sparse stored weights are
+     * copied. nullptr if the file can not be read.
+     */
+    static InferenceModel* map_model(const std::string& path, real sparse_density = 0.2);
+
+    /*
+     * number of rows of test_data whose predicted class equals the
+     * class index in test_label(rows, 1)
+     */
     int evaluate(ccma::algebra::BaseMatrixT<real>* test_data, ccma::algebra::BaseMatrixT<real>* test_label);
+    int evaluate(ccma::algebra::SparseMatrixT<real>* test_data, ccma::algebra::BaseMatrixT<real>* test_label);
+
+    /*
+     * magnitude pruning of the trained weights, the sparsity fraction
+     * (0..1) of the smallest |w| of every weight layer is set to zero.
+     * sgd keeps the pruned weights at zero afterwards, so a few more
+     * epochs fine tune the remaining ones. init_networks_weights and
+     * load_model drop the masks.
+     */
+    void prune(real sparsity);
+
+    /*
+     * N:M structured pruning, of every m consecutive inputs of an output
+     * unit only the n largest |w| are kept.
+     */
+    void prune_n_m(uint n, uint m);
 
+    /*
+     * fraction of zero weights over all weight layers
+     */
+    real get_sparsity();
+
+    /*
+     * layers whose inference weights have at most this fraction of
+     * nonzeros run feedforward and predict_batch on CSR weights.
+     * 0 always uses the dense weights.
+     */
+    inline void set_sparse_density(real density){ _sparse_density = density; _is_folded = false;}
+
+    /*
+     * write_model stores every weight matrix that is sparse enough as
+     * its nonzeros only, e.g. after prune.
+     */
     bool load_model(const std::string& path);
     bool write_model(const std::string& path);
 
+    /*
+     * number of worker threads used by mini_batch_update.
+     */
+    void set_num_thread(uint num_thread);
+
+    /*
+     * rows of a mini batch handled by one gradient buffer.
+     * the batch gradient only depends on the shard size, never on the
+     * number of threads, so training is bit-reproducible on any machine.
+     */
+    inline void set_shard_size(uint shard_size){ _shard_size = shard_size == 0 ? 1 : shard_size;}
+
+    /*
+     * update rule used by sgd, default SGDOptimizer.
+     * the dnn takes the ownership of optimizer.
+     * train_async always applies plain sgd updates.
+     */
+    void set_optimizer(Optimizer* optimizer);
+
+    /*
+     * seed of the batch shuffling and the dropout masks. with a fixed
+     * seed sgd visits the same batches and draws the same masks on
+     * every run, whatever the number of threads is.
+     * without a seed the shuffling is drawn from std::random_device.
+     */
+    inline void set_seed(uint seed){ _seed = seed; _is_seeded = true;}
+
+    /*
+     * mini batches sgd keeps in flight, 2 gathers the next batch while
+     * the current one trains, 3 allows one more batch of slack.
+     */
+    inline void set_prefetch_depth(uint depth){ _prefetch_depth = depth < 2 ? 2 : depth;}
+
+    /*
+     * learning rate schedule of sgd, applied per mini batch to the
+     * eta passed to sgd. the dnn takes the ownership of schedule,
+     * nullptr restores the constant rate.
+     */
+    inline void set_schedule(LRSchedule* schedule){ _controller.set_schedule(schedule);}
+
+    /*
+     * stop sgd once the validation accuracy did not improve by more
+     * than min_delta for patience validations, 0 trains every epoch.
+     */
+    inline void set_early_stopping(uint patience, real min_delta = 0.0){ _controller.set_early_stopping(patience, min_delta);}
+
+    /*
+     * validate every frequency epochs on num_rows rows sampled once
+     * from the test data, 0 uses all of it. the model is written to
+     * the model path only when the validation accuracy improves.
+     */
+    inline void set_validation(uint num_rows, uint frequency = 1){ _controller.set_validation(num_rows, frequency);}
+
+    /*
+     * gradient checkpointing, keep the activations of every interval-th
+     * layer only and recompute the others during the backward pass.
+     * 0 or 1 keeps every layer. gradients are the same in both modes.
+     */
+    inline void set_checkpoint_interval(uint interval){ _checkpoint_interval = interval == 0 ? 1 : interval;}
+
+    /*
+     * bytes the activation buffers of all shards may take, the smallest
+     * checkpoint interval that fits is picked when training starts.
+     * 0 disables the budget and uses set_checkpoint_interval.
+     */
+    inline void set_memory_budget(size_t bytes){ _memory_budget = bytes;}
+
+    /*
+     * clip the mini batch gradient to a global L2 norm of max_norm(0 no
+     * clipping), and skip the steps with a NaN/Inf gradient instead of
+     * applying them. checked in one read only pass over the gradients.
+     */
+    inline void set_clip_norm(real max_norm, bool skip_nonfinite = true){
+        _clip.set_max_norm(max_norm);
+        _clip.set_skip_nonfinite(skip_nonfinite);
+    }
+    inline unsigned long long get_num_skipped() const { return _clip.get_num_skipped();}
+
+    /*
+     * data parallel replicas in several processes, e.g. the workers of
+     * utils::launch_local. sgd trains on the rank-th of get_size()
+     * equal slices of its train data and sums the gradients of every
+     * mini batch over all replicas by a ring all-reduce, so the
+     * replicas keep identical weights and together train like one
+     * process with a get_size() times larger mini batch. sgd starts
+     * from the parameters of rank 0, only rank 0 prints progress and
+     * writes the model.
+     * nullptr trains alone, the dnn does not take the ownership.
+     */
+    inline void set_communicator(ccma::utils::Communicator* communicator){ _communicator = communicator;}
+
 private:
-    void mini_batch_update(ccma::algebra::BaseMatrixT<real>* mini_batch_data,
+    /*
+     * epoch loop shared by the dense and sparse sgd: train_batch(epoch,
+     * batch, eta) runs one mini batch, validate() returns the number of
+     * correct validation rows. handles the schedule, validation, early
+     * stopping and checkpoints of _controller.
+     * false if a batch failed.
+     */
+    bool train_epochs(uint num_train_data,
+                      uint num_batches,
+                      uint epochs,
+                      real eta,
+                      uint mini_batch_size,
+                      uint num_validation,
+                      const std::function<bool(uint, uint, real)>& train_batch,
+                      const std::function<int()>& validate);
+
+    /*
+     * validation rows sampled once from num_rows test rows
+     */
+    void sample_validation(uint num_rows, uint num_validation, std::vector<uint>* rows);
+
+    /*
+     * exactly one of mini_batch_data and sparse_data is set.
+     * false if the all-reduce between replicas failed.
+     */
+    bool mini_batch_update(ccma::algebra::BaseMatrixT<real>* mini_batch_data,
+                           ccma::algebra::SparseMatrixT<real>* sparse_data,
                            ccma::algebra::BaseMatrixT<real>* mini_batch_label,
                            real eta,
                            real lamda,
                            uint num_train_data);
 
-    void back_propagation(ccma::algebra::BaseMatrixT<real>* train_data,
-                          ccma::algebra::BaseMatrixT<real>* train_label,
-                          std::vector<ccma::algebra::BaseMatrixT<real>*>* batch_weights,
-                          std::vector<ccma::algebra::BaseMatrixT<real>*>* batch_biases);
+    /*
+     * the input rows are data, or rows [sparse_start, sparse_start + rows)
+     * of sparse_data if data is nullptr
+     */
+    void back_propagation(const real* data,
+                          const ccma::algebra::SparseMatrixT<real>* sparse_data,
+                          uint sparse_start,
+                          const real* label,
+                          uint rows,
+                          std::vector<ccma::algebra::BaseMatrixT<real>*>* weights,
+                          std::vector<ccma::algebra::BaseMatrixT<real>*>* biases,
+                          DNNWorkspace* workspace,
+                          unsigned long long seed);
+
+    bool check_structure(uint train_cols, uint label_cols, uint test_cols);
+    bool soft_targets(DNN* teacher,
+                      ccma::algebra::BaseMatrixT<real>* train_data,
+                      const std::string& path,
+                      ccma::algebra::BaseMatrixT<real>* probability);
+
+    bool predict(const real* data,
+                 const ccma::algebra::SparseMatrixT<real>* sparse_data,
+                 uint rows,
+                 ccma::algebra::BaseMatrixT<real>* out_probability,
+                 std::vector<uint>* out_label);
+    int num_correct(const std::vector<uint>& predict_label, ccma::algebra::BaseMatrixT<real>* label);
+
+    void relaxed_copy(ccma::algebra::BaseMatrixT<real>* src, ccma::algebra::BaseMatrixT<real>* dst);
+    void relaxed_update(ccma::algebra::BaseMatrixT<real>* param,
+                        ccma::algebra::BaseMatrixT<real>* grad,
+                        real decay,
+                        real eta);
+
+    void init_workspaces(uint num_shards);
+    uint checkpoint_interval(uint num_shards);
+    void clear_workspaces();
+    void all_reduce(uint num_shards);
+    double grad_square_sum(bool is_sparse);
+    bool broadcast_replicas();
+    bool replica_all_reduce(ParameterBuffer* buffer, real scale);
+    inline bool is_root() const { return _communicator == nullptr || _communicator->get_rank() == 0;}
 
     void init_parameter(std::vector<ccma::algebra::BaseMatrixT<real>*>* weight_parameter,
                         std::vector<ccma::algebra::BaseMatrixT<real>*>* biases_parameter);
 
     void clear_parameter(std::vector<ccma::algebra::BaseMatrixT<real>*>* parameters);
 
+    bool has_batch_norm();
+    void init_parameters();
+    void clear_parameters();
+    void update_running_stat(uint num_shards);
+
+    /*
+     * inference weights, batch norm layers folded into w and b, and the
+     * CSR copy of the sparse ones. rebuilt once the weights changed.
+     */
+    void prepare_inference();
+    void fold_batch_norm();
+    static void fold_layer(const real* weight, const real* bias,
+                           const real* gamma, const real* beta,
+                           const real* mean, const real* var,
+                           uint rows, uint cols,
+                           real* folded_weight, real* folded_bias);
+    void build_sparse_weights();
+    void clear_sparse_weights();
+
+    /*
+     * layers of the matrices of a model file(load_model, map_model),
+     * false unless the config is valid and the file holds exactly the
+     * matrices of those layers in the stored shapes. nothing is
+     * changed before it succeeded.
+     */
+    static bool parse_model(const std::vector<ccma::algebra::BaseMatrixT<real>*>& models,
+                            bool is_graph,
+                            const std::string& path,
+                            std::vector<DNNLayer>* layers);
+
+    /*
+     * masks of the zero weights after a prune, apply_prune_masks zeroes
+     * them again after an update
+     */
+    void update_prune_masks();
+    void apply_prune_masks();
+    inline ccma::algebra::BaseMatrixT<real>* get_infer_weight(uint layer){
+        return _folded_weights[layer] == nullptr ? _weights[layer] : _folded_weights[layer];
+    }
+    inline ccma::algebra::BaseMatrixT<real>* get_infer_bias(uint layer){
+        return _folded_biases[layer] == nullptr ? _biases[layer] : _folded_biases[layer];
+    }
+
+    unsigned long long dropout_seed(uint start_row);
+
 private:
     uint _num_layers;
     std::vector<uint> _sizes;
+    std::vector<DNNLayer> _layers;
     std::string _path;
     Cost* _cost;
+    Optimizer* _optimizer;
+    TrainController _controller;
 
     const uint _num_hardware_concurrency = std::thread::hardware_concurrency() == 0 ? 1 : std::thread::hardware_concurrency();
 
+    /*
+     * all trained parameters in the layout_parameters layout, the same
+     * as the workspace gradients, so the optimizer, the gradient
+     * reductions and the replica broadcast stream over flat buffers.
+     * _weights, _biases, _gammas and _betas are views into it, the
+     * running mean/var views into _running_stats.
+     */
+    ParameterBuffer _params;
+    ParameterBuffer _running_stats;
+
     std::vector<ccma::algebra::BaseMatrixT<real>*> _weights;
     std::vector<ccma::algebra::BaseMatrixT<real>*> _biases;
 
+    /*
+     * per weight layer, nullptr unless layers[i + 1] has batch norm.
+     * gamma/beta are trained, the running mean/var are the momentum
+     * averages of the shard statistics.
+     */
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _gammas;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _betas;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _running_means;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _running_vars;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _folded_weights;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _folded_biases;
+    bool _is_folded = false;
+    const real _batch_norm_momentum = 0.9;
+    static constexpr real _batch_norm_epsilon = 1e-5;
+
+    /*
+     * per weight layer, the nonzeros of the transposed inference weight
+     * (dense_sparse_forward) or nullptr if the layer is denser than
+     * _sparse_density.
+     */
+    std::vector<ccma::algebra::SparseMatrixT<real>*> _sparse_weights;
+    real _sparse_density = 0.2;
+
+    /*
+     * per weight layer, 1 for the pruned weights, empty if not pruned
+     */
+    std::vector<std::vector<char> > _prune_masks;
+
+    uint _seed = 0;
+    bool _is_seeded = false;
+    uint _prefetch_depth = 2;
+    unsigned long long _num_step = 0;
+
+    /*
+     * one workspace per shard of the mini batch, kept across batches,
+     * the gradients are reduced into workspace 0 by all_reduce.
+     */
+    uint _shard_size = 8;
+    std::vector<DNNWorkspace*> _workspaces;
+
+    uint _checkpoint_interval = 1;
+    size_t _memory_budget = 0;
+
+    GradientClip _clip;
+    std::vector<double> _grad_partials;
+
+    ccma::utils::ThreadPool* _pool;
+
+    ccma::utils::Communicator* _communicator = nullptr;
+
+    /*
+     * rows of one predict_batch block and the ping-pong activation
+     * buffers of every predict task, grown on demand.
+     */
+    const uint _predict_block = 64;
+    std::vector<real> _predict_buffer;
+
     ccma::utils::ModelLoader loader;
     ccma::utils::MatrixHelper helper;
 };//class DNN
@@ -0,0 +1,54 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 16:05
+ * Last modified : 2026-10-18 16:05
+ * Filename      : DNNLayer.h
+ * Description   : configuration of one layer of the dnn
+ **********************************************/
+
+#ifndef _CCMA_ALGORITHM_NN_DNNLAYER_H_
+#define _CCMA_ALGORITHM_NN_DNNLAYER_H_
+
+#include "algebra/MatrixKernel.h"
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+/*
+ * layer 0 is the input, its activation and batch_norm are ignored.
+ * layer l > 0 computes
+ *     z = a_l-1 * w + b
+ *     z = batch_norm(z)        if batch_norm
+ *     a_l = activation(z)
+ * and during training its output a_l is dropped out with probability
+ * dropout before the next layer reads it.
+ */
+class DNNLayer{
+public:
+    DNNLayer(uint size = 0,
+             ccma::algebra::Activation activation = ccma::algebra::Activation::SIGMOID,
+             real dropout = 0.0,
+             bool batch_norm = false){
+        this->size          = size;
+        this->activation    = activation;
+        this->dropout       = dropout;
+        this->batch_norm    = batch_norm;
+    }
+
+    inline bool operator==(const DNNLayer& layer) const{
+        return size == layer.size && activation == layer.activation
+            && dropout == layer.dropout && batch_norm == layer.batch_norm;
+    }
+
+    uint size;
+    ccma::algebra::Activation activation;
+    real dropout;
+    bool batch_norm;
+};//class DNNLayer
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
+
+#endif
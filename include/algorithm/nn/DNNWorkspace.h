@@ -0,0 +1,202 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 11:40
+ * Last modified : 2026-10-18 11:40
+ * Filename      : DNNWorkspace.h
+ * Description   : preallocated buffers of one DNN training shard
+ **********************************************/
+
+#ifndef _CCMA_ALGORITHM_NN_DNNWORKSPACE_H_
+#define _CCMA_ALGORITHM_NN_DNNWORKSPACE_H_
+
+#include <vector>
+#include "DNNLayer.h"
+#include "ParameterBuffer.h"
+#include "algebra/BaseMatrix.h"
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+/*
+ * allocates the parameters of the network of layers in buffer and
+ * appends their views, gamma/beta are nullptr for the layers without
+ * batch norm. the layout is shared by the DNN parameters and the
+ * workspace gradients: the weights of all layers first, i.e. the L2
+ * decayed range [0, buffer->get_offset(layers.size() - 1)), then the
+ * biases, then gamma/beta of the batch norm layers.
+ */
+void layout_parameters(const std::vector<DNNLayer>& layers,
+                       ParameterBuffer* buffer,
+                       std::vector<ccma::algebra::BaseMatrixT<real>*>* weights,
+                       std::vector<ccma::algebra::BaseMatrixT<real>*>* biases,
+                       std::vector<ccma::algebra::BaseMatrixT<real>*>* gammas,
+                       std::vector<ccma::algebra::BaseMatrixT<real>*>* betas);
+
+/*
+ * Everything back_propagation needs for up to max_rows samples:
+ * per layer pre-activation z, activation a, error delta and the
+ * weight/bias gradients. Sized once from the layers and reused
+ * for every batch and epoch, so training does not touch the heap.
+ *
+ * layer i is the i-th weight layer, layers[i] -> layers[i + 1],
+ * z/a/delta of layer i are (max_rows, layers[i + 1].size) row major.
+ * if layers[i + 1] has batch norm, z holds the normalized z_hat and
+ * the batch statistics and gamma/beta gradients of layer i are kept.
+ * if layers[i] has dropout, the mask and the dropped output read by
+ * weight layer i are (max_rows, layers[i].size).
+ *
+ * delta is only read by the layer below, so two buffers are swapped
+ * between the layers.
+ *
+ * gradient checkpointing: with checkpoint_interval k > 1 only every
+ * k-th layer(i % k == k - 1) and the output layer keep their own
+ * z/a/dropout buffers. the other layers of a segment share k - 1 slot
+ * buffers with the same layers of every other segment, the backward
+ * pass recomputes a segment from the checkpoint below it before
+ * walking through it.
+ */
+class DNNWorkspace{
+public:
+    DNNWorkspace(const std::vector<DNNLayer>& layers, uint max_rows, uint checkpoint_interval = 1);
+    ~DNNWorkspace();
+
+    DNNWorkspace(const DNNWorkspace&) = delete;
+    DNNWorkspace& operator=(const DNNWorkspace&) = delete;
+
+    /*
+     * true if this workspace can run a network of layers with max_rows.
+     */
+    bool fit(const std::vector<DNNLayer>& layers, uint max_rows, uint checkpoint_interval = 1) const;
+
+    inline uint get_max_rows() const { return _max_rows;}
+    inline uint get_checkpoint_interval() const { return _checkpoint_interval;}
+
+    /*
+     * true if weight layer keeps its activations through the backward pass
+     */
+    inline bool is_checkpoint(uint layer) const{
+        return layer + 1 == _layers.size() - 1 || (layer + 1) % _checkpoint_interval == 0;
+    }
+
+    /*
+     * first weight layer of the segment ending at checkpoint layer
+     */
+    inline uint get_segment_start(uint layer) const { return layer - layer % _checkpoint_interval;}
+
+    inline real* get_z(uint layer){ return _z_data[layer];}
+    inline real* get_activation(uint layer){ return _activation_data[layer];}
+    inline real* get_delta(uint layer){ return _deltas[layer & 1]->get_data();}
+
+    inline ccma::algebra::BaseMatrixT<real>* get_grad_weight(uint layer){ return _grad_weights[layer];}
+    inline ccma::algebra::BaseMatrixT<real>* get_grad_bias(uint layer){ return _grad_biases[layer];}
+
+    inline std::vector<ccma::algebra::BaseMatrixT<real>*>* get_grad_weights(){ return &_grad_weights;}
+    inline std::vector<ccma::algebra::BaseMatrixT<real>*>* get_grad_biases(){ return &_grad_biases;}
+
+    /*
+     * dropout buffers of layers[layer], nullptr without dropout
+     */
+    inline real* get_dropout_mask(uint layer){ return _dropout_mask_data[layer];}
+    inline real* get_dropout_out(uint layer){ return _dropout_out_data[layer];}
+
+    /*
+     * batch norm buffers of weight layer i, nullptr without batch norm
+     */
+    inline real* get_batch_mean(uint layer){ return get_data(_batch_means[layer]);}
+    inline real* get_batch_var(uint layer){ return get_data(_batch_vars[layer]);}
+    inline real* get_batch_inv_std(uint layer){ return get_data(_batch_inv_stds[layer]);}
+    inline ccma::algebra::BaseMatrixT<real>* get_grad_gamma(uint layer){ return _grad_gammas[layer];}
+    inline ccma::algebra::BaseMatrixT<real>* get_grad_beta(uint layer){ return _grad_betas[layer];}
+
+    /*
+     * sparse input: weight layer 0 gradient rows are only written for
+     * the inputs hit by the rows of the batch, the active rows. the
+     * other rows stay zero, clear_active_rows zeroes the active ones
+     * again before the next batch.
+     */
+    void set_sparse_input(bool sparse_input);
+    inline bool is_sparse_input() const { return _is_sparse_input;}
+    inline std::vector<uint>* get_active_rows(){ return &_active_rows;}
+    void clear_active_rows();
+
+    /*
+     * true if row was not active yet
+     */
+    inline bool mark_active_row(uint row){
+        if(_is_active[row]){
+            return false;
+        }
+        _is_active[row] = 1;
+        _active_rows.push_back(row);
+        return true;
+    }
+
+    /*
+     * all gradients in the layout_parameters layout, the views above
+     * point into it.
+     */
+    inline ParameterBuffer* get_grads(){ return &_grads;}
+
+    /*
+     * bytes held by the workspace buffers.
+     */
+    size_t get_bytes() const;
+
+    /*
+     * bytes of the z/a/delta/dropout buffers of a workspace built with
+     * these arguments, i.e. the memory checkpointing trades.
+     */
+    static size_t get_activation_bytes(const std::vector<DNNLayer>& layers, uint max_rows, uint checkpoint_interval);
+
+    /*
+     * multiply-add flops the backward pass spends recomputing
+     * activations for rows samples.
+     */
+    static size_t get_recompute_flops(const std::vector<DNNLayer>& layers, uint rows, uint checkpoint_interval);
+
+private:
+    inline real* get_data(ccma::algebra::BaseMatrixT<real>* mat){ return mat == nullptr ? nullptr : mat->get_data();}
+    void clear(std::vector<ccma::algebra::BaseMatrixT<real>*>* mats);
+
+private:
+    std::vector<DNNLayer> _layers;
+    uint _max_rows;
+    uint _checkpoint_interval;
+
+    /*
+     * owned buffers, the per layer ones of checkpoint layers followed
+     * by the shared slots, and the per layer views into them.
+     */
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _zs;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _activations;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _deltas;
+    std::vector<real*> _z_data;
+    std::vector<real*> _activation_data;
+    std::vector<real*> _dropout_mask_data;
+    std::vector<real*> _dropout_out_data;
+
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _dropout_masks;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _dropout_outs;
+
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _batch_means;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _batch_vars;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _batch_inv_stds;
+
+    //views into _grads
+    ParameterBuffer _grads;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _grad_weights;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _grad_biases;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _grad_gammas;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _grad_betas;
+
+    bool _is_sparse_input = false;
+    std::vector<uint> _active_rows;
+    std::vector<char> _is_active;
+};//class DNNWorkspace
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
+
+#endif
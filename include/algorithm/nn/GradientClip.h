@@ -0,0 +1,74 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-19 01:30
+ * Last modified : 2026-10-19 01:30
+ * Filename      : GradientClip.h
+ * Description   : global gradient norm clipping and non-finite
+ *                 step guard shared by the nn trainers
+ **********************************************/
+
+#ifndef _CCMA_ALGORITHM_NN_GRADIENTCLIP_H_
+#define _CCMA_ALGORITHM_NN_GRADIENTCLIP_H_
+
+#include <cmath>
+#include "utils/TypeDef.h"
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+/*
+ * decides one update step from the squared L2 norm of all its summed
+ * gradients(ccma::algebra::sum_square over every gradient buffer):
+ *     double sq_sum = ...;
+ *     real ratio;
+ *     if(!clip.check(sq_sum, grad_scale, &ratio)) skip the step;
+ *     apply the gradients scaled by grad_scale * ratio
+ * grad_scale is the factor the trainer applies anyway(e.g. 1 / batch
+ * size), the norm is the one of the applied gradient. ratio scales it
+ * down to max_norm if it is larger, 1 otherwise or with max_norm 0.
+ * a NaN/Inf gradient fails the check and is counted, the caller
+ * skips the update so the weights are never poisoned.
+ * the caller only needs the pass if is_enabled().
+ */
+class GradientClip{
+public:
+    inline void set_max_norm(real max_norm){ _max_norm = max_norm;}
+    inline real get_max_norm() const { return _max_norm;}
+
+    inline void set_skip_nonfinite(bool skip_nonfinite){ _skip_nonfinite = skip_nonfinite;}
+    inline bool get_skip_nonfinite() const { return _skip_nonfinite;}
+    inline bool is_enabled() const { return _max_norm > 0 || _skip_nonfinite;}
+
+    inline unsigned long long get_num_skipped() const { return _num_skipped;}
+    inline real get_last_norm() const { return _last_norm;}
+
+    bool check(double sq_sum, real grad_scale, real* ratio){
+        *ratio = 1.0;
+        double norm = std::sqrt(sq_sum) * grad_scale;
+        _last_norm = norm;
+        if(!std::isfinite(norm)){
+            if(_skip_nonfinite){
+                _num_skipped++;
+                return false;
+            }
+            return true;
+        }
+        if(_max_norm > 0 && norm > _max_norm){
+            *ratio = _max_norm / norm;
+        }
+        return true;
+    }
+
+private:
+    real _max_norm = 0;
+    bool _skip_nonfinite = true;
+    unsigned long long _num_skipped = 0;
+    real _last_norm = 0;
+};//class GradientClip
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
+
+#endif
@@ -0,0 +1,151 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-19 02:10
+ * Last modified : 2026-10-19 02:10
+ * Filename      : InferenceSession.h
+ * Description   : read only dnn snapshot for concurrent serving
+ **********************************************/
+
+#ifndef _CCMA_ALGORITHM_NN_INFERENCESESSION_H_
+#define _CCMA_ALGORITHM_NN_INFERENCESESSION_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "algebra/BaseMatrix.h"
+#include "algebra/MatrixKernel.h"
+#include "algebra/SparseMatrix.h"
+#include "utils/MappedFile.h"
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+class DNN;
+
+/*
+ * immutable inference weights of a dnn, copied or used in place from a
+ * mapped model file: batch norm folded into the weights, layers sparse
+ * enough as CSR, no training state.
+ * predict only reads the model and keeps its activations in a scratch
+ * buffer of the calling thread, so any number of threads can run it
+ * at the same time without a lock.
+ */
+class InferenceModel{
+public:
+    /*
+     * mapping(optional) is the mapped model file the weights may alias,
+     * kept alive as long as the model.
+     */
+    InferenceModel(uint input_size, std::shared_ptr<ccma::utils::MappedFile> mapping = nullptr)
+        : _sizes(1, input_size), _mapping(mapping){}
+
+    InferenceModel(const InferenceModel&) = delete;
+    InferenceModel& operator=(const InferenceModel&) = delete;
+
+    /*
+     * append a layer computing activation(a * weight + bias), weight is
+     * (last size, n) and bias (1, n). views(DenseMatrixViewT) on the
+     * mapping are used in place, other matrices are copied. is_sparse
+     * keeps the weight as CSR for dense_sparse_forward.
+     */
+    void add_layer(ccma::algebra::BaseMatrixT<real>* weight,
+                   ccma::algebra::BaseMatrixT<real>* bias,
+                   ccma::algebra::Activation activation,
+                   bool is_sparse);
+
+    inline uint get_input_size() const { return _sizes.front();}
+    inline uint get_output_size() const { return _sizes.back();}
+    inline uint get_num_layers() const { return _activations.size();}
+
+    /*
+     * rows of data(rows, input size) or of the CSR sparse_data to
+     * out_probability(rows, output size), out_label(optional, rows) the
+     * argmax class of each row. runs on the calling thread.
+     */
+    bool predict(const real* data,
+                 const ccma::algebra::SparseMatrixT<real>* sparse_data,
+                 uint rows,
+                 real* out_probability,
+                 uint* out_label) const;
+
+private:
+    std::vector<uint> _sizes;
+    std::vector<ccma::algebra::Activation> _activations;
+    std::vector<const real*> _weights;
+    std::vector<const real*> _biases;
+    std::vector<std::vector<real> > _buffers;
+    std::shared_ptr<ccma::utils::MappedFile> _mapping;
+    std::vector<ccma::algebra::SparseMatrixT<real> > _sparse_weights;
+    std::vector<char> _is_sparse;
+
+    const uint _block = 64;
+};//class InferenceModel
+
+/*
+ * serving front of a dnn, safe to share between threads:
+ *     InferenceSession session(&dnn);        or session("dnn.model")
+ *     session.predict(data, probability);    from any thread
+ *     session.reload("dnn.model");           from any thread
+ * every predict pins the current model for its duration. swap and
+ * reload publish a new model RCU style: the pointer is replaced
+ * atomically, requests in flight finish on the old model, which is
+ * freed by the last of them. a predict never waits for a swap.
+ */
+class InferenceSession{
+public:
+    InferenceSession(){}
+    explicit InferenceSession(DNN* dnn){ swap(dnn);}
+    explicit InferenceSession(const std::string& path){ reload(path);}
+
+    InferenceSession(const InferenceSession&) = delete;
+    InferenceSession& operator=(const InferenceSession&) = delete;
+
+    /*
+     * out_probability is resized to (rows, output size), same results
+     * as DNN::predict_batch.
+     */
+    bool predict(ccma::algebra::BaseMatrixT<real>* data,
+                 ccma::algebra::BaseMatrixT<real>* out_probability,
+                 std::vector<uint>* out_label = nullptr) const;
+    bool predict(const ccma::algebra::SparseMatrixT<real>* data,
+                 ccma::algebra::BaseMatrixT<real>* out_probability,
+                 std::vector<uint>* out_label = nullptr) const;
+
+    /*
+     * publish a snapshot of the current weights of dnn, the dnn can go
+     * on training afterwards. false if it has no weights.
+     */
+    bool swap(DNN* dnn);
+
+    /*
+     * map a model file written by DNN::write_model and publish it, the
+     * current model stays in place if the file can not be loaded.
+     * the weights are used in place from the mapping(DNN::map_model).
+     */
+    bool reload(const std::string& path);
+
+    /*
+     * the current model, kept alive as long as the pointer is held
+     */
+    inline std::shared_ptr<const InferenceModel> get_model() const{
+        return std::atomic_load(&_model);
+    }
+
+private:
+    bool predict(const real* data,
+                 const ccma::algebra::SparseMatrixT<real>* sparse_data,
+                 uint rows,
+                 uint cols,
+                 ccma::algebra::BaseMatrixT<real>* out_probability,
+                 std::vector<uint>* out_label) const;
+
+private:
+    std::shared_ptr<const InferenceModel> _model;
+};//class InferenceSession
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
+
+#endif
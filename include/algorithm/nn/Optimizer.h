@@ -0,0 +1,225 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 14:10
+ * Last modified : 2026-10-18 14:10
+ * Filename      : Optimizer.h
+ * Description   : parameter update rules of nn training
+ **********************************************/
+
+#ifndef _CCMA_ALGORITHM_NN_OPTIMIZER_H_
+#define _CCMA_ALGORITHM_NN_OPTIMIZER_H_
+
+#include <vector>
+#include "utils/ThreadPool.h"
+#include "utils/TypeDef.h"
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+/*
+ * An optimizer updates parameter buffers from their summed gradients.
+ * Every parameter buffer is identified by a slot id, the optimizer keeps
+ * its state(velocity, moments...) per slot, allocated zeroed the first
+ * time the slot is updated and kept across steps.
+ *
+ * one training step:
+ *     optimizer->step(eta);
+ *     optimizer->update(slot, param, grad, size, grad_scale, decay, pool);
+ *     ...one update per parameter buffer
+ *
+ * a flat parameter buffer is one slot: reserve(slot, size) once, then
+ * update_range on its ranges, e.g. the decayed weights and the rest.
+ *
+ * the gradient seen by the rule is g = grad * grad_scale + decay * param,
+ * i.e. the averaged batch gradient plus L2 weight decay. Every rule reads
+ * and writes param, grad and its state in a single pass, the buffers are
+ * split in chunks run on the thread pool.
+ */
+class Optimizer{
+public:
+    explicit Optimizer(uint num_state);
+    virtual ~Optimizer();
+
+    Optimizer(const Optimizer&) = delete;
+    Optimizer& operator=(const Optimizer&) = delete;
+
+    /*
+     * start a new step with learning rate eta
+     */
+    void step(real eta);
+
+    void update(uint slot,
+                real* param,
+                const real* grad,
+                uint size,
+                real grad_scale,
+                real decay,
+                ccma::utils::ThreadPool* pool = nullptr);
+
+    /*
+     * state of slot for size elements, zeroed if the size changed
+     */
+    void reserve(uint slot, uint size);
+
+    /*
+     * update of the elements [offset, offset + size) of a reserved
+     * slot, param and grad point to element offset.
+     */
+    void update_range(uint slot,
+                      uint offset,
+                      real* param,
+                      const real* grad,
+                      uint size,
+                      real grad_scale,
+                      real decay,
+                      ccma::utils::ThreadPool* pool = nullptr);
+
+    /*
+     * lazy update of a (size / cols, cols) parameter, only the listed
+     * rows are read and written, e.g. the embedding rows hit by a
+     * sparse batch. the other rows keep their parameters and state.
+     * the parameter starts the slot, which may be reserved larger.
+     */
+    void update_rows(uint slot,
+                     real* param,
+                     const real* grad,
+                     uint size,
+                     const uint* rows,
+                     uint num_rows,
+                     uint cols,
+                     real grad_scale,
+                     real decay,
+                     ccma::utils::ThreadPool* pool = nullptr);
+
+    /*
+     * drop all state, e.g. after the parameters were re-initialized
+     */
+    void reset();
+
+    inline uint get_num_state() const { return _num_state;}
+    inline uint get_num_step() const { return _num_step;}
+
+    /*
+     * raw state buffer idx of slot, nullptr if the slot was never updated
+     */
+    real* get_state(uint slot, uint idx);
+
+protected:
+    /*
+     * fused update of size elements, state[i] points to the state
+     * buffer i at the same offset as param.
+     */
+    virtual void apply(real* param,
+                       const real* grad,
+                       real** state,
+                       uint size,
+                       real grad_scale,
+                       real decay) = 0;
+
+    /*
+     * per step constants, called by step() after eta and num_step are set
+     */
+    virtual void prepare(){}
+
+    static const uint MAX_STATE = 2;
+    static const uint CHUNK_SIZE = 8192;
+
+    uint _num_state;
+    uint _num_step = 0;
+    real _eta = 0;
+
+private:
+    std::vector<uint> _slot_sizes;
+    std::vector<real*> _states;
+};//class Optimizer
+
+/*
+ * p = p - eta * g
+ */
+class SGDOptimizer:public Optimizer{
+public:
+    SGDOptimizer();
+protected:
+    void apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay);
+};//class SGDOptimizer
+
+/*
+ * v = mu * v - eta * g
+ * p = p + v
+ */
+class MomentumOptimizer:public Optimizer{
+public:
+    explicit MomentumOptimizer(real momentum = 0.9);
+protected:
+    void apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay);
+private:
+    real _momentum;
+};//class MomentumOptimizer
+
+/*
+ * v' = mu * v - eta * g
+ * p  = p - mu * v + (1 + mu) * v'
+ * look ahead form of nesterov momentum on the stored parameters
+ */
+class NesterovOptimizer:public Optimizer{
+public:
+    explicit NesterovOptimizer(real momentum = 0.9);
+protected:
+    void apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay);
+private:
+    real _momentum;
+};//class NesterovOptimizer
+
+/*
+ * h = h + g^2
+ * p = p - eta * g / (sqrt(h) + epsilon)
+ */
+class AdaGradOptimizer:public Optimizer{
+public:
+    explicit AdaGradOptimizer(real epsilon = 1e-8);
+protected:
+    void apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay);
+private:
+    real _epsilon;
+};//class AdaGradOptimizer
+
+/*
+ * h = rho * h + (1 - rho) * g^2
+ * p = p - eta * g / (sqrt(h) + epsilon)
+ */
+class RMSPropOptimizer:public Optimizer{
+public:
+    explicit RMSPropOptimizer(real rho = 0.9, real epsilon = 1e-8);
+protected:
+    void apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay);
+private:
+    real _rho;
+    real _epsilon;
+};//class RMSPropOptimizer
+
+/*
+ * m = beta1 * m + (1 - beta1) * g
+ * v = beta2 * v + (1 - beta2) * g^2
+ * p = p - eta_t * m / (sqrt(v) + epsilon)
+ * eta_t = eta * sqrt(1 - beta2^t) / (1 - beta1^t), the bias correction
+ * is folded into the step size once per step.
+ */
+class AdamOptimizer:public Optimizer{
+public:
+    explicit AdamOptimizer(real beta1 = 0.9, real beta2 = 0.999, real epsilon = 1e-8);
+protected:
+    void apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay);
+    void prepare();
+private:
+    real _beta1;
+    real _beta2;
+    real _epsilon;
+    real _step_size = 0;
+};//class AdamOptimizer
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
+
+#endif
@@ -0,0 +1,80 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-19 00:20
+ * Last modified : 2026-10-19 00:20
+ * Filename      : ParameterBuffer.h
+ * Description   : matrices packed in one flat aligned buffer
+ **********************************************/
+
+#ifndef _CCMA_ALGORITHM_NN_PARAMETERBUFFER_H_
+#define _CCMA_ALGORITHM_NN_PARAMETERBUFFER_H_
+
+#include <vector>
+#include "algebra/BaseMatrix.h"
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+/*
+ * one cache line aligned buffer holding a set of matrices, e.g. all
+ * parameters of a network, with a matrix view on each of them:
+ *     buffer.add(rows, cols);     ...once per matrix
+ *     buffer.allocate();
+ *     buffer.get_view(i)          matrix i
+ *     buffer.get_data()           all of them, get_size() elements
+ * every matrix starts at a multiple of ALIGN elements, the padding is
+ * zeroed and stays zero under elementwise passes over the whole
+ * buffer(sums, optimizer updates, scaling). two buffers built by the
+ * same add() calls have the same layout, so e.g. the gradients of a
+ * parameter sit at the same offset in their own buffer.
+ */
+class ParameterBuffer{
+public:
+    ParameterBuffer(){}
+    ~ParameterBuffer();
+
+    ParameterBuffer(const ParameterBuffer&) = delete;
+    ParameterBuffer& operator=(const ParameterBuffer&) = delete;
+
+    /*
+     * append a matrix to the layout, index of its view
+     */
+    uint add(uint rows, uint cols);
+
+    /*
+     * allocate the zeroed buffer and the views of the layout
+     */
+    void allocate();
+
+    /*
+     * drop the buffer, the views and the layout
+     */
+    void clear();
+
+    inline real* get_data(){ return _data;}
+    inline uint get_size() const { return _size;}
+    inline uint get_num_views() const { return _offsets.size();}
+
+    /*
+     * first element of matrix idx, get_size() for idx == get_num_views()
+     */
+    inline uint get_offset(uint idx) const { return idx < _offsets.size() ? _offsets[idx] : _size;}
+    inline ccma::algebra::BaseMatrixT<real>* get_view(uint idx){ return _views[idx];}
+
+    static const uint ALIGN = 64 / sizeof(real);
+
+private:
+    real* _data = nullptr;
+    uint _size = 0;
+    std::vector<uint> _offsets;
+    std::vector<uint> _rows;
+    std::vector<uint> _cols;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> _views;
+};//class ParameterBuffer
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
+
+#endif
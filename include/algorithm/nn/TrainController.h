@@ -0,0 +1,160 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 18:40
+ * Last modified : 2026-10-18 18:40
+ * Filename      : TrainController.h
+ * Description   : learning rate schedules, validation scheduling
+ *                 and early stopping of nn training
+ **********************************************/
+
+#ifndef _CCMA_ALGORITHM_NN_TRAINCONTROLLER_H_
+#define _CCMA_ALGORITHM_NN_TRAINCONTROLLER_H_
+
+#include "utils/TypeDef.h"
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+/*
+ * learning rate of the current step from the base eta passed to sgd.
+ * epoch is fractional, epoch + batch / num_batches, so a schedule can
+ * change the rate inside an epoch.
+ */
+class LRSchedule{
+public:
+    virtual ~LRSchedule(){}
+    virtual real get_eta(real eta, real epoch) const = 0;
+};//class LRSchedule
+
+/*
+ * eta
+ */
+class ConstantSchedule:public LRSchedule{
+public:
+    real get_eta(real eta, real epoch) const { return eta;}
+};//class ConstantSchedule
+
+/*
+ * eta * gamma ^ floor(epoch / step_size)
+ */
+class StepSchedule:public LRSchedule{
+public:
+    explicit StepSchedule(uint step_size, real gamma = 0.1);
+    real get_eta(real eta, real epoch) const;
+private:
+    uint _step_size;
+    real _gamma;
+};//class StepSchedule
+
+/*
+ * eta_min + (eta - eta_min) * (1 + cos(pi * epoch / epochs)) / 2
+ * eta_min = eta * min_ratio, flat at eta_min after epochs.
+ */
+class CosineSchedule:public LRSchedule{
+public:
+    explicit CosineSchedule(uint epochs, real min_ratio = 0.0);
+    real get_eta(real eta, real epoch) const;
+private:
+    uint _epochs;
+    real _min_ratio;
+};//class CosineSchedule
+
+/*
+ * cosine annealing with warm restarts(SGDR), the first cycle lasts
+ * period epochs and every next one mult times longer.
+ */
+class WarmRestartSchedule:public LRSchedule{
+public:
+    explicit WarmRestartSchedule(uint period, uint mult = 2, real min_ratio = 0.0);
+    real get_eta(real eta, real epoch) const;
+private:
+    uint _period;
+    uint _mult;
+    real _min_ratio;
+};//class WarmRestartSchedule
+
+/*
+ * drives DNN::sgd between epochs:
+ *     start(epochs, num_batches);
+ *     per batch:  eta_t = get_eta(eta, epoch, batch);
+ *     per epoch:  if(should_validate(epoch)){
+ *                     if(report(epoch, score)) write the model;
+ *                     if(should_stop()) break;
+ *                 }
+ * validation runs every frequency epochs and after the last one, on at
+ * most num_rows rows of the held-out data(0 is all of them).
+ * training stops once the score did not improve by more than min_delta
+ * for patience validations in a row, patience 0 never stops.
+ */
+class TrainController{
+public:
+    TrainController();
+    ~TrainController();
+
+    TrainController(const TrainController&) = delete;
+    TrainController& operator=(const TrainController&) = delete;
+
+    /*
+     * takes the ownership of schedule, nullptr is ConstantSchedule
+     */
+    void set_schedule(LRSchedule* schedule);
+
+    inline void set_early_stopping(uint patience, real min_delta = 0.0){
+        _patience = patience;
+        _min_delta = min_delta;
+    }
+
+    inline void set_validation(uint num_rows, uint frequency = 1){
+        _validation_rows = num_rows;
+        _validation_frequency = frequency == 0 ? 1 : frequency;
+    }
+
+    void start(uint epochs, uint num_batches);
+
+    inline real get_eta(real eta, uint epoch, uint batch) const{
+        return _schedule->get_eta(eta, epoch + (real)batch / _num_batches);
+    }
+
+    inline bool should_validate(uint epoch) const{
+        return (epoch + 1) % _validation_frequency == 0 || epoch + 1 == _epochs;
+    }
+
+    /*
+     * rows of a held-out set of num_rows used for validation
+     */
+    inline uint get_validation_rows(uint num_rows) const{
+        return (_validation_rows == 0 || _validation_rows > num_rows) ? num_rows : _validation_rows;
+    }
+
+    /*
+     * score of a validation, higher is better.
+     * true if it is the best one so far.
+     */
+    bool report(uint epoch, real score);
+
+    inline bool should_stop() const { return _patience > 0 && _num_bad >= _patience;}
+
+    inline real get_best_score() const { return _best_score;}
+    inline int get_best_epoch() const { return _best_epoch;}
+
+private:
+    LRSchedule* _schedule;
+
+    uint _patience = 0;
+    real _min_delta = 0.0;
+    uint _validation_rows = 0;
+    uint _validation_frequency = 1;
+
+    uint _epochs = 0;
+    uint _num_batches = 1;
+    real _best_score = 0.0;
+    int _best_epoch = -1;
+    uint _num_bad = 0;
+};//class TrainController
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
+
+#endif
@@ -34,6 +34,18 @@ public:
                       ccma::algebra::BaseMatrixT<real>* activation,
                       bool debug = false);
 
+	/*
+	 * same as feed_farward without the softmax, activation gets the
+	 * logits V * s[t] of every step
+	 */
+	void forward_logits(ccma::algebra::BaseMatrixT<real>* train_seq_data,
+                        ccma::algebra::BaseMatrixT<real>* weight,
+                        ccma::algebra::BaseMatrixT<real>* pre_weight,
+                        ccma::algebra::BaseMatrixT<real>* act_weight,
+                        ccma::algebra::BaseMatrixT<real>* state,
+                        ccma::algebra::BaseMatrixT<real>* logits,
+                        bool debug = false);
+
 	void back_propagation(ccma::algebra::BaseMatrixT<real>* train_seq_data,
 						  ccma::algebra::BaseMatrixT<real>* train_seq_label,
                           ccma::algebra::BaseMatrixT<real>* weight,
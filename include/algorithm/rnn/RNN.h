@@ -12,6 +12,7 @@
 #include <vector>
 #include <thread>
 #include "algorithm/rnn/Layer.h"
+#include "algorithm/nn/GradientClip.h"
 #include "utils/ModelLoader.h"
 
 namespace ccma{
@@ -66,9 +67,24 @@ public:
              const uint mini_batch_size = 1,
              const real alpha = 0.1);
 
+    /*
+     * U, W and V of a model file are used in place from a copy-on-write
+     * mapping of the file, see ModelLoader::map.
+     */
     bool load_model(const std::string& path);
     bool write_model(const std::string& path);
 
+    /*
+     * clip the averaged mini batch gradient of U, W and V to a global
+     * L2 norm of max_norm(0 no clipping), and skip the mini batches
+     * with a NaN/Inf gradient instead of applying them.
+     */
+    inline void set_clip_norm(real max_norm, bool skip_nonfinite = true){
+        _clip.set_max_norm(max_norm);
+        _clip.set_skip_nonfinite(skip_nonfinite);
+    }
+    inline unsigned long long get_num_skipped() const { return _clip.get_num_skipped();}
+
 private:
     void mini_batch_update(std::vector<ccma::algebra::BaseMatrixT<real>*> train_seq_data,
                            std::vector<ccma::algebra::BaseMatrixT<real>*> train_seq_label, 
@@ -92,11 +108,13 @@ private:
     ccma::utils::ModelLoader loader;
     std::string _path;
 
-    ccma::algebra::BaseMatrixT<real>* _U;
-    ccma::algebra::BaseMatrixT<real>* _W;
-    ccma::algebra::BaseMatrixT<real>* _V;
+    ccma::algebra::BaseMatrixT<real>* _U = nullptr;
+    ccma::algebra::BaseMatrixT<real>* _W = nullptr;
+    ccma::algebra::BaseMatrixT<real>* _V = nullptr;
+    std::shared_ptr<ccma::utils::MappedFile> _mapping;
 
-    Layer* _layer;
+    Layer* _layer = nullptr;
+    ccma::algorithm::nn::GradientClip _clip;
     const uint _num_hardware_concurrency = std::thread::hardware_concurrency() == 0 ? 1 : std::thread::hardware_concurrency();
 };//class RNN 
 
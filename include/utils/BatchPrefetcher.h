@@ -0,0 +1,214 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 17:20
+ * Last modified : 2026-10-18 17:20
+ * Filename      : BatchPrefetcher.h
+ * Description   : background producer of shuffled mini batches
+ **********************************************/
+
+#ifndef _CCMA_UTILS_BATCHPREFETCHER_H_
+#define _CCMA_UTILS_BATCHPREFETCHER_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "algebra/BaseMatrix.h"
+#include "utils/Shuffler.h"
+
+namespace ccma{
+namespace utils{
+
+/*
+ * A producer thread walks epochs * get_num_batches() mini batches of
+ * (data, label). At the start of every epoch it calls
+ * shuffler->shuffle(), then copies the shuffled rows of each batch
+ * into one of depth preallocated slots. depth = 2 is double
+ * buffering, 3 is triple buffering.
+ *
+ * The consumer calls next() once per batch. The batch it returns
+ * stays valid until the following next() call, which hands the slot
+ * back to the producer. So at most depth - 1 batches are gathered
+ * ahead, and nothing is allocated after construction.
+ *
+ * There is a single producer and the slots are used in ring order.
+ * The batch sequence therefore only depends on the shuffler. A
+ * seeded shuffler gives the same batches on every run.
+ */
+template<class T>
+class BatchPrefetcher{
+public:
+    BatchPrefetcher(ccma::algebra::BaseMatrixT<T>* data,
+                    ccma::algebra::BaseMatrixT<T>* label,
+                    uint batch_size,
+                    uint epochs,
+                    Shuffler* shuffler,
+                    uint depth = 2);
+
+    ~BatchPrefetcher();
+
+    BatchPrefetcher(const BatchPrefetcher&) = delete;
+    BatchPrefetcher& operator=(const BatchPrefetcher&) = delete;
+
+    /*
+     * number of batches of one epoch, the last one may be short
+     */
+    inline uint get_num_batches() const { return _num_batches;}
+
+    /*
+     * blocks until the next batch is ready.
+     * false once epochs * get_num_batches() batches were consumed.
+     */
+    bool next(ccma::algebra::BaseMatrixT<T>** batch_data, ccma::algebra::BaseMatrixT<T>** batch_label);
+
+private:
+    class Slot{
+    public:
+        ccma::algebra::BaseMatrixT<T>* data[2];
+        ccma::algebra::BaseMatrixT<T>* label[2];
+        bool is_last = false;
+    };
+
+    void produce();
+    void gather(ccma::algebra::BaseMatrixT<T>* src, uint start_idx, ccma::algebra::BaseMatrixT<T>* dst);
+
+private:
+    ccma::algebra::BaseMatrixT<T>* _data;
+    ccma::algebra::BaseMatrixT<T>* _label;
+    uint _batch_size;
+    uint _num_batches;
+    uint _total_batches;
+    Shuffler* _shuffler;
+
+    std::vector<Slot> _slots;
+
+    std::mutex _mutex;
+    std::condition_variable _ready_cv;
+    std::condition_variable _free_cv;
+    uint _num_produced = 0;
+    uint _num_consumed = 0;
+    bool _holding = false;
+    bool _stop = false;
+
+    std::thread _producer;
+};//class BatchPrefetcher
+
+template<class T>
+BatchPrefetcher<T>::BatchPrefetcher(ccma::algebra::BaseMatrixT<T>* data,
+                                    ccma::algebra::BaseMatrixT<T>* label,
+                                    uint batch_size,
+                                    uint epochs,
+                                    Shuffler* shuffler,
+                                    uint depth){
+    _data = data;
+    _label = label;
+    _shuffler = shuffler;
+
+    uint rows = data->get_rows();
+    _batch_size = std::max(1u, std::min(batch_size, rows));
+    _num_batches = (rows + _batch_size - 1) / _batch_size;
+    _total_batches = _num_batches * epochs;
+
+    uint num_last = rows % _batch_size;
+    _slots.resize(depth < 2 ? 2 : depth);
+    for(auto& slot : _slots){
+        slot.data[0]  = new ccma::algebra::DenseMatrixT<T>(_batch_size, data->get_cols());
+        slot.label[0] = new ccma::algebra::DenseMatrixT<T>(_batch_size, label->get_cols());
+        slot.data[1]  = new ccma::algebra::DenseMatrixT<T>(num_last, data->get_cols());
+        slot.label[1] = new ccma::algebra::DenseMatrixT<T>(num_last, label->get_cols());
+    }
+
+    _producer = std::thread(&BatchPrefetcher<T>::produce, this);
+}
+
+template<class T>
+BatchPrefetcher<T>::~BatchPrefetcher(){
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _free_cv.notify_all();
+    _producer.join();
+
+    for(auto& slot : _slots){
+        for(uint i = 0; i != 2; i++){
+            delete slot.data[i];
+            delete slot.label[i];
+        }
+    }
+}
+
+template<class T>
+bool BatchPrefetcher<T>::next(ccma::algebra::BaseMatrixT<T>** batch_data, ccma::algebra::BaseMatrixT<T>** batch_label){
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    //hand the previous batch back to the producer
+    if(_holding){
+        _holding = false;
+        _num_consumed++;
+        _free_cv.notify_one();
+    }
+
+    if(_num_consumed == _total_batches){
+        return false;
+    }
+
+    _ready_cv.wait(lock, [this]{ return _num_produced > _num_consumed;});
+
+    Slot& slot = _slots[_num_consumed % _slots.size()];
+    *batch_data = slot.data[slot.is_last ? 1 : 0];
+    *batch_label = slot.label[slot.is_last ? 1 : 0];
+    _holding = true;
+    return true;
+}
+
+template<class T>
+void BatchPrefetcher<T>::produce(){
+    uint rows = _data->get_rows();
+    uint num_slots = _slots.size();
+
+    for(uint k = 0; k != _total_batches; k++){
+        {
+            //slot k % num_slots is free once batch k - num_slots was released
+            std::unique_lock<std::mutex> lock(_mutex);
+            _free_cv.wait(lock, [this, k, num_slots]{ return _stop || k < _num_consumed + num_slots;});
+            if(_stop){
+                return;
+            }
+        }
+
+        uint batch_id = k % _num_batches;
+        if(batch_id == 0){
+            _shuffler->shuffle();
+        }
+
+        Slot& slot = _slots[k % num_slots];
+        uint start_idx = batch_id * _batch_size;
+        slot.is_last = (rows - start_idx < _batch_size);
+        gather(_data, start_idx, slot.data[slot.is_last ? 1 : 0]);
+        gather(_label, start_idx, slot.label[slot.is_last ? 1 : 0]);
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _num_produced++;
+        }
+        _ready_cv.notify_one();
+    }
+}
+
+template<class T>
+void BatchPrefetcher<T>::gather(ccma::algebra::BaseMatrixT<T>* src, uint start_idx, ccma::algebra::BaseMatrixT<T>* dst){
+    uint cols = src->get_cols();
+    T* src_data = src->get_data();
+    T* dst_data = dst->get_data();
+    for(uint i = 0; i != dst->get_rows(); i++){
+        memcpy(&dst_data[i * cols], &src_data[_shuffler->get_row(start_idx + i) * cols], sizeof(T) * cols);
+    }
+}
+
+}//namespace utils
+}//namespace ccma
+
+#endif
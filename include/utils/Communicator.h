@@ -0,0 +1,265 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 23:20
+ * Last modified : 2026-10-18 23:20
+ * Filename      : Communicator.h
+ * Description   : ring all-reduce between worker processes
+ **********************************************/
+
+#ifndef _CCMA_UTILS_COMMUNICATOR_H_
+#define _CCMA_UTILS_COMMUNICATOR_H_
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <functional>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace ccma{
+namespace utils{
+
+/*
+ * get_size() workers, ranks 0..size-1, connected as a ring: each one
+ * sends to rank + 1 and receives from rank - 1.
+ * A transport only implements send_recv, the exchange with both ring
+ * neighbours. all_reduce is built on it, so a new transport(e.g. TCP)
+ * gets the collective for free.
+ */
+class Communicator{
+public:
+    Communicator(uint rank, uint size) : _rank(rank), _size(size == 0 ? 1 : size){}
+    virtual ~Communicator(){}
+
+    inline uint get_rank() const { return _rank;}
+    inline uint get_size() const { return _size;}
+
+    /*
+     * sends send_size bytes to the next rank while receiving recv_size
+     * bytes from the previous one, false if a neighbour is gone.
+     */
+    virtual bool send_recv(const void* send_data, size_t send_size, void* recv_data, size_t recv_size) = 0;
+
+    /*
+     * data = sum of data over all ranks, in place.
+     * ring algorithm: size - 1 reduce-scatter steps, after which every
+     * rank owns the full sum of one chunk, then size - 1 all-gather
+     * steps passing the summed chunks around. every rank sends and
+     * receives 2 * (size - 1) / size of the data, whatever size is.
+     * chunk c is summed in ring order starting at rank c and then
+     * copied, so all ranks end with bitwise identical results.
+     */
+    template<class T>
+    bool all_reduce(T* data, size_t size);
+
+private:
+    inline size_t chunk_start(size_t size, uint chunk) const{
+        return size * chunk / _size;
+    }
+
+private:
+    uint _rank;
+    uint _size;
+    std::vector<char> _recv_buffer;
+};//class Communicator
+
+template<class T>
+bool Communicator::all_reduce(T* data, size_t size){
+    if(_size == 1){
+        return true;
+    }
+
+    size_t max_chunk = (size + _size - 1) / _size;
+    if(_recv_buffer.size() < max_chunk * sizeof(T)){
+        _recv_buffer.resize(max_chunk * sizeof(T));
+    }
+    T* recv_data = (T*)_recv_buffer.data();
+
+    //reduce-scatter: at step s send chunk rank - s, add chunk rank - s - 1
+    for(uint s = 0; s + 1 < _size; s++){
+        uint send_chunk = (_rank + _size - s) % _size;
+        uint recv_chunk = (_rank + _size - s - 1) % _size;
+        size_t send_start = chunk_start(size, send_chunk);
+        size_t recv_start = chunk_start(size, recv_chunk);
+        size_t recv_size = chunk_start(size, recv_chunk + 1) - recv_start;
+
+        if(!send_recv(&data[send_start], sizeof(T) * (chunk_start(size, send_chunk + 1) - send_start),
+                      recv_data, sizeof(T) * recv_size)){
+            return false;
+        }
+        for(size_t i = 0; i != recv_size; i++){
+            data[recv_start + i] = recv_data[i] + data[recv_start + i];
+        }
+    }
+
+    //all-gather: rank owns the sum of chunk rank + 1, pass the sums on
+    for(uint s = 0; s + 1 < _size; s++){
+        uint send_chunk = (_rank + 1 + _size - s) % _size;
+        uint recv_chunk = (_rank + _size - s) % _size;
+        size_t send_start = chunk_start(size, send_chunk);
+        size_t recv_start = chunk_start(size, recv_chunk);
+
+        if(!send_recv(&data[send_start], sizeof(T) * (chunk_start(size, send_chunk + 1) - send_start),
+                      &data[recv_start], sizeof(T) * (chunk_start(size, recv_chunk + 1) - recv_start))){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * transport over connected stream sockets, Unix domain sockets from
+ * launch_local or TCP connections alike. takes the ownership of both
+ * descriptors. the exchange polls both sockets, so neither side
+ * blocks on a full socket buffer while its neighbour does the same.
+ */
+class SocketCommunicator:public Communicator{
+public:
+    SocketCommunicator(uint rank, uint size, int next_fd, int prev_fd) : Communicator(rank, size){
+        _next_fd = next_fd;
+        _prev_fd = prev_fd;
+        fcntl(_next_fd, F_SETFL, fcntl(_next_fd, F_GETFL) | O_NONBLOCK);
+        fcntl(_prev_fd, F_SETFL, fcntl(_prev_fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    ~SocketCommunicator(){
+        close(_next_fd);
+        if(_prev_fd != _next_fd){
+            close(_prev_fd);
+        }
+    }
+
+    SocketCommunicator(const SocketCommunicator&) = delete;
+    SocketCommunicator& operator=(const SocketCommunicator&) = delete;
+
+    bool send_recv(const void* send_data, size_t send_size, void* recv_data, size_t recv_size){
+        const char* send_ptr = (const char*)send_data;
+        char* recv_ptr = (char*)recv_data;
+        size_t num_sent = 0;
+        size_t num_recv = 0;
+
+        while(num_sent < send_size || num_recv < recv_size){
+            pollfd fds[2];
+            uint num_fds = 0;
+            if(num_sent < send_size){
+                fds[num_fds++] = {_next_fd, POLLOUT, 0};
+            }
+            if(num_recv < recv_size){
+                fds[num_fds++] = {_prev_fd, POLLIN, 0};
+            }
+            if(poll(fds, num_fds, -1) < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                return false;
+            }
+
+            for(uint i = 0; i != num_fds; i++){
+                if(fds[i].revents == 0){
+                    continue;
+                }
+                ssize_t ret;
+                if(fds[i].events == POLLOUT){
+                    ret = ::send(_next_fd, send_ptr + num_sent, send_size - num_sent, MSG_NOSIGNAL);
+                }else{
+                    ret = ::recv(_prev_fd, recv_ptr + num_recv, recv_size - num_recv, 0);
+                    if(ret == 0){
+                        printf("SocketCommunicator rank %u: previous rank closed\n", get_rank());
+                        return false;
+                    }
+                }
+                if(ret < 0){
+                    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+                        continue;
+                    }
+                    printf("SocketCommunicator rank %u: %s\n", get_rank(), strerror(errno));
+                    return false;
+                }
+                (fds[i].events == POLLOUT ? num_sent : num_recv) += ret;
+            }
+        }
+        return true;
+    }
+
+private:
+    int _next_fd;
+    int _prev_fd;
+};//class SocketCommunicator
+
+/*
+ * runs worker(communicator) in num_workers forked processes of this
+ * machine, ring neighbours connected by Unix domain socket pairs.
+ * blocks until all of them exited, true if every worker returned 0.
+ * threads do not survive fork, so a worker must create its thread
+ * pools(e.g. the DNN) itself. data loaded before the call is shared
+ * copy-on-write.
+ */
+inline bool launch_local(uint num_workers, const std::function<int(Communicator*)>& worker){
+    if(num_workers == 0){
+        num_workers = 1;
+    }
+
+    //pair i links rank i(end 0) to rank i + 1(end 1)
+    std::vector<int> fds(num_workers * 2);
+    for(uint i = 0; i != num_workers; i++){
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[i * 2]) != 0){
+            printf("launch_local socketpair failed: %s\n", strerror(errno));
+            for(uint j = 0; j != i * 2; j++){
+                close(fds[j]);
+            }
+            return false;
+        }
+    }
+
+    fflush(stdout);
+    std::vector<pid_t> pids;
+    for(uint rank = 0; rank != num_workers; rank++){
+        pid_t pid = fork();
+        if(pid == 0){
+            int next_fd = fds[rank * 2];
+            int prev_fd = fds[((rank + num_workers - 1) % num_workers) * 2 + 1];
+            for(uint j = 0; j != fds.size(); j++){
+                if(fds[j] != next_fd && fds[j] != prev_fd){
+                    close(fds[j]);
+                }
+            }
+
+            int ret = 0;
+            {
+                SocketCommunicator communicator(rank, num_workers, next_fd, prev_fd);
+                ret = worker(&communicator);
+            }
+            fflush(stdout);
+            _exit(ret);
+        }
+        if(pid < 0){
+            printf("launch_local fork failed: %s\n", strerror(errno));
+            break;
+        }
+        pids.push_back(pid);
+    }
+
+    for(auto fd : fds){
+        close(fd);
+    }
+
+    bool is_ok = (pids.size() == num_workers);
+    for(auto pid : pids){
+        int status = 0;
+        if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            is_ok = false;
+        }
+    }
+    return is_ok;
+}
+
+}//namespace utils
+}//namespace ccma
+
+#endif
@@ -0,0 +1,81 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-19 03:00
+ * Last modified : 2026-10-19 03:00
+ * Filename      : MappedFile.h
+ * Description   : copy-on-write memory mapping of a whole file
+ **********************************************/
+
+#ifndef _CCMA_UTILS_MAPPEDFILE_H_
+#define _CCMA_UTILS_MAPPEDFILE_H_
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ccma{
+namespace utils{
+
+/*
+ * a private writable mapping of a file: pages are read from the page
+ * cache on first touch, so opening costs O(1) whatever the size, and
+ * every process mapping the same file shares the clean pages. a write
+ * copies only the touched page into the process, the file is never
+ * changed. the file may be replaced(rename) while mapped, truncating
+ * it in place would fault the pages not read yet.
+ */
+class MappedFile{
+public:
+    MappedFile(){}
+    ~MappedFile(){
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path){
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0){
+            return false;
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size == 0){
+            ::close(fd);
+            return false;
+        }
+        void* data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(data == MAP_FAILED){
+            printf("MappedFile mmap %s failed\n", path.c_str());
+            return false;
+        }
+        _data = (char*)data;
+        _size = st.st_size;
+        return true;
+    }
+
+    void close(){
+        if(_data != nullptr){
+            munmap(_data, _size);
+            _data = nullptr;
+            _size = 0;
+        }
+    }
+
+    inline char* get_data(){ return _data;}
+    inline size_t get_size() const { return _size;}
+
+private:
+    char* _data = nullptr;
+    size_t _size = 0;
+};//class MappedFile
+
+}//namespace utils
+}//namespace ccma
+
+#endif
@@ -9,13 +9,27 @@
 #ifndef _CCMA_UTILS_MODELLOADER_H_
 #define _CCMA_UTILS_MODELLOADER_H_
 
+#include <algorithm>
+#include <ctype.h>
 #include <fstream>
+#include <memory>
+#include <stdio.h>
 #include <vector>
 #include "algebra/BaseMatrix.h"
+#include "utils/MappedFile.h"
 
 namespace ccma{
 namespace utils{
 
+/*
+ * file: signature, uint num_models, num_models (type, rows, cols)
+ * headers, then the data of every matrix.
+ * type is 'i', 'f' or 'd', upper case if the matrix is stored as its
+ * nonzeros: uint nnz, nnz uint flat indices, nnz values.
+ * ALIGNED in num_models marks the files written by this version: the
+ * data starts at a DATA_ALIGN boundary and every matrix at a
+ * MATRIX_ALIGN one, zero padded, so a mapped file can be used in place.
+ */
 class ModelInfo{
 public:
     char type;
@@ -25,31 +39,79 @@ public:
 
 class ModelLoader{
 public:
+    /*
+     * is_sparse stores every matrix whose nonzeros take less space than
+     * its dense data as the nonzeros only, e.g. pruned weights.
+     * read handles both encodings.
+     */
     template<class T>
     bool write(std::vector<ccma::algebra::BaseMatrixT<T>*> models,
                const std::string& path,
                bool is_append = false,
-               const std::string& signature = "");
+               const std::string& signature = "",
+               bool is_sparse = false);
     template<class T>
     bool write(ccma::algebra::BaseMatrixT<T>* model,
                const std::string& path,
                bool is_append = false,
-               const std::string& signature = "");
+               const std::string& signature = "",
+               bool is_sparse = false);
     template<class T>
     bool read(const std::string& path,
               std::vector<ccma::algebra::BaseMatrixT<T>*>* models,
               const std::string& signature = "");
+
+    /*
+     * read without copying: the dense matrices of an aligned file are
+     * views on a copy-on-write mapping of it(DenseMatrixViewT), the
+     * others are decoded into their own buffers. opening costs O(1),
+     * pages are loaded on first touch and shared with every process
+     * mapping the same file. the views can be written(the process gets
+     * its own copy of the touched pages) but not resized, and must not
+     * outlive mapping.
+     */
+    template<class T>
+    bool map(const std::string& path,
+             std::vector<ccma::algebra::BaseMatrixT<T>*>* models,
+             std::shared_ptr<MappedFile>* mapping,
+             const std::string& signature = "");
+
+    /*
+     * true if the file at path starts with signature, prints nothing
+     */
+    bool check_signature(const std::string& path, const std::string& signature);
 private:
+    //'i', 'f' or 'd' of T, 0 if T can't be stored
+    template<class T>
+    static char get_type();
     template<class T>
     bool generate_header(std::vector<ccma::algebra::BaseMatrixT<T>*> models,
-                         std::vector<ModelInfo>* infos);
+                         std::vector<ModelInfo>* infos,
+                         bool is_sparse);
+    template<class T>
+    void write_data(std::ofstream& out_file, ccma::algebra::BaseMatrixT<T>* model, const ModelInfo& info);
+    template<class T>
+    bool read_mapped(MappedFile* file,
+                     const std::string& path,
+                     std::vector<ccma::algebra::BaseMatrixT<T>*>* models,
+                     const std::string& signature,
+                     bool is_view);
+    void write_padding(std::ofstream& out_file, size_t align);
+
+public:
+    static const uint ALIGNED = 0x80000000;
+    static const size_t DATA_ALIGN = 4096;
+    static const size_t MATRIX_ALIGN = 64;
+    //most elements a sparse matrix of a read file may expand to
+    static const size_t MAX_SPARSE_SIZE = (size_t)1 << 28;
 };//class ModelLoader
 
 template<class T>
 bool ModelLoader::write(std::vector<ccma::algebra::BaseMatrixT<T>*> models,
                         const std::string& path,
                         bool is_append,
-                        const std::string& signature){
+                        const std::string& signature,
+                        bool is_sparse){
     std::vector<ccma::algebra::BaseMatrixT<T>*> old_models;
     if(is_append){
         read<T>(path, &old_models, signature);
@@ -58,32 +120,46 @@ bool ModelLoader::write(std::vector<ccma::algebra::BaseMatrixT<T>*> models,
     uint num_models = models.size() + old_models.size();
     std::vector<ModelInfo> infos;
 
-    if(!generate_header(old_models, &infos) || !generate_header(models, &infos)){
+    if(!generate_header(old_models, &infos, is_sparse) || !generate_header(models, &infos, is_sparse)){
         return false;
     }
      
-    std::ofstream out_file(path, std::ios::binary);
+    /*
+     * written next to path and renamed over it, a process that has the
+     * old file mapped keeps reading the old data.
+     */
+    const std::string tmp_path = path + ".tmp";
+    std::ofstream out_file(tmp_path, std::ios::binary);
 
+    uint flag_num_models = num_models | ALIGNED;
     out_file.write(signature.c_str(), sizeof(char)*signature.size());
-    out_file.write((char*)&num_models, sizeof(uint));
+    out_file.write((char*)&flag_num_models, sizeof(uint));
     for(auto&& info : infos){
         out_file.write(&info.type, sizeof(char));
         out_file.write((char*)&info.rows, sizeof(uint));
         out_file.write((char*)&info.cols, sizeof(uint));
     }
+    write_padding(out_file, DATA_ALIGN);
 
     uint num_old_models = old_models.size();
     for(uint i = 0; i != num_old_models; i++){
-        out_file.write((char*)old_models[i]->get_data(), sizeof(T) * infos[i].rows * infos[i].cols);
+        write_data(out_file, old_models[i], infos[i]);
+        write_padding(out_file, MATRIX_ALIGN);
+        delete old_models[i];
     }
 
     num_models = models.size();
     for(uint i = 0; i != num_models; i++){
-        ModelInfo info = infos[i+num_old_models];
-        out_file.write((char*)models[i]->get_data(), sizeof(T) * info.rows * info.cols);
+        write_data(out_file, models[i], infos[i + num_old_models]);
+        write_padding(out_file, MATRIX_ALIGN);
     }
 
     out_file.close();
+    if(!out_file || rename(tmp_path.c_str(), path.c_str()) != 0){
+        printf("ModelLoader write %s failed\n", path.c_str());
+        remove(tmp_path.c_str());
+        return false;
+    }
 
     return true;
 }
@@ -91,81 +167,226 @@ template<class T>
 bool ModelLoader::write(ccma::algebra::BaseMatrixT<T>* model,
                         const std::string& path,
                         bool is_append,
-                        const std::string& signature){
+                        const std::string& signature,
+                        bool is_sparse){
     std::vector<ccma::algebra::BaseMatrixT<T>*> models;
     models.push_back(model);
-    return write(models, path, is_append, signature);
+    return write(models, path, is_append, signature, is_sparse);
 }
 
 template<class T>
 bool ModelLoader::read(const std::string& path,
                        std::vector<ccma::algebra::BaseMatrixT<T>*>* models,
                        const std::string& signature){
-    std::ifstream in_file(path, std::ios::binary);
-    if(!in_file){
+    MappedFile file;
+    return read_mapped(&file, path, models, signature, false);
+}
+
+template<class T>
+bool ModelLoader::map(const std::string& path,
+                      std::vector<ccma::algebra::BaseMatrixT<T>*>* models,
+                      std::shared_ptr<MappedFile>* mapping,
+                      const std::string& signature){
+    auto file = std::make_shared<MappedFile>();
+    if(!read_mapped(file.get(), path, models, signature, true)){
+        return false;
+    }
+    *mapping = file;
+    return true;
+}
+
+template<class T>
+bool ModelLoader::read_mapped(MappedFile* file,
+                              const std::string& path,
+                              std::vector<ccma::algebra::BaseMatrixT<T>*>* models,
+                              const std::string& signature,
+                              bool is_view){
+    models->clear();
+    if(!file->open(path)){
         printf("Can't open Filename:%s\n", path.c_str());
         return false;
     }
+    const char* data = file->get_data();
+    size_t file_size = file->get_size();
+    size_t pos = 0;
 
-    uint num_models = 0;
-    std::string read_signature(signature.size(), ' ');
-    in_file.read(&read_signature[0], sizeof(char) * signature.size());
-    if(read_signature != signature){
-        printf("ModelLoader read model error:[signature error]\n");
-        in_file.close();
+    //false once a read would run past the end of the file
+    auto fetch = [&](void* dst, size_t size){
+        if(pos + size > file_size){
+            return false;
+        }
+        memcpy(dst, &data[pos], size);
+        pos += size;
+        return true;
+    };
+    auto align = [&](size_t alignment){
+        pos = (pos + alignment - 1) / alignment * alignment;
+    };
+    auto fail = [&](const char* error){
+        printf("ModelLoader read model error:[%s]\n", error);
+        for(auto model : *models){
+            delete model;
+        }
+        models->clear();
         return false;
+    };
+
+    if(signature.size() > file_size || signature.compare(0, signature.size(), data, signature.size()) != 0){
+        return fail("signature error");
     }
+    pos = signature.size();
 
-    in_file.read((char*)(&num_models), sizeof(uint));
+    uint num_models = 0;
+    if(!fetch(&num_models, sizeof(uint))){
+        return fail("truncated header");
+    }
+    bool is_aligned = (num_models & ALIGNED) != 0;
+    num_models &= ~ALIGNED;
 
-    std::vector<ModelInfo> infos;
-    for(uint i = 0; i != num_models; i++){
-        ModelInfo info;
-        in_file.read(&info.type, sizeof(char));
-        in_file.read((char*)(&info.rows), sizeof(uint));
-        in_file.read((char*)(&info.cols), sizeof(uint));
-        infos.push_back(info);
+    std::vector<ModelInfo> infos(num_models);
+    for(auto&& info : infos){
+        if(!fetch(&info.type, sizeof(char)) || !fetch(&info.rows, sizeof(uint)) || !fetch(&info.cols, sizeof(uint))){
+            return fail("truncated header");
+        }
+    }
+    if(is_aligned){
+        align(DATA_ALIGN);
     }
 
-    models->clear();
-    for(uint i = 0; i != num_models; i++){
-        ModelInfo info = infos[i];
-        uint size      = info.rows * info.cols;
-        
-        T* data = new T[size];
-        in_file.read((char*)data, sizeof(T) * size);
-
-        auto mat = new ccma::algebra::DenseMatrixT<T>();
-        mat->set_shallow_data(data, info.rows, info.cols);
+    for(auto&& info : infos){
+        size_t size = (size_t)info.rows * info.cols;
+        ccma::algebra::BaseMatrixT<T>* mat = nullptr;
+        if(tolower(info.type) != get_type<T>()){
+            return fail("type error");
+        }
+        //matrices index their elements with uint
+        if(size > (uint)-1){
+            return fail("matrix size error");
+        }
+
+        if(!isupper(info.type)){
+            if(pos > file_size || size > (file_size - pos) / sizeof(T)){
+                return fail("truncated data");
+            }
+            if(is_view && is_aligned){
+                mat = new ccma::algebra::DenseMatrixViewT<T>((T*)&file->get_data()[pos], info.rows, info.cols);
+            }else{
+                T* mat_data = new T[size];
+                memcpy(mat_data, &data[pos], sizeof(T) * size);
+                mat = new ccma::algebra::DenseMatrixT<T>();
+                mat->set_shallow_data(mat_data, info.rows, info.cols);
+            }
+            pos += size * sizeof(T);
+        }else{
+            uint nnz = 0;
+            if(!fetch(&nnz, sizeof(uint)) || nnz > (file_size - pos) / (sizeof(uint) + sizeof(T))){
+                return fail("truncated data");
+            }
+            if(nnz > size || size > MAX_SPARSE_SIZE){
+                return fail("matrix size error");
+            }
+            T* mat_data = new T[size];
+            std::fill(mat_data, mat_data + size, (T)0);
+            const char* idx = &data[pos];
+            const char* values = &data[pos + sizeof(uint) * nnz];
+            for(uint i = 0; i != nnz; i++){
+                uint k;
+                memcpy(&k, &idx[sizeof(uint) * i], sizeof(uint));
+                if(k < size){
+                    memcpy(&mat_data[k], &values[sizeof(T) * i], sizeof(T));
+                }
+            }
+            pos += (size_t)nnz * (sizeof(uint) + sizeof(T));
+            mat = new ccma::algebra::DenseMatrixT<T>();
+            mat->set_shallow_data(mat_data, info.rows, info.cols);
+        }
         models->push_back(mat);
-    }
 
-    in_file.close();
+        if(is_aligned){
+            align(MATRIX_ALIGN);
+        }
+    }
     return true;
 }
 
+inline bool ModelLoader::check_signature(const std::string& path, const std::string& signature){
+    std::ifstream in_file(path, std::ios::binary);
+    if(!in_file){
+        return false;
+    }
+    std::string read_signature(signature.size(), ' ');
+    in_file.read(&read_signature[0], sizeof(char) * signature.size());
+    return in_file && read_signature == signature;
+}
+
+template<class T>
+char ModelLoader::get_type(){
+    if(typeid(T) == typeid(int)){
+        return 'i';
+    }else if(typeid(T) == typeid(float)){
+        return 'f';
+    }else if(typeid(T) == typeid(double)){
+        return 'd';
+    }
+    return 0;
+}
+
 template<class T>
 bool ModelLoader::generate_header(std::vector<ccma::algebra::BaseMatrixT<T>*> models,
-                                  std::vector<ModelInfo>* infos){
+                                  std::vector<ModelInfo>* infos,
+                                  bool is_sparse){
     for(auto&& model : models){
         ModelInfo info;
         info.rows = model->get_rows();
         info.cols = model->get_cols();
-        if(typeid(T) == typeid(int)){
-            info.type = 'i';
-        }else if(typeid(T) == typeid(float)){
-            info.type = 'f';
-        }else if(typeid(T) == typeid(double)){
-            info.type = 'd';
-        }else{
+        info.type = get_type<T>();
+        if(info.type == 0){
             printf("ModelLoader not support data type:[%s]\n", typeid(T).name());
             return false;
         }
+
+        if(is_sparse){
+            uint size = info.rows * info.cols;
+            uint nnz = size - std::count(model->get_data(), model->get_data() + size, (T)0);
+            if(sizeof(uint) + nnz * (sizeof(uint) + sizeof(T)) < size * sizeof(T)){
+                info.type = toupper(info.type);
+            }
+        }
         infos->push_back(info);
     }
     return true;
 }
 
+template<class T>
+void ModelLoader::write_data(std::ofstream& out_file, ccma::algebra::BaseMatrixT<T>* model, const ModelInfo& info){
+    uint size = info.rows * info.cols;
+    T* data = model->get_data();
+    if(!isupper(info.type)){
+        out_file.write((char*)data, sizeof(T) * size);
+        return;
+    }
+
+    std::vector<uint> idx;
+    std::vector<T> values;
+    for(uint i = 0; i != size; i++){
+        if(data[i] != 0){
+            idx.push_back(i);
+            values.push_back(data[i]);
+        }
+    }
+    uint nnz = idx.size();
+    out_file.write((char*)&nnz, sizeof(uint));
+    out_file.write((char*)idx.data(), sizeof(uint) * nnz);
+    out_file.write((char*)values.data(), sizeof(T) * nnz);
+}
+
+inline void ModelLoader::write_padding(std::ofstream& out_file, size_t align){
+    size_t pos = out_file.tellp();
+    size_t padding = (align - pos % align) % align;
+    std::vector<char> zeros(padding, 0);
+    out_file.write(zeros.data(), padding);
+}
+
 }//namespace utils
 }//namespace ccma
 
@@ -16,9 +16,15 @@
 namespace ccma{
 namespace utils{
 
+/*
+ * random permutation of [0, size), reshuffled by shuffle().
+ * Shuffler(size) draws from std::random_device, Shuffler(size, seed)
+ * gives the same permutations on every run.
+ */
 class Shuffler{
 public:
     Shuffler(uint size);
+    Shuffler(uint size, uint seed);
 
     ~Shuffler(){ _shuffler_idx.clear();}
 
@@ -29,23 +35,26 @@ public:
 private:
     uint _size;
     std::vector<uint> _shuffler_idx;
+    std::mt19937 _engine;
 };//class Shuffler
 
 
-Shuffler::Shuffler(uint size){
+inline Shuffler::Shuffler(uint size) : Shuffler(size, std::random_device()()){}
+
+inline Shuffler::Shuffler(uint size, uint seed) : _engine(seed){
     _size = size;
     for(uint i = 0; i != _size; i++){
         _shuffler_idx.push_back(i);
     }
 }
 
-void Shuffler::shuffle(){
+inline void Shuffler::shuffle(){
 
-    std::random_device rd;
     uint random_idx, value;
 
-    for(uint i = _size - 1; i != 0 ; i--){
-        random_idx = rd() % i;
+    //Fisher-Yates, i may stay in place
+    for(uint i = _size - 1; i < _size && i != 0; i--){
+        random_idx = _engine() % (i + 1);
         value =  _shuffler_idx[random_idx];
 
         _shuffler_idx[random_idx] = _shuffler_idx[i];
@@ -54,7 +63,7 @@ void Shuffler::shuffle(){
 
 }
 
-uint Shuffler::get_row(uint row_id){
+inline uint Shuffler::get_row(uint row_id){
     return _shuffler_idx[row_id];
 }
 
@@ -0,0 +1,153 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 10:12
+ * Last modified : 2026-10-18 10:12
+ * Filename      : ThreadPool.h
+ * Description   : persistent worker threads for data parallel tasks
+ **********************************************/
+
+#ifndef _CCMA_UTILS_THREADPOOL_H_
+#define _CCMA_UTILS_THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ccma{
+namespace utils{
+
+/*
+ * Workers are created once and sleep between jobs.
+ * parallel_for(num_task, func) calls func(task_id) for every task_id in
+ * [0, num_task) and blocks until all of them finished, the calling thread
+ * works on the tasks too. Which thread runs a task is not fixed, so a task
+ * must only write to memory owned by its task_id.
+ *
+ * A parallel_for issued while the pool is busy(e.g. from inside a task)
+ * runs serially on the calling thread.
+ */
+class ThreadPool{
+public:
+    explicit ThreadPool(uint num_thread = 0){
+        if(num_thread == 0){
+            num_thread = std::thread::hardware_concurrency();
+        }
+        _num_thread = (num_thread == 0) ? 1 : num_thread;
+
+        for(uint i = 1; i < _num_thread; i++){
+            _threads.push_back(std::thread(&ThreadPool::work, this));
+        }
+    }
+
+    ~ThreadPool(){
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _task_cv.notify_all();
+        for(auto& thread : _threads){
+            thread.join();
+        }
+        _threads.clear();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    inline uint get_num_thread() const { return _num_thread;}
+
+    template<class F>
+    void parallel_for(uint num_task, F& func){
+        if(num_task == 0){
+            return;
+        }
+
+        bool expected = false;
+        if(num_task == 1 || _num_thread == 1 || !_busy.compare_exchange_strong(expected, true)){
+            for(uint i = 0; i != num_task; i++){
+                func(i);
+            }
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _task_func  = &ThreadPool::invoke<F>;
+            _task_arg   = &func;
+            _num_task   = num_task;
+            _next_task  = 0;
+            _num_active = _threads.size();
+            _generation++;
+        }
+        _task_cv.notify_all();
+
+        run_tasks();
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _done_cv.wait(lock, [this]{ return _num_active == 0;});
+        }
+        _busy = false;
+    }
+
+private:
+    template<class F>
+    static void invoke(void* arg, uint task_id){
+        (*static_cast<F*>(arg))(task_id);
+    }
+
+    inline void run_tasks(){
+        uint task_id;
+        while((task_id = _next_task.fetch_add(1)) < _num_task){
+            _task_func(_task_arg, task_id);
+        }
+    }
+
+    void work(){
+        uint generation = 0;
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _task_cv.wait(lock, [this, generation]{ return _stop || _generation != generation;});
+                if(_stop){
+                    return;
+                }
+                generation = _generation;
+            }
+
+            run_tasks();
+
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                if(--_num_active == 0){
+                    _done_cv.notify_one();
+                }
+            }
+        }
+    }
+
+private:
+    uint _num_thread;
+    std::vector<std::thread> _threads;
+
+    std::mutex _mutex;
+    std::condition_variable _task_cv;
+    std::condition_variable _done_cv;
+
+    void (*_task_func)(void*, uint) = nullptr;
+    void* _task_arg = nullptr;
+    uint _num_task = 0;
+    std::atomic<uint> _next_task{0};
+    uint _num_active = 0;
+    uint _generation = 0;
+    bool _stop = false;
+
+    std::atomic<bool> _busy{false};
+};//class ThreadPool
+
+}//namespace utils
+}//namespace ccma
+
+#endif
@@ -366,14 +366,13 @@ void BaseMatrixT<T>::derivative_sigmoid(){
 }
 
 /*
- * softmax
+ * softmax over the whole matrix, in place
  */
 template<class T>
 void BaseMatrixT<T>::softmax(){
 
 	T e_sum     = 0;
 	uint size   = get_size();
-	T* data     = new T[size];
 	T* src_data = this->get_data();
 
     //avoid exp overflow
@@ -386,8 +385,8 @@ void BaseMatrixT<T>::softmax(){
 
     T min = (T)SOFTMAX_MIN;
 	for(uint i = 0; i != size; i++){
-        data[i] = std::exp(std::max(src_data[i] - max_value, min));
-        e_sum += data[i];
+        src_data[i] = std::exp(std::max(src_data[i] - max_value, min));
+        e_sum += src_data[i];
 	}
 
     if(std::isinf(e_sum)){
@@ -395,9 +394,8 @@ void BaseMatrixT<T>::softmax(){
     }
 
 	for(uint i = 0; i != size; i++){
-        src_data[i] = data[i] / e_sum;
+        src_data[i] /= e_sum;
 	}
-    delete[] data;
 }
 
 
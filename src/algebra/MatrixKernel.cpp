@@ -0,0 +1,679 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 11:20
+ * Last modified : 2026-10-18 11:20
+ * Filename      : MatrixKernel.cpp
+ * Description   : Implemention of raw buffer kernels
+ **********************************************/
+
+#include "algebra/MatrixKernel.h"
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+namespace ccma{
+namespace algebra{
+
+/*
+ * i-k-j order, the inner loop walks a row of B and a row of C
+ * contiguously and vectorizes. zero a(i,p), common for binary
+ * input such as mnist, skip the whole row of B.
+ */
+template<class T>
+void gemm(const T* a, const T* b, T* c, uint m, uint k, uint n){
+    memset(c, 0, sizeof(T) * m * n);
+    for(uint i = 0; i != m; i++){
+        const T* a_row = &a[i * k];
+        T* c_row = &c[i * n];
+        for(uint p = 0; p != k; p++){
+            T a_value = a_row[p];
+            if(a_value == 0){
+                continue;
+            }
+            const T* b_row = &b[p * n];
+            for(uint j = 0; j != n; j++){
+                c_row[j] += a_value * b_row[j];
+            }
+        }
+    }
+}
+
+template<class T>
+void gemm_tn(const T* a, const T* b, T* c, uint m, uint k, uint n){
+    memset(c, 0, sizeof(T) * k * n);
+    for(uint i = 0; i != m; i++){
+        const T* a_row = &a[i * k];
+        const T* b_row = &b[i * n];
+        for(uint p = 0; p != k; p++){
+            T a_value = a_row[p];
+            if(a_value == 0){
+                continue;
+            }
+            T* c_row = &c[p * n];
+            for(uint j = 0; j != n; j++){
+                c_row[j] += a_value * b_row[j];
+            }
+        }
+    }
+}
+
+template<class T>
+void gemm_nt(const T* a, const T* b, T* c, uint m, uint n, uint k){
+    for(uint i = 0; i != m; i++){
+        const T* a_row = &a[i * n];
+        T* c_row = &c[i * k];
+        for(uint p = 0; p != k; p++){
+            const T* b_row = &b[p * n];
+            T value = 0;
+            for(uint j = 0; j != n; j++){
+                value += a_row[j] * b_row[j];
+            }
+            c_row[p] = value;
+        }
+    }
+}
+
+template<class T>
+void add_row(T* a, const T* row, uint m, uint n){
+    for(uint i = 0; i != m; i++){
+        T* a_row = &a[i * n];
+        for(uint j = 0; j != n; j++){
+            a_row[j] += row[j];
+        }
+    }
+}
+
+template<class T>
+void col_sum(const T* a, T* out, uint m, uint n){
+    memset(out, 0, sizeof(T) * n);
+    for(uint i = 0; i != m; i++){
+        const T* a_row = &a[i * n];
+        for(uint j = 0; j != n; j++){
+            out[j] += a_row[j];
+        }
+    }
+}
+
+template<class T>
+void sigmoid(T* a, uint size){
+    T one = static_cast<T>(1);
+    T sigmoid_max = (T)SIGMOID_MAX;
+    T sigmoid_min = (T)SIGMOID_MIN;
+    for(uint i = 0; i != size; i++){
+        T d = a[i];
+        if(d < sigmoid_min){
+            d = sigmoid_min;
+        }else if(d > sigmoid_max){
+            d = sigmoid_max;
+        }
+        a[i] = one / (one + std::exp(-d));
+    }
+}
+
+/*
+ * element wise activation and its derivative expressed with a = act(z).
+ * the activation is a template argument, so the per element switch
+ * is resolved at compile time and the loops stay vectorizable.
+ */
+template<Activation ACT, class T>
+inline T activate_value(T value){
+    switch(ACT){
+        case Activation::SIGMOID:{
+            if(value < (T)SIGMOID_MIN){
+                value = (T)SIGMOID_MIN;
+            }else if(value > (T)SIGMOID_MAX){
+                value = (T)SIGMOID_MAX;
+            }
+            return 1 / (1 + std::exp(-value));
+        }
+        case Activation::TANH:
+            return 2 / (1 + std::exp(std::min((T)EXP_MAX, -2 * value))) - 1;
+        case Activation::RELU:
+            return value < 0 ? 0 : value;
+        case Activation::LEAKY_RELU:
+            return value < 0 ? (T)LEAKY_RELU_SLOPE * value : value;
+        default:
+            return value;
+    }
+}
+
+template<Activation ACT, class T>
+inline T derivative_value(T a){
+    switch(ACT){
+        case Activation::SIGMOID:
+            return a * (1 - a);
+        case Activation::TANH:
+            return 1 - a * a;
+        case Activation::RELU:
+            return a > 0 ? 1 : 0;
+        case Activation::LEAKY_RELU:
+            return a > 0 ? 1 : (T)LEAKY_RELU_SLOPE;
+        default:
+            return 1;
+    }
+}
+
+template<class T>
+inline void softmax_row(T* row, uint n){
+    T max_value = row[0];
+    for(uint j = 1; j < n; j++){
+        if(row[j] > max_value){
+            max_value = row[j];
+        }
+    }
+
+    T min = (T)SOFTMAX_MIN;
+    T sum = 0;
+    for(uint j = 0; j != n; j++){
+        row[j] = std::exp(std::max(row[j] - max_value, min));
+        sum += row[j];
+    }
+    for(uint j = 0; j != n; j++){
+        row[j] /= sum;
+    }
+}
+
+template<Activation ACT, class T>
+inline void activate_row(T* row, uint n){
+    if(ACT == Activation::SOFTMAX){
+        softmax_row(row, n);
+    }else{
+        for(uint j = 0; j != n; j++){
+            row[j] = activate_value<ACT>(row[j]);
+        }
+    }
+}
+
+/*
+ * i-k-j order like gemm, the output row starts from the bias and is
+ * accumulated in place, at n <= a few hundred it stays in L1. z and
+ * the activation are written while the row is still hot, so the
+ * output is never streamed through memory twice.
+ */
+template<Activation ACT, class T>
+void dense_forward_impl(const T* a, const T* w, const T* b, T* z, T* out, uint m, uint k, uint n){
+    for(uint i = 0; i != m; i++){
+        const T* a_row = &a[i * k];
+        T* out_row = &out[i * n];
+        for(uint j = 0; j != n; j++){
+            out_row[j] = b[j];
+        }
+        for(uint p = 0; p != k; p++){
+            T a_value = a_row[p];
+            if(a_value == 0){
+                continue;
+            }
+            const T* w_row = &w[p * n];
+            for(uint j = 0; j != n; j++){
+                out_row[j] += a_value * w_row[j];
+            }
+        }
+
+        if(z != nullptr){
+            memcpy(&z[i * n], out_row, sizeof(T) * n);
+        }
+        activate_row<ACT>(out_row, n);
+    }
+}
+
+/*
+ * dense_forward_impl with the row of a as a list of nonzeros, the
+ * same weight rows are summed in the same order.
+ */
+template<Activation ACT, class T>
+void sparse_dense_forward_impl(const uint* row_ptr, const uint* col_idx, const T* values,
+                               const T* w, const T* b, T* z, T* out, uint m, uint n){
+    for(uint i = 0; i != m; i++){
+        T* out_row = &out[i * n];
+        for(uint j = 0; j != n; j++){
+            out_row[j] = b[j];
+        }
+        for(uint p = row_ptr[i]; p != row_ptr[i + 1]; p++){
+            T a_value = values[p];
+            if(a_value == 0){
+                continue;
+            }
+            const T* w_row = &w[col_idx[p] * n];
+            for(uint j = 0; j != n; j++){
+                out_row[j] += a_value * w_row[j];
+            }
+        }
+
+        if(z != nullptr){
+            memcpy(&z[i * n], out_row, sizeof(T) * n);
+        }
+        activate_row<ACT>(out_row, n);
+    }
+}
+
+/*
+ * out(i, j) = b(j) + sum of a(i, p) * w(p, j) over the nonzero w(p, j)
+ * of column j, for a block of rows at once.
+ */
+template<Activation ACT, class T>
+void dense_sparse_forward_impl(const T* a, const uint* col_ptr, const uint* row_idx, const T* values,
+                               const T* b, T* z, T* out, T* buffer, uint m, uint k, uint n){
+    const uint block = SPARSE_FORWARD_BLOCK;
+    for(uint start_idx = 0; start_idx < m; start_idx += block){
+        uint rows = std::min(block, m - start_idx);
+
+        //buffer(p, r) = a(start_idx + r, p), the rows past m are zero
+        for(uint p = 0; p != k; p++){
+            for(uint r = 0; r != block; r++){
+                buffer[p * block + r] = (r < rows) ? a[(start_idx + r) * k + p] : 0;
+            }
+        }
+
+        for(uint j = 0; j != n; j++){
+            T acc[SPARSE_FORWARD_BLOCK];
+            for(uint r = 0; r != block; r++){
+                acc[r] = b[j];
+            }
+            for(uint q = col_ptr[j]; q != col_ptr[j + 1]; q++){
+                const T* a_col = &buffer[row_idx[q] * block];
+                T w_value = values[q];
+                for(uint r = 0; r != block; r++){
+                    acc[r] += a_col[r] * w_value;
+                }
+            }
+            for(uint r = 0; r != rows; r++){
+                out[(start_idx + r) * n + j] = acc[r];
+            }
+        }
+
+        for(uint r = 0; r != rows; r++){
+            T* out_row = &out[(start_idx + r) * n];
+            if(z != nullptr){
+                memcpy(&z[(start_idx + r) * n], out_row, sizeof(T) * n);
+            }
+            activate_row<ACT>(out_row, n);
+        }
+    }
+}
+
+/*
+ * calls IMPL<act> with the runtime activation turned into a template
+ * argument
+ */
+#define CCMA_DISPATCH_ACTIVATION(act, IMPL, ...) \
+    switch(act){ \
+        case Activation::SIGMOID: IMPL<Activation::SIGMOID>(__VA_ARGS__); break; \
+        case Activation::TANH: IMPL<Activation::TANH>(__VA_ARGS__); break; \
+        case Activation::RELU: IMPL<Activation::RELU>(__VA_ARGS__); break; \
+        case Activation::SOFTMAX: IMPL<Activation::SOFTMAX>(__VA_ARGS__); break; \
+        case Activation::LINEAR: IMPL<Activation::LINEAR>(__VA_ARGS__); break; \
+        case Activation::LEAKY_RELU: IMPL<Activation::LEAKY_RELU>(__VA_ARGS__); break; \
+    }
+
+template<Activation ACT, class T>
+void activate_impl(T* a, uint m, uint n){
+    if(ACT == Activation::SOFTMAX){
+        for(uint i = 0; i != m; i++){
+            softmax_row(&a[i * n], n);
+        }
+    }else if(ACT != Activation::LINEAR){
+        uint size = m * n;
+        for(uint i = 0; i != size; i++){
+            a[i] = activate_value<ACT>(a[i]);
+        }
+    }
+}
+
+template<class T>
+void activate(T* a, uint m, uint n, Activation act){
+    CCMA_DISPATCH_ACTIVATION(act, activate_impl, a, m, n);
+}
+
+template<class T>
+void dense_forward(const T* a,
+                   const T* w,
+                   const T* b,
+                   T* z,
+                   T* out,
+                   uint m,
+                   uint k,
+                   uint n,
+                   Activation act){
+    CCMA_DISPATCH_ACTIVATION(act, dense_forward_impl, a, w, b, z, out, m, k, n);
+}
+
+template<class T>
+void sparse_dense_forward(const uint* row_ptr,
+                          const uint* col_idx,
+                          const T* values,
+                          const T* w,
+                          const T* b,
+                          T* z,
+                          T* out,
+                          uint m,
+                          uint n,
+                          Activation act){
+    CCMA_DISPATCH_ACTIVATION(act, sparse_dense_forward_impl, row_ptr, col_idx, values, w, b, z, out, m, n);
+}
+
+template<class T>
+void dense_sparse_forward(const T* a,
+                          const uint* col_ptr,
+                          const uint* row_idx,
+                          const T* values,
+                          const T* b,
+                          T* z,
+                          T* out,
+                          T* buffer,
+                          uint m,
+                          uint k,
+                          uint n,
+                          Activation act){
+    CCMA_DISPATCH_ACTIVATION(act, dense_sparse_forward_impl, a, col_ptr, row_idx, values, b, z, out, buffer, m, k, n);
+}
+
+template<class T>
+void sparse_gemm_tn(const uint* row_ptr, const uint* col_idx, const T* values, const T* b, T* c, uint m, uint n){
+    for(uint i = 0; i != m; i++){
+        const T* b_row = &b[i * n];
+        for(uint p = row_ptr[i]; p != row_ptr[i + 1]; p++){
+            T a_value = values[p];
+            if(a_value == 0){
+                continue;
+            }
+            T* c_row = &c[col_idx[p] * n];
+            for(uint j = 0; j != n; j++){
+                c_row[j] += a_value * b_row[j];
+            }
+        }
+    }
+}
+
+template<Activation ACT, class T>
+void dense_backward_impl(const T* delta, const T* w, const T* a_in, T* pre_delta, uint m, uint n, uint k, const T* mask){
+    for(uint i = 0; i != m; i++){
+        const T* delta_row = &delta[i * n];
+        const T* a_row = &a_in[i * k];
+        T* pre_row = &pre_delta[i * k];
+        for(uint p = 0; p != k; p++){
+            const T* w_row = &w[p * n];
+            T value = 0;
+            for(uint j = 0; j != n; j++){
+                value += delta_row[j] * w_row[j];
+            }
+            pre_row[p] = value * derivative_value<ACT>(a_row[p]);
+        }
+        if(mask != nullptr){
+            const T* mask_row = &mask[i * k];
+            for(uint p = 0; p != k; p++){
+                pre_row[p] *= mask_row[p];
+            }
+        }
+    }
+}
+
+template<class T>
+void dense_backward(const T* delta,
+                    const T* w,
+                    const T* a_in,
+                    T* pre_delta,
+                    uint m,
+                    uint n,
+                    uint k,
+                    Activation act,
+                    const T* mask){
+    CCMA_DISPATCH_ACTIVATION(act, dense_backward_impl, delta, w, a_in, pre_delta, m, n, k, mask);
+}
+
+template<Activation ACT, class T>
+void derivative_impl(T* delta, const T* a, uint size){
+    if(ACT == Activation::LINEAR || ACT == Activation::SOFTMAX){
+        return;
+    }
+    for(uint i = 0; i != size; i++){
+        delta[i] *= derivative_value<ACT>(a[i]);
+    }
+}
+
+template<class T>
+void derivative(T* delta, const T* a, uint size, Activation act){
+    CCMA_DISPATCH_ACTIVATION(act, derivative_impl, delta, a, size);
+}
+
+/*
+ * a window row of size pixels is one contiguous run of size * channels
+ * in NHWC, copied at once unless it crosses the image border.
+ */
+template<class T>
+void im2row(const T* a, T* out, uint rows, uint cols, uint channels, uint size, uint stride, uint out_rows, uint out_cols){
+    uint run = size * channels;
+    for(uint y = 0; y != out_rows; y++){
+        for(uint x = 0; x != out_cols; x++){
+            T* out_row = &out[(y * out_cols + x) * size * run];
+            uint col = x * stride;
+            uint num_cols = std::min(size, cols - col);
+            for(uint ky = 0; ky != size; ky++){
+                uint row = y * stride + ky;
+                T* dst = &out_row[ky * run];
+                if(row >= rows){
+                    memset(dst, 0, sizeof(T) * run);
+                    continue;
+                }
+                memcpy(dst, &a[(row * cols + col) * channels], sizeof(T) * num_cols * channels);
+                if(num_cols != size){
+                    memset(&dst[num_cols * channels], 0, sizeof(T) * (size - num_cols) * channels);
+                }
+            }
+        }
+    }
+}
+
+template<class T>
+void row2im(const T* patches, T* a, uint rows, uint cols, uint channels, uint size, uint stride, uint out_rows, uint out_cols){
+    uint run = size * channels;
+    for(uint y = 0; y != out_rows; y++){
+        for(uint x = 0; x != out_cols; x++){
+            const T* patch_row = &patches[(y * out_cols + x) * size * run];
+            uint col = x * stride;
+            uint num = std::min(size, cols - col) * channels;
+            for(uint ky = 0; ky != size; ky++){
+                uint row = y * stride + ky;
+                if(row >= rows){
+                    break;
+                }
+                const T* src = &patch_row[ky * run];
+                T* dst = &a[(row * cols + col) * channels];
+                for(uint i = 0; i != num; i++){
+                    dst[i] += src[i];
+                }
+            }
+        }
+    }
+}
+
+template<class T>
+void batch_norm_forward(T* z,
+                        T* out,
+                        const T* gamma,
+                        const T* beta,
+                        T* mean,
+                        T* var,
+                        T* inv_std,
+                        uint m,
+                        uint n,
+                        T epsilon){
+    col_sum(z, mean, m, n);
+    for(uint j = 0; j != n; j++){
+        mean[j] /= m;
+        var[j] = 0;
+    }
+    for(uint i = 0; i != m; i++){
+        const T* z_row = &z[i * n];
+        for(uint j = 0; j != n; j++){
+            T diff = z_row[j] - mean[j];
+            var[j] += diff * diff;
+        }
+    }
+    for(uint j = 0; j != n; j++){
+        var[j] /= m;
+        inv_std[j] = 1 / std::sqrt(var[j] + epsilon);
+    }
+
+    for(uint i = 0; i != m; i++){
+        T* z_row = &z[i * n];
+        T* out_row = &out[i * n];
+        for(uint j = 0; j != n; j++){
+            T z_hat = (z_row[j] - mean[j]) * inv_std[j];
+            z_row[j] = z_hat;
+            out_row[j] = gamma[j] * z_hat + beta[j];
+        }
+    }
+}
+
+/*
+ * dz = gamma * inv_std / m * (m * dout - sum(dout) - z_hat * sum(dout * z_hat))
+ */
+template<class T>
+void batch_norm_backward(T* delta,
+                         const T* z_hat,
+                         const T* gamma,
+                         const T* inv_std,
+                         T* grad_gamma,
+                         T* grad_beta,
+                         uint m,
+                         uint n){
+    memset(grad_gamma, 0, sizeof(T) * n);
+    memset(grad_beta, 0, sizeof(T) * n);
+    for(uint i = 0; i != m; i++){
+        const T* delta_row = &delta[i * n];
+        const T* z_row = &z_hat[i * n];
+        for(uint j = 0; j != n; j++){
+            grad_gamma[j] += delta_row[j] * z_row[j];
+            grad_beta[j] += delta_row[j];
+        }
+    }
+
+    for(uint i = 0; i != m; i++){
+        T* delta_row = &delta[i * n];
+        const T* z_row = &z_hat[i * n];
+        for(uint j = 0; j != n; j++){
+            T scale = gamma[j] * inv_std[j] / m;
+            delta_row[j] = scale * (m * delta_row[j] - grad_beta[j] - z_row[j] * grad_gamma[j]);
+        }
+    }
+}
+
+/*
+ * splitmix64 finalizer
+ */
+inline unsigned long long mix_bits(unsigned long long x){
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+template<class T>
+void dropout(const T* a, T* out, T* mask, uint size, T rate, unsigned long long seed){
+    T scale = 1 / (1 - rate);
+    unsigned long long base = mix_bits(seed);
+    for(uint i = 0; i != size; i++){
+        //top 24 bits as a uniform number in [0, 1)
+        T u = (T)(mix_bits(base + i) >> 40) * (T)(1.0 / 16777216.0);
+        mask[i] = u < rate ? 0 : scale;
+        out[i] = a[i] * mask[i];
+    }
+}
+
+template<class T>
+T softmax_cross_entropy(const T* z, const T* y, T* a, T* delta, uint m, uint n){
+    T loss = 0;
+    for(uint i = 0; i != m; i++){
+        const T* z_row = &z[i * n];
+        const T* y_row = &y[i * n];
+
+        T max_value = z_row[0];
+        for(uint j = 1; j < n; j++){
+            max_value = std::max(max_value, z_row[j]);
+        }
+
+        //sum(exp(z - max)) with sum(y * (z - max)) and sum(y) on the way
+        T sum = 0;
+        T y_dot = 0;
+        T y_sum = 0;
+        if(a != nullptr){
+            T* a_row = &a[i * n];
+            for(uint j = 0; j != n; j++){
+                T shift = z_row[j] - max_value;
+                T e = std::exp(shift);
+                a_row[j] = e;
+                sum += e;
+                y_dot += y_row[j] * shift;
+                y_sum += y_row[j];
+            }
+        }else{
+            for(uint j = 0; j != n; j++){
+                T shift = z_row[j] - max_value;
+                sum += std::exp(shift);
+                y_dot += y_row[j] * shift;
+                y_sum += y_row[j];
+            }
+        }
+        loss += y_sum * std::log(sum) - y_dot;
+
+        T inv_sum = 1 / sum;
+        if(a != nullptr){
+            T* a_row = &a[i * n];
+            for(uint j = 0; j != n; j++){
+                a_row[j] *= inv_sum;
+            }
+            if(delta != nullptr){
+                T* delta_row = &delta[i * n];
+                for(uint j = 0; j != n; j++){
+                    delta_row[j] = a_row[j] - y_row[j];
+                }
+            }
+        }else if(delta != nullptr){
+            T* delta_row = &delta[i * n];
+            for(uint j = 0; j != n; j++){
+                delta_row[j] = std::exp(z_row[j] - max_value) * inv_sum - y_row[j];
+            }
+        }
+    }
+    return loss;
+}
+
+template<class T>
+double sum_square(const T* x, uint size){
+    double lane[4] = {0, 0, 0, 0};
+    uint i = 0;
+    for(; i + 4 <= size; i += 4){
+        lane[0] += (double)x[i] * x[i];
+        lane[1] += (double)x[i + 1] * x[i + 1];
+        lane[2] += (double)x[i + 2] * x[i + 2];
+        lane[3] += (double)x[i + 3] * x[i + 3];
+    }
+    for(; i != size; i++){
+        lane[0] += (double)x[i] * x[i];
+    }
+    return (lane[0] + lane[1]) + (lane[2] + lane[3]);
+}
+
+template void gemm<real>(const real*, const real*, real*, uint, uint, uint);
+template void gemm_tn<real>(const real*, const real*, real*, uint, uint, uint);
+template void gemm_nt<real>(const real*, const real*, real*, uint, uint, uint);
+template void add_row<real>(real*, const real*, uint, uint);
+template void col_sum<real>(const real*, real*, uint, uint);
+template void sigmoid<real>(real*, uint);
+template void activate<real>(real*, uint, uint, Activation);
+template void dense_forward<real>(const real*, const real*, const real*, real*, real*, uint, uint, uint, Activation);
+template void sparse_dense_forward<real>(const uint*, const uint*, const real*, const real*, const real*, real*, real*, uint, uint, Activation);
+template void sparse_gemm_tn<real>(const uint*, const uint*, const real*, const real*, real*, uint, uint);
+template void dense_sparse_forward<real>(const real*, const uint*, const uint*, const real*, const real*, real*, real*, real*, uint, uint, uint, Activation);
+template void dense_backward<real>(const real*, const real*, const real*, real*, uint, uint, uint, Activation, const real*);
+template void derivative<real>(real*, const real*, uint, Activation);
+template void im2row<real>(const real*, real*, uint, uint, uint, uint, uint, uint, uint);
+template void row2im<real>(const real*, real*, uint, uint, uint, uint, uint, uint, uint);
+template void batch_norm_forward<real>(real*, real*, const real*, const real*, real*, real*, real*, uint, uint, real);
+template void batch_norm_backward<real>(real*, const real*, const real*, const real*, real*, real*, uint, uint);
+template void dropout<real>(const real*, real*, real*, uint, real, unsigned long long);
+template real softmax_cross_entropy<real>(const real*, const real*, real*, real*, uint, uint);
+template double sum_square<real>(const real*, uint);
+
+}//namespace algebra
+}//namespace ccma
@@ -7,14 +7,34 @@
 **********************************************/
 
 #include "algorithm/cnn/CNN.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 
 namespace ccma{
 namespace algorithm{
 namespace cnn{
+
+/*
+ * layer and pooling types in the config of a model file
+ */
+enum ModelLayerType{
+    MODEL_DATA_LAYER = 0,
+    MODEL_CONVOLUTION_LAYER = 1,
+    MODEL_SUBSAMPLING_LAYER = 2,
+    MODEL_FULL_CONNECTION_LAYER = 3
+};
+enum ModelPoolingType{
+    MODEL_MEAN_POOLING = 0,
+    MODEL_MAX_POOLING = 1,
+    MODEL_L2_POOLING = 2
+};
+
 bool CNN::add_layer(Layer* layer){
     /*
      * the first layer must be DataLayer
      */
+    layer->set_pool(_pool);
     if(_layers.size() == 0){
         if(typeid(*layer) != typeid(DataLayer)){
             printf("The first layer must be DataLayer.\n");
@@ -30,6 +50,7 @@ bool CNN::add_layer(Layer* layer){
     if(layer->initialize(pre_layer)){
 	pre_layer->set_is_last_layer();
         _layers.push_back(layer);
+        set_fuse_pooling(_fuse_pooling);
         return true;
     }else{
         return false;
@@ -40,7 +61,8 @@ void CNN::train(ccma::algebra::BaseMatrixT<real>* train_data,
                 ccma::algebra::BaseMatrixT<real>* train_label,
                 uint epoch,
                 ccma::algebra::BaseMatrixT<real>* test_data,
-                ccma::algebra::BaseMatrixT<real>* test_label){
+                ccma::algebra::BaseMatrixT<real>* test_label,
+                uint mini_batch_size){
     uint num_train_data = train_data->get_rows();
     uint num_test_data = 0;
     if(test_data != nullptr){
@@ -48,26 +70,32 @@ void CNN::train(ccma::algebra::BaseMatrixT<real>* train_data,
     }
 
     //check cnn structure and data dim
-    if(!check(train_data->get_cols())){
+    if(!check(train_data->get_cols(), train_label->get_cols())){
         return;
     }
+    if(mini_batch_size == 0){
+        mini_batch_size = 1;
+    }
 
-    auto mini_batch_data = new ccma::algebra::DenseMatrixT<real>();
-    auto mini_batch_label = new ccma::algebra::DenseMatrixT<real>();
+    uint data_cols = train_data->get_cols();
+    uint label_cols = train_label->get_cols();
     auto now = []{return std::chrono::system_clock::now();};
 
-    for(uint i = 0; i != epoch; i++){
+    uint end_epoch = _num_epochs + epoch;
+    for(uint i = _num_epochs; i != end_epoch; i++){
 
         auto start_time = now();
     	bool debug = (num_train_data < 10);
-        for(uint j = 0; j != num_train_data; j++){
-            train_data->get_row_data(j, mini_batch_data);
-            train_label->get_row_data(j, mini_batch_label);
+        for(uint j = 0; j < num_train_data; j += mini_batch_size){
+            //the batch rows are used in place
+            uint batch_size = std::min(mini_batch_size, num_train_data - j);
+            ccma::algebra::DenseMatrixViewT<real> mini_batch_data(&train_data->get_data()[j * data_cols], batch_size, data_cols);
+            ccma::algebra::DenseMatrixViewT<real> mini_batch_label(&train_label->get_data()[j * label_cols], batch_size, label_cols);
 
-            feed_forward(mini_batch_data, debug);
-            back_propagation(mini_batch_label, debug);
+            feed_forward(&mini_batch_data, debug);
+            back_propagation(&mini_batch_label, debug);
 
-            if(j % 100 == 0){
+            if(j / mini_batch_size % 100 == 0){
                 printf("Epoch[%d][%d/%d]training...\r", i, j, num_train_data);
             }
         }//end per epoch
@@ -75,24 +103,68 @@ void CNN::train(ccma::algebra::BaseMatrixT<real>* train_data,
         auto training_time = now();
         printf("Epoch %d training run time: %ld ms\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(training_time - start_time).count());
 
-        int cnt = 0;
-    	debug = (num_test_data < 10);
-        for(uint k = 0; k != num_test_data; k++){
-            test_data->get_row_data(k, mini_batch_data);
-            test_label->get_row_data(k, mini_batch_label);
-            if(evaluate(mini_batch_data, mini_batch_label, debug)){
-                cnt++;
-            }
-        }
-
 	    if(num_test_data > 0){
+            uint cnt = evaluate(test_data, test_label, mini_batch_size, num_test_data < 10);
 	        printf("Epoch %d %d/%d\n", i, cnt, num_test_data);
     	    printf("Epoch %d predict run time: %ld ms\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(now() - training_time).count());
 	    }
+
+        _num_epochs = i + 1;
+        if(_path != ""){
+            write_model(_path);
+        }
     }//end all epoch
+}
 
-    delete mini_batch_data;
-    delete mini_batch_label;
+InferenceEngine* CNN::export_engine(){
+    if(_layers.size() < 2 || typeid(*_layers.back()) != typeid(FullConnectionLayer)){
+        printf("CNN export_engine needs a network ending in FullConnectionLayer.\n");
+        return nullptr;
+    }
+
+    auto engine = new InferenceEngine(_layers[0]->get_rows(), _layers[0]->get_cols());
+    bool ok = true;
+    for(uint k = 1; ok && k != _layers.size(); k++){
+        auto layer = _layers[k];
+        if(typeid(*layer) == typeid(ConvolutionLayer)){
+            auto conv = (ConvolutionLayer*)layer;
+            ok = engine->add_convolution(conv->get_weight(0, 0), conv->get_bias(), conv->get_kernal_size(),
+                                         conv->get_stride(), conv->get_activation_type());
+        }else if(typeid(*layer) == typeid(SubSamplingLayer)){
+            auto sub = (SubSamplingLayer*)layer;
+            ok = engine->add_pooling(sub->get_pooling(), sub->get_scale());
+        }else{
+            ok = engine->add_full_connection(layer->get_weight(0, 0), layer->get_bias(), layer->get_activation_type());
+        }
+    }
+    if(!ok){
+        delete engine;
+        return nullptr;
+    }
+    return engine;
+}
+
+void CNN::set_learning_rate(real eta){
+    for(auto layer : _layers){
+        layer->set_alpha(eta);
+    }
+}
+
+void CNN::set_num_thread(uint num_thread){
+    delete _pool;
+    _pool = new ccma::utils::ThreadPool(num_thread);
+    for(auto layer : _layers){
+        layer->set_pool(_pool);
+    }
+}
+
+void CNN::set_fuse_pooling(bool fuse_pooling){
+    _fuse_pooling = fuse_pooling;
+    for(uint k = 0; k + 1 < _layers.size(); k++){
+        if(typeid(*_layers[k]) == typeid(ConvolutionLayer) && typeid(*_layers[k + 1]) == typeid(SubSamplingLayer)){
+            ((ConvolutionLayer*)_layers[k])->fuse_pooling(fuse_pooling ? (SubSamplingLayer*)_layers[k + 1] : nullptr);
+        }
+    }
 }
 
 void CNN::feed_forward(ccma::algebra::BaseMatrixT<real>* mat, bool debug){
@@ -101,7 +173,6 @@ void CNN::feed_forward(ccma::algebra::BaseMatrixT<real>* mat, bool debug){
         auto layer = _layers[k];
         Layer* pre_layer = nullptr;
         if(k == 0){
-            mat->reshape(layer->get_rows(), layer->get_cols());
             ((DataLayer*)layer)->set_x(mat);
         }else{
             pre_layer = _layers[k - 1];
@@ -112,54 +183,231 @@ void CNN::feed_forward(ccma::algebra::BaseMatrixT<real>* mat, bool debug){
 
 void CNN::back_propagation(ccma::algebra::BaseMatrixT<real>* mat, bool debug){
     int layer_size = _layers.size();
-    for(int k = layer_size - 1; k >= 0; k--){
+    ((FullConnectionLayer*)_layers[layer_size - 1])->set_y(mat);
+    for(int k = layer_size - 1; k > 0; k--){
         auto layer = _layers[k];
-        Layer* pre_layer = nullptr;
         Layer* back_layer = nullptr;
-        if(k > 0){
-            pre_layer = _layers[k - 1];
-        }
         if(k < layer_size -1){
             back_layer = _layers[k + 1];
         }
-        if(typeid(*layer) == typeid(FullConnectionLayer)){
-            mat->reshape(mat->get_cols(),mat->get_rows());
-            ((FullConnectionLayer*)_layers[k])->set_y(mat);
-        }
-        layer->back_propagation(pre_layer, back_layer, debug);
+        layer->back_propagation(_layers[k - 1], back_layer, debug);
     }//end back_propagation
+
+    /*
+     * every layer holds the gradients summed over the batch now, one
+     * read only pass over them for the global norm of the mean before
+     * any weight changes.
+     */
+    real grad_scale = 1.0 / mat->get_rows();
+    real ratio = 1.0;
+    if(_clip.is_enabled()){
+        double sq_sum = 0;
+        for(auto layer : _layers){
+            sq_sum += layer->grad_square_sum();
+        }
+        if(!_clip.check(sq_sum, grad_scale, &ratio)){
+            printf("CNN batch skipped, non-finite gradient.\n");
+            return;
+        }
+    }
+    for(auto layer : _layers){
+        layer->apply_gradients(grad_scale * ratio);
+    }
 }
 
-bool CNN::evaluate(ccma::algebra::BaseMatrixT<real>* data, ccma::algebra::BaseMatrixT<real>* label, bool debug){
-    feed_forward(data, debug);
-    auto layer = _layers[_layers.size() - 1];
-    auto predict_mat = layer->get_activation(0);
-    real max_value = 0;
-    int max_idx = 0;
-    uint rows = predict_mat->get_rows();
+uint CNN::evaluate(ccma::algebra::BaseMatrixT<real>* data,
+                   ccma::algebra::BaseMatrixT<real>* label,
+                   uint mini_batch_size,
+                   bool debug){
+    uint rows = data->get_rows();
+    uint cols = data->get_cols();
+    uint out_size = _layers[_layers.size() - 1]->get_size();
+    uint cnt = 0;
+    for(uint j = 0; j < rows; j += mini_batch_size){
+        uint batch_size = std::min(mini_batch_size, rows - j);
+        ccma::algebra::DenseMatrixViewT<real> mini_batch_data(&data->get_data()[j * cols], batch_size, cols);
+        feed_forward(&mini_batch_data, debug);
 
-    for(uint i = 0; i != rows; i++){
-        real value = predict_mat->get_data(i);
-        if(i == 0 || value > max_value){
-            max_value = value;
-            max_idx = i;
+        auto predict_mat = _layers[_layers.size() - 1]->get_activation();
+        for(uint k = 0; k != batch_size; k++){
+            const real* row = &predict_mat->get_data()[k * out_size];
+            int max_idx = std::max_element(row, row + out_size) - row;
+            int y = static_cast<int>(label->get_data(j + k));
+            if(max_idx == y){
+                cnt++;
+            }else if(debug){
+                printf("[%d][%d]\n", max_idx, y);
+            }
+        }
+
+        if(debug){
+            predict_mat->display("|");
         }
     }
+    return cnt;
+}
+
+
+bool CNN::load_model(const std::string& path){
+    std::vector<ccma::algebra::BaseMatrixT<real>*> models;
+    std::shared_ptr<ccma::utils::MappedFile> mapping;
+    if(!loader.map<real>(path, &models, &mapping, "CNNMODEL")){
+        return false;
+    }
+
+    /*
+     * the layers of the file are built and checked on their own, the
+     * current network is only replaced once every weight fits.
+     */
+    std::vector<Layer*> layers;
+    bool is_ok = models.size() >= 2 && models[0]->get_cols() == 5 && models[1]->get_size() == 4;
+    //config values are stored as real, exact whole numbers up to 2^24 even in float
+    auto is_count = [](real value){
+        return value >= 1 && value <= (1 << 24) && value == (uint)value;
+    };
+    auto fits = [&](ccma::algebra::BaseMatrixT<real>* dst, uint idx){
+        return idx < models.size() && dst->get_rows() == models[idx]->get_rows() && dst->get_cols() == models[idx]->get_cols();
+    };
+    //epochs, learning rate, clip norm
+    if(is_ok){
+        auto state = models[1]->get_data();
+        is_ok = (state[0] == 0 || is_count(state[0])) && std::isfinite(state[1]) && state[1] > 0
+             && std::isfinite(state[2]) && state[2] >= 0;
+    }
+
+    uint idx = 2;
+    for(uint i = 0; is_ok && i != models[0]->get_rows(); i++){
+        auto config = models[0];
+        real type = config->get_data(i, 0);
+        real size = config->get_data(i, 1);
+        real arg = config->get_data(i, 2);
+        real channels = config->get_data(i, 3);
+        real pooling_type = config->get_data(i, 4);
+        Layer* layer = nullptr;
+        //only the first layer is a DataLayer, as add_layer
+        if(type == MODEL_DATA_LAYER && i == 0 && is_count(size) && is_count(arg)){
+            layer = new DataLayer((uint)size, (uint)arg);
+        }else if(type == MODEL_CONVOLUTION_LAYER && i > 0 && is_count(size) && is_count(arg) && is_count(channels)){
+            layer = new ConvolutionLayer((uint)size, (uint)arg, (uint)channels);
+        }else if(type == MODEL_SUBSAMPLING_LAYER && i > 0 && is_count(size)){
+            Pooling* pooling = nullptr;
+            if(pooling_type == MODEL_MEAN_POOLING){
+                pooling = new MeanPooling();
+            }else if(pooling_type == MODEL_MAX_POOLING){
+                pooling = new MaxPooling();
+            }else if(pooling_type == MODEL_L2_POOLING){
+                pooling = new L2Pooling();
+            }
+            layer = pooling == nullptr ? nullptr : new SubSamplingLayer((uint)size, pooling);
+        }else if(type == MODEL_FULL_CONNECTION_LAYER && i > 0 && is_count(size) && (arg == 0 || arg == 1)){
+            layer = new FullConnectionLayer((uint)size, arg != 0);
+        }
+        if(layer == nullptr){
+            is_ok = false;
+            break;
+        }
+
+        layer->set_pool(_pool);
+        if(!layer->initialize(layers.empty() ? nullptr : layers.back())){
+            delete layer;
+            is_ok = false;
+            break;
+        }
+        if(!layers.empty()){
+            layers.back()->set_is_last_layer();
+        }
+        layers.push_back(layer);
 
-    if(debug){
-        predict_mat->transpose();
-        predict_mat->display("|");
-        predict_mat->transpose();
-        if(max_idx != label->get_data(0)){
-            printf("[%d][%d]\n", max_idx, static_cast<int>(label->get_data(0)));
+        //the freshly initialized weights are replaced by the stored ones
+        if(type == MODEL_CONVOLUTION_LAYER || type == MODEL_FULL_CONNECTION_LAYER){
+            if(!fits(layer->get_weight(0, 0), idx) || !fits(layer->get_bias(), idx + 1)){
+                is_ok = false;
+                break;
+            }
+            layer->set_weight(0, 0, models[idx]);
+            layer->set_bias(models[idx + 1]);
+            models[idx] = models[idx + 1] = nullptr;
+            idx += 2;
         }
     }
+    is_ok = is_ok && !layers.empty() && idx == models.size();
+
+    if(is_ok){
+        _layers.swap(layers);
+        set_fuse_pooling(_fuse_pooling);
 
-    return max_idx == label->get_data(0);
+        auto state = models[1]->get_data();
+        _num_epochs = (uint)state[0];
+        set_learning_rate(state[1]);
+        _clip.set_max_norm(state[2]);
+        _clip.set_skip_nonfinite(state[3] != 0);
+        _mapping = mapping;
+    }else{
+        printf("CNN model %s does not match its layers.\n", path.c_str());
+    }
+    //the new layers on failure, the old ones otherwise
+    for(auto layer : layers){
+        delete layer;
+    }
+    for(auto model : models){
+        delete model;
+    }
+    return is_ok;
 }
 
+bool CNN::write_model(const std::string& path){
+    if(_layers.empty()){
+        return false;
+    }
 
-bool CNN::check(uint size){
+    std::vector<ccma::algebra::BaseMatrixT<real>*> models;
+    auto config = new ccma::algebra::DenseMatrixMNT<real>(_layers.size(), 5, 0.0);
+    auto state = new ccma::algebra::DenseMatrixMNT<real>(1, 4, 0.0);
+    models.push_back(config);
+    models.push_back(state);
+    for(uint i = 0; i != _layers.size(); i++){
+        auto layer = _layers[i];
+        if(typeid(*layer) == typeid(DataLayer)){
+            config->set_data(MODEL_DATA_LAYER, i, 0);
+            config->set_data(layer->get_rows(), i, 1);
+            config->set_data(layer->get_cols(), i, 2);
+        }else if(typeid(*layer) == typeid(ConvolutionLayer)){
+            auto conv = (ConvolutionLayer*)layer;
+            config->set_data(MODEL_CONVOLUTION_LAYER, i, 0);
+            config->set_data(conv->get_kernal_size(), i, 1);
+            config->set_data(conv->get_stride(), i, 2);
+            config->set_data(conv->get_out_channel_size(), i, 3);
+        }else if(typeid(*layer) == typeid(SubSamplingLayer)){
+            auto sub = (SubSamplingLayer*)layer;
+            auto pooling = sub->get_pooling();
+            config->set_data(MODEL_SUBSAMPLING_LAYER, i, 0);
+            config->set_data(sub->get_scale(), i, 1);
+            config->set_data(typeid(*pooling) == typeid(MaxPooling) ? MODEL_MAX_POOLING :
+                             typeid(*pooling) == typeid(L2Pooling) ? MODEL_L2_POOLING : MODEL_MEAN_POOLING, i, 4);
+        }else{
+            config->set_data(MODEL_FULL_CONNECTION_LAYER, i, 0);
+            config->set_data(layer->get_rows(), i, 1);
+            config->set_data(layer->get_activation_type() == ccma::algebra::Activation::SOFTMAX ? 1 : 0, i, 2);
+        }
+
+        if(typeid(*layer) == typeid(ConvolutionLayer) || typeid(*layer) == typeid(FullConnectionLayer)){
+            models.push_back(layer->get_weight(0, 0));
+            models.push_back(layer->get_bias());
+        }
+    }
+
+    state->set_data(_num_epochs, 0, 0);
+    state->set_data(_layers.back()->get_alpha(), 0, 1);
+    state->set_data(_clip.get_max_norm(), 0, 2);
+    state->set_data(_clip.get_skip_nonfinite() ? 1 : 0, 0, 3);
+
+    bool ret = loader.write<real>(models, path, false, "CNNMODEL");
+    delete config;
+    delete state;
+    return ret;
+}
+
+bool CNN::check(uint size, uint label_size){
     if(_layers.size() <= 2){
         printf("convolution neural network layer must bemore than 2.\n");
         return false;
@@ -172,6 +420,10 @@ bool CNN::check(uint size){
         printf("Data dim size error.");
         return false;
     }
+    if(label_size != _layers[_layers.size() - 1]->get_size()){
+        printf("Label dim size error.");
+        return false;
+    }
     return true;
 }
 
@@ -0,0 +1,268 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-19 10:30
+ * Last modified : 2026-10-19 10:30
+ * Filename      : InferenceEngine.cpp
+ * Description   : Implemention of the inference only cnn
+ **********************************************/
+
+#include "algorithm/cnn/InferenceEngine.h"
+#include <algorithm>
+#include <stdio.h>
+
+namespace ccma{
+namespace algorithm{
+namespace cnn{
+
+InferenceEngine::~InferenceEngine(){
+    for(auto& op : _ops){
+        delete op.pooling;
+    }
+}
+
+uint InferenceEngine::add_params(ccma::algebra::BaseMatrixT<real>* mat){
+    uint offset = _params.size();
+    _params.insert(_params.end(), mat->get_data(), mat->get_data() + mat->get_size());
+    return offset;
+}
+
+bool InferenceEngine::add_convolution(ccma::algebra::BaseMatrixT<real>* weight,
+                                      ccma::algebra::BaseMatrixT<real>* bias,
+                                      uint kernal_size,
+                                      uint stride,
+                                      ccma::algebra::Activation activation){
+    if(_rows < kernal_size || _cols < kernal_size || stride == 0 ||
+       weight->get_rows() != kernal_size * kernal_size * _channels || bias->get_size() != weight->get_cols()){
+        printf("InferenceEngine convolution shape error.\n");
+        return false;
+    }
+
+    Op op;
+    op.type = CONVOLUTION;
+    op.in_rows = _rows;
+    op.in_cols = _cols;
+    op.in_channels = _channels;
+    //same output size as ConvolutionLayer, the last window may hang over
+    op.rows = (_rows - kernal_size + stride - 1) / stride + 1;
+    op.cols = (_cols - kernal_size + stride - 1) / stride + 1;
+    op.channels = weight->get_cols();
+    op.out_rows = op.rows;
+    op.out_cols = op.cols;
+    op.kernal_size = kernal_size;
+    op.stride = stride;
+    op.activation = activation;
+    op.weight = add_params(weight);
+    op.bias = add_params(bias);
+    _ops.push_back(op);
+
+    _rows = op.out_rows;
+    _cols = op.out_cols;
+    _channels = op.channels;
+    plan();
+    return true;
+}
+
+bool InferenceEngine::add_pooling(const Pooling* pooling, uint scale){
+    if(scale == 0 || _rows % scale != 0 || _cols % scale != 0){
+        printf("InferenceEngine pooling scale error:rows[%d]cols[%d]scale[%d].\n", _rows, _cols, scale);
+        return false;
+    }
+
+    if(_ops.empty() || _ops.back().type != CONVOLUTION || _ops.back().pooling != nullptr){
+        Op op;
+        op.type = POOLING;
+        op.in_rows = op.rows = _rows;
+        op.in_cols = op.cols = _cols;
+        op.in_channels = op.channels = _channels;
+        _ops.push_back(op);
+    }
+    Op& op = _ops.back();
+    op.pooling = pooling->clone();
+    op.scale = scale;
+    op.out_rows = op.rows / scale;
+    op.out_cols = op.cols / scale;
+
+    _rows = op.out_rows;
+    _cols = op.out_cols;
+    plan();
+    return true;
+}
+
+bool InferenceEngine::add_full_connection(ccma::algebra::BaseMatrixT<real>* weight,
+                                          ccma::algebra::BaseMatrixT<real>* bias,
+                                          ccma::algebra::Activation activation){
+    if(weight->get_rows() != get_output_size() || bias->get_size() != weight->get_cols()){
+        printf("InferenceEngine full connection shape error.\n");
+        return false;
+    }
+
+    Op op;
+    op.type = FULL_CONNECTION;
+    op.in_rows = 1;
+    op.in_cols = get_output_size();
+    op.in_channels = 1;
+    op.rows = op.cols = op.out_rows = op.out_cols = 1;
+    op.channels = weight->get_cols();
+    op.activation = activation;
+    op.weight = add_params(weight);
+    op.bias = add_params(bias);
+    _ops.push_back(op);
+
+    _rows = _cols = 1;
+    _channels = op.channels;
+    plan();
+    return true;
+}
+
+void InferenceEngine::plan(){
+    /*
+     * tensors live from the op writing them to the last op reading
+     * them: the output of op k until op k + 1, the patches of one image
+     * and the band tile of a fused pooling only within op k. the input
+     * and the last output are the caller's.
+     */
+    struct Tensor{
+        uint size;
+        uint first;
+        uint last;
+        uint* offsets[2];
+    };
+    std::vector<Tensor> tensors;
+    uint num_ops = _ops.size();
+    for(uint k = 0; k != num_ops; k++){
+        Op& op = _ops[k];
+        if(k + 1 != num_ops){
+            tensors.push_back({_block * op.get_out_size(), k, k + 1, {&op.out_offset, &_ops[k + 1].in_offset}});
+        }
+        if(op.type == CONVOLUTION){
+            uint patch_size = op.kernal_size * op.kernal_size * op.in_channels;
+            tensors.push_back({op.rows * op.cols * patch_size, k, k, {&op.patch_offset, nullptr}});
+            if(op.pooling != nullptr){
+                tensors.push_back({op.scale * op.cols * op.channels, k, k, {&op.tile_offset, nullptr}});
+            }
+        }
+    }
+    std::stable_sort(tensors.begin(), tensors.end(), [](const Tensor& a, const Tensor& b){
+        return a.size > b.size;
+    });
+
+    std::vector<std::pair<uint, uint> > placed;//(offset, tensor id)
+    _arena_size = 0;
+    for(uint i = 0; i != tensors.size(); i++){
+        Tensor& tensor = tensors[i];
+        uint offset = 0;
+        std::sort(placed.begin(), placed.end());
+        for(auto& p : placed){
+            const Tensor& other = tensors[p.second];
+            bool is_live = other.first <= tensor.last && tensor.first <= other.last;
+            if(is_live && p.first < offset + tensor.size && offset < p.first + other.size){
+                //aligned end of the overlapping tensor, the later ones start beyond it
+                offset = std::max(offset, (p.first + other.size + _align - 1) / _align * _align);
+            }
+        }
+        placed.push_back(std::make_pair(offset, i));
+        for(auto ptr : tensor.offsets){
+            if(ptr != nullptr){
+                *ptr = offset;
+            }
+        }
+        _arena_size = std::max(_arena_size, offset + tensor.size);
+    }
+}
+
+void InferenceEngine::run(const Op& op, const real* in, real* out, real* arena, uint block_rows) const{
+    const real* weight = &_params[op.weight];
+    const real* bias = &_params[op.bias];
+    uint in_size = op.get_in_size();
+    uint out_size = op.get_out_size();
+
+    if(op.type == FULL_CONNECTION){
+        ccma::algebra::dense_forward(in, weight, bias, (real*)nullptr, out, block_rows, in_size, op.channels, op.activation);
+        return;
+    }
+    if(op.type == POOLING){
+        for(uint i = 0; i != block_rows; i++){
+            op.pooling->pool(&in[i * in_size], op.out_rows, op.out_cols, op.channels, op.scale, &out[i * out_size]);
+        }
+        return;
+    }
+
+    uint patch_size = op.kernal_size * op.kernal_size * op.in_channels;
+    uint band_rows = op.scale * op.cols;
+    real* patches = &arena[op.patch_offset];
+    real* tile = &arena[op.tile_offset];
+    for(uint i = 0; i != block_rows; i++){
+        ccma::algebra::im2row(&in[i * in_size], patches, op.in_rows, op.in_cols, op.in_channels,
+                              op.kernal_size, op.stride, op.rows, op.cols);
+        if(op.pooling == nullptr){
+            ccma::algebra::dense_forward((const real*)patches, weight, bias, (real*)nullptr, &out[i * out_size],
+                                         op.rows * op.cols, patch_size, op.channels, op.activation);
+            continue;
+        }
+        //conv -> bias -> activation of scale rows, pooled while in cache
+        for(uint band_id = 0; band_id != op.out_rows; band_id++){
+            ccma::algebra::dense_forward((const real*)&patches[band_id * band_rows * patch_size], weight, bias, (real*)nullptr,
+                                         tile, band_rows, patch_size, op.channels, op.activation);
+            op.pooling->pool(tile, 1, op.out_cols, op.channels, op.scale,
+                             &out[i * out_size + band_id * op.out_cols * op.channels]);
+        }
+    }
+}
+
+bool InferenceEngine::predict_batch(const real* data,
+                                    uint rows,
+                                    real* out_probability,
+                                    uint* out_label) const{
+    uint num_ops = _ops.size();
+    if(num_ops == 0){
+        return false;
+    }
+
+    static thread_local std::vector<real> arena;
+    if(arena.size() < _arena_size){
+        arena.resize(_arena_size);
+    }
+
+    uint out_size = get_output_size();
+    for(uint start_idx = 0; start_idx < rows; start_idx += _block){
+        uint block_rows = std::min(rows - start_idx, _block);
+        for(uint k = 0; k != num_ops; k++){
+            const Op& op = _ops[k];
+            const real* in = (k == 0) ? &data[start_idx * _input_size] : &arena[op.in_offset];
+            real* out = (k + 1 == num_ops) ? &out_probability[start_idx * out_size] : &arena[op.out_offset];
+            run(op, in, out, arena.data(), block_rows);
+        }
+
+        if(out_label == nullptr){
+            continue;
+        }
+        for(uint j = start_idx; j != start_idx + block_rows; j++){
+            const real* row = &out_probability[j * out_size];
+            out_label[j] = std::max_element(row, row + out_size) - row;
+        }
+    }
+    return true;
+}
+
+bool InferenceEngine::predict_batch(ccma::algebra::BaseMatrixT<real>* data,
+                                    ccma::algebra::BaseMatrixT<real>* out_probability,
+                                    std::vector<uint>* out_label) const{
+    if(data->get_cols() != _input_size){
+        printf("InferenceEngine predict data dim error.\n");
+        return false;
+    }
+    uint rows = data->get_rows();
+    uint out_size = get_output_size();
+    if(out_probability->get_rows() != rows || out_probability->get_cols() != out_size){
+        out_probability->set_shallow_data(new real[rows * out_size], rows, out_size);
+    }
+    if(out_label != nullptr){
+        out_label->resize(rows);
+    }
+    return predict_batch(data->get_data(), rows, out_probability->get_data(),
+                         out_label == nullptr ? nullptr : out_label->data());
+}
+
+}//namespace cnn
+}//namespace algorithm
+}//namespace ccma
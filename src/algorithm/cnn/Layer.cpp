@@ -6,33 +6,88 @@
 * Description: convolutional network 
 **********************************************/
 #include <typeinfo>
+#include <algorithm>
 #include <math.h>
+#include <string.h>
 #include "algorithm/cnn/Layer.h"
+#include "algebra/MatrixKernel.h"
 
 namespace ccma{
 namespace algorithm{
 namespace cnn{
 
+double Layer::grad_square_sum(){
+    double sq_sum = 0;
+    for(auto grad : _grad_weights){
+        if(grad != nullptr){
+            sq_sum += ccma::algebra::sum_square(grad->get_data(), grad->get_size());
+        }
+    }
+    if(_grad_bias != nullptr){
+        sq_sum += ccma::algebra::sum_square(_grad_bias->get_data(), _grad_bias->get_size());
+    }
+    return sq_sum;
+}
+
+void Layer::apply_gradients(real ratio){
+    real alpha = _alpha * ratio;
+    for(uint i = 0; i != _grad_weights.size(); i++){
+        if(_grad_weights[i] != nullptr){
+            _grad_weights[i]->multiply(alpha);
+            _weights[i]->subtract(_grad_weights[i]);
+        }
+    }
+    if(_grad_bias != nullptr){
+        _grad_bias->multiply(alpha);
+        _bias->subtract(_grad_bias);
+    }
+}
+
+ccma::algebra::BaseMatrixT<real>* Layer::get_grad_weight(uint in_channel_id, uint out_channel_id){
+    uint idx = in_channel_id * this->_out_channel_size + out_channel_id;
+    if(_grad_weights.size() != _weights.size()){
+        clear_vector_matrix(&_grad_weights);
+        _grad_weights.resize(_weights.size(), nullptr);
+    }
+    if(_grad_weights[idx] == nullptr){
+        _grad_weights[idx] = new ccma::algebra::DenseMatrixT<real>();
+        resize(_grad_weights[idx], _weights[idx]->get_rows(), _weights[idx]->get_cols());
+    }
+    return _grad_weights[idx];
+}
+
+ccma::algebra::BaseMatrixT<real>* Layer::get_grad_bias(){
+    if(_grad_bias == nullptr){
+        _grad_bias = new ccma::algebra::DenseMatrixT<real>();
+        resize(_grad_bias, _bias->get_rows(), _bias->get_cols());
+    }
+    return _grad_bias;
+}
+
+void Layer::resize(uint batch_size){
+    _batch_size = batch_size;
+    resize(_activation, batch_size, get_size());
+    resize(_delta, batch_size, get_size());
+}
+
+void Layer::resize(ccma::algebra::BaseMatrixT<real>* mat, uint rows, uint cols){
+    if(mat->get_rows() != rows || mat->get_cols() != cols){
+        mat->set_shallow_data(new real[rows * cols], rows, cols);
+    }
+}
+
 bool DataLayer::initialize(Layer* pre_layer){
     return true;
 }
 void DataLayer::feed_forward(Layer* pre_layer, bool debug){
-    auto activation = new ccma::algebra::DenseMatrixT<real>();
-    _x->clone(activation);
-    this->set_activation(0, activation);
+    uint batch_size = _x->get_rows();
+    _batch_size = batch_size;
+    resize(_activation, batch_size, get_size());
+    memcpy(_activation->get_data(), _x->get_data(), sizeof(real) * _x->get_size());
+
     if(debug){
     	printf("DataLayer activation");
-        auto a = new ccma::algebra::DenseMatrixT<int>();
-        int* d = new int[_x->get_rows() * _x->get_cols()];
-		uint size = _x->get_size();
-
-        for(uint i = 0; i != size; i++){
-            d[i] = static_cast<int>(_x->get_data(i));
-        }
-
-        a->set_shallow_data(d, _x->get_rows(), _x->get_cols());
-        a->display("|");
-        delete a;
+        _activation->display("|");
     }
 }
 void DataLayer::back_propagation(Layer* pre_layer, Layer* back_layer, bool debug){
@@ -57,57 +112,81 @@ bool SubSamplingLayer::initialize(Layer* pre_layer){
     set_bias(new ccma::algebra::DenseColMatrixT<real>(this->_out_channel_size, 0.0));
     return true;
 }
+void SubSamplingLayer::prepare(uint batch_size){
+    resize(batch_size);
+    if(_pooling->has_argmax()){
+        _argmax.resize(batch_size * get_size());
+    }
+}
+
 void SubSamplingLayer::feed_forward(Layer* pre_layer, bool debug){
+    if(_is_fused){
+        return;
+    }
+
     // in_channel size equal out_channel size to subsampling layer.
-    for(uint i = 0; i != this->_in_channel_size; i++){
-        auto a = pre_layer->get_activation(i);
-        auto activation = new ccma::algebra::DenseMatrixT<real>();
-        _pooling->pool(a, this->_rows, this->_cols, this->_scale, activation);
-        this->set_activation(i, activation);
+    uint batch_size = pre_layer->get_batch_size();
+    uint pre_size = pre_layer->get_size();
+    uint size = get_size();
+    prepare(batch_size);
+
+    real* a = pre_layer->get_activation()->get_data();
+    real* activation = _activation->get_data();
+    uint* argmax = _pooling->has_argmax() ? _argmax.data() : nullptr;
+    auto pool_task = [&](uint i){
+        _pooling->pool(&a[i * pre_size], this->_rows, this->_cols, this->_out_channel_size, this->_scale,
+                       &activation[i * size], argmax == nullptr ? nullptr : &argmax[i * size]);
+    };
+    parallel_for(batch_size, pool_task);
 
-	    if(debug){
-	        printf("sub feed[%d]", i);
-	        activation->display("|");
-	    }
+    if(debug){
+        printf("SubSamplingLayer feed_forward activation");
+        _activation->display("|");
     }
 }
 void SubSamplingLayer::back_propagation(Layer* pre_layer, Layer* back_layer, bool debug){
-    if(back_layer->get_is_last_layer()){
-        real* data = back_layer->get_delta(0)->get_data();
-        for(uint i = 0; i != this->_out_channel_size; i++){
-            auto delta = new ccma::algebra::DenseMatrixT<real>();
-            real* d = new real[_rows * _cols];
-            memcpy(d, &data[i * this->_rows * this->_cols], sizeof(real) * this->_rows * this->_cols);
-            delta->set_shallow_data(d, this->_rows, this->_cols);
-            this->set_delta(i, delta);
-
-            if(debug){
-	        	printf("sub back-full[%d]", i);
-	            delta->display("|");
-            }
-        }
-    }else if(typeid(*back_layer) == typeid(ConvolutionLayer)){
-        uint stride = ((ConvolutionLayer*)back_layer)->get_stride();
-        auto d = new ccma::algebra::DenseMatrixT<real>();
-        auto w = new ccma::algebra::DenseMatrixT<real>();
-        for(uint i = 0 ; i != this->_out_channel_size; i++){
-            auto delta = new ccma::algebra::DenseMatrixT<real>();
-            for(uint j = 0; j != back_layer->get_out_channel_size(); j++){
-                back_layer->get_delta(j)->clone(d);
-                back_layer->get_weight(i, j)->clone(w);
-                d->convn(w, stride, "full");
-                delta->add(d);
-            }
-            this->set_delta(i, delta);
+    if(typeid(*pre_layer) == typeid(DataLayer)){
+        return;
+    }
 
-            if(debug){
-	        	printf("sub back-conv[%d]", i);
-	        	delta->display("|");
-            }
-	
+    uint batch_size = get_batch_size();
+    uint size = get_size();
+    uint pre_size = pre_layer->get_size();
+    bool has_argmax = _pooling->has_argmax();
+    if(_is_fused && !has_argmax){
+        ((ConvolutionLayer*)pre_layer)->materialize();
+    }
+
+    /*
+     * pre delta = dC/da of the pooling times the derivative of the
+     * activation below. the pooling with argmax routes every error to
+     * one element whose activation is the output itself, so the
+     * derivative is taken on the outputs and the full resolution
+     * activation is not needed(fused convolution).
+     */
+    real* delta = _delta->get_data();
+    real* activation = _activation->get_data();
+    real* pre_delta = pre_layer->get_delta()->get_data();
+    real* pre_activation = has_argmax ? nullptr : pre_layer->get_activation()->get_data();
+    auto backward_task = [&](uint i){
+        real* d = &delta[i * size];
+        real* pre_d = &pre_delta[i * pre_size];
+        if(has_argmax){
+            ccma::algebra::derivative(d, &activation[i * size], size, pre_layer->get_activation_type());
+            _pooling->backward(nullptr, &activation[i * size], d, &_argmax[i * size],
+                               this->_rows, this->_cols, this->_out_channel_size, _scale, pre_d);
+        }else{
+            const real* a = &pre_activation[i * pre_size];
+            _pooling->backward(a, &activation[i * size], d, nullptr,
+                               this->_rows, this->_cols, this->_out_channel_size, _scale, pre_d);
+            ccma::algebra::derivative(pre_d, a, pre_size, pre_layer->get_activation_type());
         }
-        delete d;
-        delete w;
+    };
+    parallel_for(batch_size, backward_task);
+
+    if(debug){
+        printf("SubSamplingLayer back_propagation pre delta");
+        pre_layer->get_delta()->display("|");
     }
 }
 
@@ -125,17 +204,13 @@ bool ConvolutionLayer::initialize(Layer* pre_layer){
 
     this->_in_channel_size = pre_layer->get_out_channel_size();
 
-    for(uint i = 0; i != this->_in_channel_size; i++){
-        for(uint j = 0; j != this->_out_channel_size; j++){
-            auto weight = new ccma::algebra::DenseRandomMatrixT<real>(_kernal_size, _kernal_size, 0.0, 0.5);
-            this->set_weight(i, j, weight);
-        }
-    }
-    for(uint i = 0; i != this->_in_channel_size; i++){
-        for(uint j = 0; j != this->_out_channel_size; j++){
-            this->get_weight(i, j)->display("|");
-        }
-    }
+    /*
+     * row (ky * kernal_size + kx) * in_channel_size + j, column i is the
+     * kernel weight of input channel j to output channel i
+     */
+    auto weight = new ccma::algebra::DenseRandomMatrixT<real>(_kernal_size * _kernal_size * this->_in_channel_size,
+                                                              this->_out_channel_size, 0.0, 0.5);
+    this->set_weight(0, 0, weight);
     /*
      * channel shared the same bias of current layer.
      */
@@ -145,402 +220,514 @@ bool ConvolutionLayer::initialize(Layer* pre_layer){
 }
 
 void ConvolutionLayer::feed_forward(Layer* pre_layer, bool debug){
-    auto a = new ccma::algebra::DenseMatrixT<real>();
-    //foreach output channel
-    for(uint i = 0; i != this->_out_channel_size; i++){
-        auto activation = new ccma::algebra::DenseMatrixT<real>();
-        for(uint j = 0; j != pre_layer->get_out_channel_size(); j++){
-            pre_layer->get_activation(j)->clone(a);
-            a->convn(this->get_weight(j, i), _stride, "valid");
-            //sum all channels of pre_layer.
-            activation->add(a);
-
-            if(debug){
-                printf("ConvolutionLayer convn[%d][%d]", i, j);
-                pre_layer->get_activation(j)->display("|");
-                this->get_weight(j, i)->display("|");
-                a->display("|");
-                activation->display("|");
-            }
-        }
-        //add shared bias of channel in current layer.
-        activation->add(this->get_bias()->get_data(i, 0));
+    uint batch_size = pre_layer->get_batch_size();
+    uint pre_size = pre_layer->get_size();
+    uint num_patches = this->_rows * this->_cols;
+    uint patch_size = _kernal_size * _kernal_size * this->_in_channel_size;
+    uint m = batch_size * num_patches;
+    if(_pooling_layer != nullptr){
+        //only the delta at full resolution
+        _batch_size = batch_size;
+        resize(_delta, batch_size, get_size());
+    }else{
+        resize(batch_size);
+    }
+    resize(_patches, m, patch_size);
+
+    real* a = pre_layer->get_activation()->get_data();
+    real* patches = _patches->get_data();
+    auto im2row_task = [&](uint i){
+        ccma::algebra::im2row(&a[i * pre_size], &patches[i * num_patches * patch_size],
+                              pre_layer->get_rows(), pre_layer->get_cols(), this->_in_channel_size,
+                              _kernal_size, _stride, this->_rows, this->_cols);
+    };
+    parallel_for(batch_size, im2row_task);
+
+    if(_pooling_layer != nullptr){
+        feed_forward_pooled(batch_size);
+    }else{
+        materialize();
+    }
 
-        if(debug){
-            printf("ConvolutionLayer bias [%d][%f]", i, this->get_bias()->get_data(i, 0));
-            activation->display("|");
-        }
+    if(debug){
+        printf("ConvolutionLayer feed_forward activation");
+        (_pooling_layer != nullptr ? _pooling_layer->get_activation() : _activation)->display("|");
+    }
+}
 
-        //if sigmoid activative function.
-        activation->sigmoid();
-        this->set_activation(i, activation);
-	
-	    if(debug){
-	        printf("conv feed activation[%d]", i);
-	        activation->display("|");
-    	}
+void ConvolutionLayer::materialize(){
+    uint m = _batch_size * this->_rows * this->_cols;
+    uint patch_size = _kernal_size * _kernal_size * this->_in_channel_size;
+    resize(_activation, _batch_size, get_size());
 
-    }
-    delete a;
+    /*
+     * sum of all channels of pre_layer plus the shared bias of the
+     * channel, sigmoid activative function.
+     */
+    real* patches = _patches->get_data();
+    real* weight = this->get_weight(0, 0)->get_data();
+    real* bias = this->get_bias()->get_data();
+    real* activation = _activation->get_data();
+    auto forward_task = [&](uint block_id){
+        uint start_idx = block_id * _block_rows;
+        uint rows = std::min(_block_rows, m - start_idx);
+        ccma::algebra::dense_forward(&patches[start_idx * patch_size], weight, bias, (real*)nullptr,
+                                     &activation[start_idx * this->_out_channel_size],
+                                     rows, patch_size, this->_out_channel_size, _activation_type);
+    };
+    parallel_for((m + _block_rows - 1) / _block_rows, forward_task);
 }
 
-void ConvolutionLayer::back_propagation(Layer* pre_layer, Layer* back_layer, bool debug){
-    if(back_layer->get_is_last_layer()){
-        real* data = back_layer->get_delta(0)->get_data();
-		uint size = this->_rows * this->_cols;
-        for(uint i = 0; i != this->_out_channel_size; i++){
-            auto delta = new ccma::algebra::DenseMatrixT<real>();
-            real* d = new real[size];
-            memcpy(d, &data[i * size], sizeof(real) * size);
-            delta->set_shallow_data(d, this->_rows, this->_cols);
-            this->set_delta(i, delta);
-
-            if(debug){
-                printf("ConvolutionLayer-last_layer back_propagation[%d]\n", i);
-                delta->display("|");
-            }
+void ConvolutionLayer::feed_forward_pooled(uint batch_size){
+    uint scale = _pooling_layer->get_scale();
+    uint pooled_rows = this->_rows / scale;
+    uint pooled_cols = this->_cols / scale;
+    uint out_size = this->_out_channel_size;
+    uint patch_size = _kernal_size * _kernal_size * this->_in_channel_size;
+    uint band_rows = scale * this->_cols;
+    uint pooled_size = _pooling_layer->get_size();
+    _pooling_layer->prepare(batch_size);
+
+    real* patches = _patches->get_data();
+    real* weight = this->get_weight(0, 0)->get_data();
+    real* bias = this->get_bias()->get_data();
+    real* pooled = _pooling_layer->get_activation()->get_data();
+    Pooling* pooling = _pooling_layer->get_pooling();
+    uint* argmax = pooling->has_argmax() ? _pooling_layer->get_argmax() : nullptr;
+
+    /*
+     * one task per band of scale output rows of a sample: the
+     * (scale * cols, out channels) tile is computed into a buffer of
+     * the thread and pooled into one output row right away.
+     */
+    auto band_task = [&](uint task_id){
+        uint i = task_id / pooled_rows;
+        uint band_id = task_id % pooled_rows;
+        static thread_local std::vector<real> tile;
+        if(tile.size() < band_rows * out_size){
+            tile.resize(band_rows * out_size);
         }
-    }else if(typeid(*back_layer) == typeid(SubSamplingLayer)){
-
-        SubSamplingLayer* sub_layer = (SubSamplingLayer*)back_layer;
-        uint scale = sub_layer->get_scale();
-
-        for(uint i = 0; i != this->_out_channel_size; i++){
-            /*
-             * derivative_sigmoid: 
-             *  sigmoid(z)*(1-sigmoid(z))
-             *  a = sigmoid(z)
-             */
-            auto delta = new ccma::algebra::DenseMatrixT<real>();
-            auto d = new ccma::algebra::DenseMatrixT<real>();
-            this->get_activation(i)->clone(delta);
-            delta->clone(d);
-			
-    	    d->multiply(-1);
-            d->add(1);
-            delta->multiply(d);
-            delete d;
-
-            auto back_delta = new ccma::algebra::DenseMatrixT<real>();
-            back_layer->get_delta(i)->clone(back_delta);
-
-            /*
-             * subsampling layer reduced matrix dim, so recover it by expand function
-             */
-            back_delta->expand(scale, scale);
-            /*
-             * back layer error sharing
-             */
-            back_delta->division(scale*scale);
-            /*
-             * delta_l = derivative_sigmoid * delta_l+1(recover dim)
-             */
-            delta->multiply(back_delta);
-            delete back_delta;
-
-            this->set_delta(i, delta);
-
-            if(debug){
-                printf("ConvolutionLayer-none_last_layer back_propagation[%d]\n", i);
-                delta->display("|");
+        ccma::algebra::dense_forward(&patches[(i * this->_rows * this->_cols + band_id * band_rows) * patch_size],
+                                     weight, bias, (real*)nullptr, tile.data(), band_rows, patch_size, out_size, _activation_type);
+
+        uint out_idx = i * pooled_size + band_id * pooled_cols * out_size;
+        uint* band_argmax = (argmax == nullptr) ? nullptr : &argmax[out_idx];
+        pooling->pool(tile.data(), 1, pooled_cols, out_size, scale, &pooled[out_idx], band_argmax);
+        if(band_argmax != nullptr){
+            //index in the band to index in the sample
+            for(uint j = 0; j != pooled_cols * out_size; j++){
+                band_argmax[j] += band_id * band_rows * out_size;
             }
-	    }
+        }
+    };
+    parallel_for(batch_size * pooled_rows, band_task);
+}
+
+void ConvolutionLayer::fuse_pooling(SubSamplingLayer* pooling_layer){
+    if(_pooling_layer != nullptr){
+        _pooling_layer->set_fused(false);
     }
+    _pooling_layer = pooling_layer;
+    if(_pooling_layer != nullptr){
+        _pooling_layer->set_fused(true);
+    }
+}
+
+void ConvolutionLayer::back_propagation(Layer* pre_layer, Layer* back_layer, bool debug){
+    uint batch_size = get_batch_size();
+    uint num_patches = this->_rows * this->_cols;
+    uint patch_size = _kernal_size * _kernal_size * this->_in_channel_size;
+    uint out_size = this->_out_channel_size;
+    uint m = batch_size * num_patches;
+    uint num_blocks = (m + _block_rows - 1) / _block_rows;
+
     /*
-     * calc grad and update weight/bias
-     * only for online learning, if batch learning
-     * need to average weight and bias
+     * derivate_weight = patches.T * delta
+     * derivate_bias = sum of delta over the batch and the positions
+     * one partial sum per block of rows, then the blocks are added in
+     * order by chunks of the gradient.
      */
-    auto derivate_weight = new ccma::algebra::DenseMatrixT<real>();
-    real* derivate_bias_data = new real[this->_out_channel_size];
-    for(uint i = 0; i != this->_out_channel_size; i++){
-    	for(uint j = 0; j != pre_layer->get_out_channel_size(); j++){
-			//derivate_weight = pre_layer.activation(j).convn(delta[i], 'valid')
-	        pre_layer->get_activation(j)->clone(derivate_weight);
-
-            if(debug){
-    			derivate_weight->display("|");
-	    		this->get_delta(i)->display("|");
+    uint weight_size = patch_size * out_size;
+    uint grad_size = weight_size + out_size;
+    resize(_grad_partials, num_blocks, grad_size);
+
+    real* delta = _delta->get_data();
+    real* patches = _patches->get_data();
+    real* partials = _grad_partials->get_data();
+    auto grad_task = [&](uint block_id){
+        uint start_idx = block_id * _block_rows;
+        uint rows = std::min(_block_rows, m - start_idx);
+        real* partial = &partials[block_id * grad_size];
+        ccma::algebra::gemm_tn(&patches[start_idx * patch_size], &delta[start_idx * out_size], partial, rows, patch_size, out_size);
+        ccma::algebra::col_sum(&delta[start_idx * out_size], &partial[weight_size], rows, out_size);
+    };
+    parallel_for(num_blocks, grad_task);
+
+    real* grad_weight = get_grad_weight(0, 0)->get_data();
+    real* grad_bias = get_grad_bias()->get_data();
+    const uint chunk_size = 1024;
+    auto reduce_task = [&](uint chunk_id){
+        uint start_idx = chunk_id * chunk_size;
+        uint end_idx = std::min(grad_size, start_idx + chunk_size);
+        for(uint j = start_idx; j < end_idx; j++){
+            real value = 0;
+            for(uint k = 0; k != num_blocks; k++){
+                value += partials[k * grad_size + j];
             }
-		    derivate_weight->convn(this->get_delta(i), _stride, "valid");
-    	    /*
-             * update grad: w -= alpha * derivate_weight
-	         */
-            if(debug){
-			    printf("convolutelayer old derivate_weight");
-			    derivate_weight->display("|");
-            }
-
-	        derivate_weight->multiply(this->_alpha);
-            
-            if(debug){
-    			derivate_weight->display("|");
-                this->get_weight(j, i)->display("|");
+            if(j < weight_size){
+                grad_weight[j] = value;
+            }else{
+                grad_bias[j - weight_size] = value;
             }
+        }
+    };
+    parallel_for((grad_size + chunk_size - 1) / chunk_size, reduce_task);
 
-            this->get_weight(j, i)->subtract(derivate_weight);
-            
-            if(debug){
-                this->get_weight(j, i)->display("|");
-	            printf("conv back derivate_weight[%d][%d]", j , i);
-	            derivate_weight->display("|");
-            }
-    	}
-	    //update bias
-        derivate_bias_data[i] = this->get_delta(i)->sum();
-
-		if(debug){
-			printf("ConvolutionLayer delta[%d]", i);
-			this->get_delta(i)->display("|");
-		}
-    }
-    delete derivate_weight;
-
-    auto derivate_bias = new ccma::algebra::DenseMatrixT<real>();
-    derivate_bias->set_shallow_data(derivate_bias_data, this->_out_channel_size, 1);
-    derivate_bias->multiply(this->_alpha);
-    this->get_bias()->subtract(derivate_bias);
-  
     if(debug){
-	    printf("conv back derivate_bias");
-        derivate_bias->display("|");
+        printf("ConvolutionLayer back_propagation derivate_weight");
+        get_grad_weight(0, 0)->display("|");
+    }
+
+    if(typeid(*pre_layer) == typeid(DataLayer)){
+        return;
     }
 
-    delete derivate_bias;
+    /*
+     * delta of every window element(the patches are not needed any
+     * more), summed back onto the pixels of pre_layer
+     */
+    real* weight = this->get_weight(0, 0)->get_data();
+    auto patch_delta_task = [&](uint block_id){
+        uint start_idx = block_id * _block_rows;
+        uint rows = std::min(_block_rows, m - start_idx);
+        ccma::algebra::gemm_nt(&delta[start_idx * out_size], weight, &patches[start_idx * patch_size], rows, out_size, patch_size);
+    };
+    parallel_for(num_blocks, patch_delta_task);
+
+    uint pre_size = pre_layer->get_size();
+    real* pre_delta = pre_layer->get_delta()->get_data();
+    real* pre_activation = pre_layer->get_activation()->get_data();
+    auto row2im_task = [&](uint i){
+        memset(&pre_delta[i * pre_size], 0, sizeof(real) * pre_size);
+        ccma::algebra::row2im(&patches[i * num_patches * patch_size], &pre_delta[i * pre_size],
+                              pre_layer->get_rows(), pre_layer->get_cols(), this->_in_channel_size,
+                              _kernal_size, _stride, this->_rows, this->_cols);
+        ccma::algebra::derivative(&pre_delta[i * pre_size], &pre_activation[i * pre_size],
+                                  pre_size, pre_layer->get_activation_type());
+    };
+    parallel_for(batch_size, row2im_task);
 }
 
 bool FullConnectionLayer::initialize(Layer* pre_layer){
-    _cols = pre_layer->get_rows() * pre_layer->get_cols() * pre_layer->get_out_channel_size();
+    _cols = pre_layer->get_size();
     this->_in_channel_size = pre_layer->get_out_channel_size();
 
     this->set_bias(new ccma::algebra::DenseColMatrixT<real>(_rows, 0.0));
-    auto weight = new ccma::algebra::DenseRandomMatrixT<real>(this->_rows, this->_cols, 0.0, 0.5);
+    auto weight = new ccma::algebra::DenseRandomMatrixT<real>(this->_cols, this->_rows, 0.0, 0.5);
     this->set_weight(0, 0, weight);
     return true;
 }
 void FullConnectionLayer::feed_forward(Layer* pre_layer, bool debug){
     /*
-     * concatenate pre_layer's all channel mat into vector
+     * the rows of pre_layer's activation are the concatenated channel
+     * vectors already
      */
-    auto a = new ccma::algebra::DenseMatrixT<real>();
-    auto av = new ccma::algebra::DenseMatrixT<real>();
-	uint size = pre_layer->get_rows() * pre_layer->get_cols();;
-    for(uint i = 0; i != this->_in_channel_size; i++){
-        pre_layer->get_activation(i)->clone(a);
-        a->reshape(size, 1);
-        av->extend(a, false);
-    }
-    delete a;
-    if(_av != nullptr){
-        delete _av;
-    }
-    _av = av;
-
-    auto activation = new ccma::algebra::DenseMatrixT<real>();
-    this->get_weight(0, 0)->clone(activation);
-    activation->dot(_av);
-    activation->add(this->get_bias());
-    //if sigmoid activative function
-    activation->sigmoid();
-    this->set_activation(0, activation);
-    
+    uint batch_size = pre_layer->get_batch_size();
+    resize(batch_size);
+    if(_softmax){
+        //keep the logits for the fused loss of back_propagation
+        if(_logits == nullptr){
+            _logits = new ccma::algebra::DenseMatrixT<real>();
+        }
+        resize(_logits, batch_size, _rows);
+    }
+
+    ccma::algebra::dense_forward(pre_layer->get_activation()->get_data(), this->get_weight(0, 0)->get_data(),
+                                 this->get_bias()->get_data(), _softmax ? _logits->get_data() : (real*)nullptr,
+                                 _activation->get_data(), batch_size, _cols, _rows, _activation_type);
+
     if(debug){
         printf("FullConnectionLayer feed_forward activation");
-	    activation->display("|");
+	    _activation->display("|");
     }
-
 }
 
 void FullConnectionLayer::back_propagation(Layer* pre_layer, Layer* back_layer, bool debug){
-    if(_error == nullptr){
-        _error = new ccma::algebra::DenseMatrixT<real>();
-    }
-    this->get_activation(0)->clone(_error);
-    _error->subtract(_y);
-
-	if(debug){
-		printf("FullConnectionLayer back activation");
-		this->get_activation(0)->display("|");
-		printf("FullConnectionLayer back error");
-		_error->display("|");
-	}
-
-    /* loss function, mse mean square error
-     * 1/2 sum(error*error)/size
-     * the size is 1 right here
-     */
-    auto mse_mat = new ccma::algebra::DenseMatrixT<real>();
-    _error->clone(mse_mat);
-    mse_mat->multiply(mse_mat);
-    _loss = mse_mat->sum()/2;
-    delete mse_mat;
+    uint batch_size = get_batch_size();
+    uint size = batch_size * _rows;
+    real* delta = _delta->get_data();
 
-    /*
-     * error * derivate_of_output
-     * derivate_of_output is activation * (1-activation)
-     */
-    auto derivate_output	= new ccma::algebra::DenseMatrixT<real>();
-    auto derivate_output_b 	= new ccma::algebra::DenseMatrixT<real>();
-
-    this->get_activation(0)->clone(derivate_output);
-    derivate_output->clone(derivate_output_b);
-    
-	derivate_output_b->multiply(-1);
-    derivate_output_b->add(1);
-
-    derivate_output->multiply(derivate_output_b);
-    derivate_output->multiply(_error);
-
-    delete derivate_output_b;
-
-    /*
-     * calc delta: weight.T * derivate_output
-     */
-    auto delta = new ccma::algebra::DenseMatrixT<real>();
-    this->get_weight(0, 0)->clone(delta);
-    delta->transpose();
-    delta->dot(derivate_output);
-    this->set_delta(0, delta);
-    //if pre_layer is ConvolutionLayer, has sigmoid function
-    if(typeid(*pre_layer) == typeid(ConvolutionLayer)){
-        auto av1 = new ccma::algebra::DenseMatrixT<real>();
-        auto av2 = new ccma::algebra::DenseMatrixT<real>();
-        _av->clone(av1);
-        _av->clone(av2);
+    if(_softmax){
         /*
-         * derivate_sigmoid: z * (1-z)
+         * cross entropy loss -sum(y * log_softmax(z)) and its
+         * derivate softmax(z) - y in one pass over the logits
          */
-        av2->multiply(-1);
-        av2->add(1);
-        av1->multiply(av2);
-        this->get_delta(0)->multiply(av1);
+        _loss = ccma::algebra::softmax_cross_entropy(_logits->get_data(), _y->get_data(), (real*)nullptr,
+                                                     delta, batch_size, _rows) / batch_size;
+    }else{
+        /*
+         * loss function, mse mean square error 1/2 sum(error*error),
+         * delta = error * derivate_of_output, activation * (1-activation)
+         */
+        real* a = _activation->get_data();
+        real* y = _y->get_data();
+        real loss = 0;
+        for(uint i = 0; i != size; i++){
+            real error = a[i] - y[i];
+            loss += error * error;
+            delta[i] = error * a[i] * (1 - a[i]);
+        }
+        _loss = loss / 2 / batch_size;
+    }
 
-        delete av1;
-        delete av2;
+    if(debug){
+        printf("FullConnectionLayer back_propagation delta");
+        _delta->display("|");
     }
 
     /*
-     * derivate_weight = derivate_output * av.T
-     * derivate_bias = derviate_output
+     * derivate_weight = av.T * delta
+     * derivate_bias = sum of delta over the batch
      */
-    auto derivate_weight = new ccma::algebra::DenseMatrixT<real>();
-    auto derivate_bias   = new ccma::algebra::DenseMatrixT<real>();
-    auto avt             = new ccma::algebra::DenseMatrixT<real>();
+    real* av = pre_layer->get_activation()->get_data();
+    ccma::algebra::gemm_tn(av, delta, get_grad_weight(0, 0)->get_data(), batch_size, _cols, _rows);
+    ccma::algebra::col_sum(delta, get_grad_bias()->get_data(), batch_size, _rows);
 
-    derivate_output->clone(derivate_weight);
-    derivate_output->clone(derivate_bias);
-    delete derivate_output;
-    _av->clone(avt);
-
-    avt->transpose();
-    derivate_weight->dot(avt);
-    delete avt;
+    if(typeid(*pre_layer) == typeid(DataLayer)){
+        return;
+    }
 
     /*
-     * update weight & bias
+     * pre delta: delta * weight.T, times the derivative of pre_layer's
+     * activation function
      */
-    //todo set alpha
-
-    if(debug){
-    	printf("derivate_weight");
-	    derivate_weight->display("|");
-    }
-
-	derivate_weight->multiply(this->_alpha);
-	
-    if(debug){
-    	derivate_weight->display("|");
-    }
+    ccma::algebra::dense_backward(delta, this->get_weight(0, 0)->get_data(), av, pre_layer->get_delta()->get_data(),
+                                  batch_size, _rows, _cols, pre_layer->get_activation_type());
+}
 
-	derivate_bias->multiply(this->_alpha);
-   
-    if(debug){
-    	printf("old weight");
-	    this->get_weight(0, 0)->display("|");
+/*
+ * pooling kernels of one image, SCALE 2 and 3 are compile time
+ * constants so the window loops unroll, 0 uses the scale argument.
+ * w points at the first pixel of a window, the window pixel (m, n)
+ * is w[(m * a_cols + n) * channels + c].
+ */
+#define CCMA_DISPATCH_SCALE(scale, IMPL, ...) \
+    switch(scale){ \
+        case 2: IMPL<2>(__VA_ARGS__); break; \
+        case 3: IMPL<3>(__VA_ARGS__); break; \
+        default: IMPL<0>(__VA_ARGS__); break; \
     }
 
-	this->get_weight(0, 0)->subtract(derivate_weight);
-
-    if(debug){
-	    this->get_weight(0, 0)->display("|");
+template<uint SCALE>
+void mean_pool(const real* a, uint rows, uint cols, uint channels, uint scale, real* out){
+    scale = (SCALE == 0) ? scale : SCALE;
+    uint a_cols = cols * scale;
+    real inv_size = 1.0 / (scale * scale);
+    for(uint j = 0; j != rows; j++){
+        for(uint k = 0; k != cols; k++){
+            const real* w = &a[(j * scale * a_cols + k * scale) * channels];
+            real* o = &out[(j * cols + k) * channels];
+            for(uint c = 0; c != channels; c++){
+                o[c] = 0;
+            }
+            for(uint m = 0; m != scale; m++){
+                for(uint n = 0; n != scale; n++){
+                    const real* p = &w[(m * a_cols + n) * channels];
+                    for(uint c = 0; c != channels; c++){
+                        o[c] += p[c];
+                    }
+                }
+            }
+            for(uint c = 0; c != channels; c++){
+                o[c] *= inv_size;
+            }
+        }
     }
+}
 
-    this->get_bias()->subtract(derivate_bias);
-
-    if(debug){
-        printf("FullConnectionLayer back_propagation derivate_weight");
-        derivate_weight->display("|");
-        printf("FullConnectionLayer back_propagation derivate_bias");
-        derivate_bias->display("|");
+template<uint SCALE>
+void mean_pool_backward(const real* delta, uint rows, uint cols, uint channels, uint scale, real* pre_delta){
+    scale = (SCALE == 0) ? scale : SCALE;
+    uint a_cols = cols * scale;
+    real inv_size = 1.0 / (scale * scale);
+    for(uint j = 0; j != rows; j++){
+        for(uint k = 0; k != cols; k++){
+            const real* d = &delta[(j * cols + k) * channels];
+            real* w = &pre_delta[(j * scale * a_cols + k * scale) * channels];
+            for(uint m = 0; m != scale; m++){
+                for(uint n = 0; n != scale; n++){
+                    real* p = &w[(m * a_cols + n) * channels];
+                    for(uint c = 0; c != channels; c++){
+                        p[c] = d[c] * inv_size;
+                    }
+                }
+            }
+        }
     }
-
-    delete derivate_weight;
-    delete derivate_bias;
 }
 
-void MeanPooling::pool(ccma::algebra::BaseMatrixT<real>* mat,
-                       uint rows,
-                       uint cols,
-                       uint scale,
-                       ccma::algebra::BaseMatrixT<real>* pooling_mat){
-    real* data = new real[rows * cols];
-    uint pooling_size = scale * scale;
+/*
+ * the first largest element of a window wins, as a branch free select
+ * per channel
+ */
+template<uint SCALE>
+void max_pool(const real* a, uint rows, uint cols, uint channels, uint scale, real* out, uint* argmax){
+    scale = (SCALE == 0) ? scale : SCALE;
+    uint a_cols = cols * scale;
     for(uint j = 0; j != rows; j++){
         for(uint k = 0; k != cols; k++){
-            real pooling_value = 0;
+            uint base = (j * scale * a_cols + k * scale) * channels;
+            const real* w = &a[base];
+            real* o = &out[(j * cols + k) * channels];
+            for(uint c = 0; c != channels; c++){
+                o[c] = w[c];
+            }
+            if(argmax == nullptr){
+                for(uint m = 0; m != scale; m++){
+                    for(uint n = (m == 0) ? 1 : 0; n != scale; n++){
+                        const real* p = &w[(m * a_cols + n) * channels];
+                        for(uint c = 0; c != channels; c++){
+                            o[c] = p[c] > o[c] ? p[c] : o[c];
+                        }
+                    }
+                }
+                continue;
+            }
+
+            uint* idx = &argmax[(j * cols + k) * channels];
+            for(uint c = 0; c != channels; c++){
+                idx[c] = base + c;
+            }
             for(uint m = 0; m != scale; m++){
-                for(uint n = 0; n != scale; n++){
-                    pooling_value += mat->get_data(j * scale + m, k * scale + n);
+                for(uint n = (m == 0) ? 1 : 0; n != scale; n++){
+                    uint offset = base + (m * a_cols + n) * channels;
+                    const real* p = &a[offset];
+                    for(uint c = 0; c != channels; c++){
+                        bool take = p[c] > o[c];
+                        o[c] = take ? p[c] : o[c];
+                        idx[c] = take ? offset + c : idx[c];
+                    }
                 }
             }
-            data[j * cols + k] = pooling_value / pooling_size;
         }
     }
-    pooling_mat->set_shallow_data(data, rows, cols);
 }
-void MaxPooling::pool(ccma::algebra::BaseMatrixT<real>* mat,
-                      uint rows,
-                      uint cols,
-                      uint scale,
-                      ccma::algebra::BaseMatrixT<real>* pooling_mat){
-    real* data = new real[rows * cols];
+
+template<uint SCALE>
+void l2_pool(const real* a, uint rows, uint cols, uint channels, uint scale, real* out){
+    scale = (SCALE == 0) ? scale : SCALE;
+    uint a_cols = cols * scale;
     for(uint j = 0; j != rows; j++){
         for(uint k = 0; k != cols; k++){
-            real pooling_value = 0;
+            const real* w = &a[(j * scale * a_cols + k * scale) * channels];
+            real* o = &out[(j * cols + k) * channels];
+            for(uint c = 0; c != channels; c++){
+                o[c] = 0;
+            }
             for(uint m = 0; m != scale; m++){
                 for(uint n = 0; n != scale; n++){
-                    real value = mat->get_data(j * scale + m, k * scale + n);
-                    if((m == 0 && n == 0) || value > pooling_value){
-                        pooling_value = value;
+                    const real* p = &w[(m * a_cols + n) * channels];
+                    for(uint c = 0; c != channels; c++){
+                        o[c] += p[c] * p[c];
                     }
                 }
             }
-            data[j * cols + k] = pooling_value;
+            for(uint c = 0; c != channels; c++){
+                o[c] = sqrt(o[c]);
+            }
         }
     }
-    pooling_mat->set_shallow_data(data, rows, cols);
 }
-void L2Pooling::pool(ccma::algebra::BaseMatrixT<real>* mat,
-                     uint rows,
-                     uint cols,
-                     uint scale,
-                     ccma::algebra::BaseMatrixT<real>* pooling_mat){
-    real* data = new real[rows * cols];
+
+/*
+ * out = sqrt(sum a^2), dout/da = a / out, 0 for an all zero window
+ */
+template<uint SCALE>
+void l2_pool_backward(const real* a, const real* out, const real* delta, uint rows, uint cols, uint channels, uint scale, real* pre_delta){
+    scale = (SCALE == 0) ? scale : SCALE;
+    uint a_cols = cols * scale;
     for(uint j = 0; j != rows; j++){
         for(uint k = 0; k != cols; k++){
-            real pooling_value = 0;
+            uint base = (j * scale * a_cols + k * scale) * channels;
+            const real* o = &out[(j * cols + k) * channels];
+            const real* d = &delta[(j * cols + k) * channels];
             for(uint m = 0; m != scale; m++){
                 for(uint n = 0; n != scale; n++){
-                    real value = mat->get_data(j * scale + m, k * scale + n);
-                    if(value != 0){
-                        pooling_value += (value * value);
+                    uint offset = base + (m * a_cols + n) * channels;
+                    for(uint c = 0; c != channels; c++){
+                        pre_delta[offset + c] = o[c] > 0 ? d[c] * a[offset + c] / o[c] : 0;
                     }
                 }
             }
-            data[j * cols + k] = sqrt(pooling_value);
         }
     }
-    pooling_mat->set_shallow_data(data, rows, cols);
+}
+
+void MeanPooling::pool(const real* a,
+                       uint rows,
+                       uint cols,
+                       uint channels,
+                       uint scale,
+                       real* out,
+                       uint* argmax){
+    CCMA_DISPATCH_SCALE(scale, mean_pool, a, rows, cols, channels, scale, out);
+}
+void MeanPooling::backward(const real* a,
+                           const real* out,
+                           const real* delta,
+                           const uint* argmax,
+                           uint rows,
+                           uint cols,
+                           uint channels,
+                           uint scale,
+                           real* pre_delta){
+    CCMA_DISPATCH_SCALE(scale, mean_pool_backward, delta, rows, cols, channels, scale, pre_delta);
+}
+
+void MaxPooling::pool(const real* a,
+                      uint rows,
+                      uint cols,
+                      uint channels,
+                      uint scale,
+                      real* out,
+                      uint* argmax){
+    CCMA_DISPATCH_SCALE(scale, max_pool, a, rows, cols, channels, scale, out, argmax);
+}
+void MaxPooling::backward(const real* a,
+                          const real* out,
+                          const real* delta,
+                          const uint* argmax,
+                          uint rows,
+                          uint cols,
+                          uint channels,
+                          uint scale,
+                          real* pre_delta){
+    memset(pre_delta, 0, sizeof(real) * rows * cols * channels * scale * scale);
+    uint size = rows * cols * channels;
+    for(uint j = 0; j != size; j++){
+        pre_delta[argmax[j]] = delta[j];
+    }
+}
+
+void L2Pooling::pool(const real* a,
+                     uint rows,
+                     uint cols,
+                     uint channels,
+                     uint scale,
+                     real* out,
+                     uint* argmax){
+    CCMA_DISPATCH_SCALE(scale, l2_pool, a, rows, cols, channels, scale, out);
+}
+void L2Pooling::backward(const real* a,
+                         const real* out,
+                         const real* delta,
+                         const uint* argmax,
+                         uint rows,
+                         uint cols,
+                         uint channels,
+                         uint scale,
+                         real* pre_delta){
+    CCMA_DISPATCH_SCALE(scale, l2_pool_backward, a, out, delta, rows, cols, channels, scale, pre_delta);
 }
 
 }//namespace cnn
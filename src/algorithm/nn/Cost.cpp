@@ -7,6 +7,11 @@
 **********************************************/
 
 #include "algorithm/nn/Cost.h"
+#include <algorithm>
+#include <cmath>
+#include <math.h>
+#include <string.h>
+#include "algebra/MatrixKernel.h"
 
 namespace ccma{
 namespace algorithm{
@@ -28,6 +33,19 @@ void Cost::derivative_sigmoid(ccma::algebra::BaseMatrixT<real>* mat){
     delete sigz;
 }
 
+void Cost::softmax_delta(const real* logits,
+                         const real* y,
+                         uint rows,
+                         uint cols,
+                         real* a,
+                         real* out_cost){
+    if(a != logits){
+        memcpy(a, logits, sizeof(real) * rows * cols);
+    }
+    ccma::algebra::activate(a, rows, cols, ccma::algebra::Activation::SOFTMAX);
+    delta(logits, a, y, rows * cols, out_cost);
+}
+
 /*
  * derivative C_w (a-y) * sigmoid(z) * (1 - sigmoid(z))
  * sigmoid(z) = 1.0/(1.0+exp(-z))
@@ -54,6 +72,16 @@ void QuadraticCost::delta(ccma::algebra::BaseMatrixT<real>* z,
     delete sigz;
 }
 
+void QuadraticCost::delta(const real* z,
+                          const real* a,
+                          const real* y,
+                          uint size,
+                          real* out_cost){
+    for(uint i = 0; i != size; i++){
+        out_cost[i] = (a[i] - y[i]) * a[i] * (1 - a[i]);
+    }
+}
+
 /*
  * derivative C_w = 1/n * ∑(x_j(σ(z) - y))
  */
@@ -70,6 +98,57 @@ void CrossEntropyCost::delta(ccma::algebra::BaseMatrixT<real>* z,
     delete cost;
 }
 
+void CrossEntropyCost::delta(const real* z,
+                             const real* a,
+                             const real* y,
+                             uint size,
+                             real* out_cost){
+    for(uint i = 0; i != size; i++){
+        out_cost[i] = a[i] - y[i];
+    }
+}
+
+void CrossEntropyCost::softmax_delta(const real* logits,
+                                     const real* y,
+                                     uint rows,
+                                     uint cols,
+                                     real* a,
+                                     real* out_cost){
+    ccma::algebra::softmax_cross_entropy(logits, y, a, out_cost, rows, cols);
+}
+
+void DistillationCost::softmax_delta(const real* logits,
+                                     const real* y,
+                                     uint rows,
+                                     uint cols,
+                                     real* a,
+                                     real* out_cost){
+    for(uint i = 0; i != rows; i++){
+        const real* z = &logits[i * cols];
+        const real* hard = &y[i * 2 * cols];
+        const real* soft = &hard[cols];
+        real* p = &a[i * cols];
+        real* out = &out_cost[i * cols];
+        real max_z = *std::max_element(z, z + cols);
+
+        //out holds the tempered exponentials until z is read, a may alias z
+        real soft_sum = 0;
+        for(uint j = 0; j != cols; j++){
+            out[j] = std::exp((z[j] - max_z) / _temperature);
+            soft_sum += out[j];
+        }
+        real sum = 0;
+        for(uint j = 0; j != cols; j++){
+            p[j] = std::exp(z[j] - max_z);
+            sum += p[j];
+        }
+        for(uint j = 0; j != cols; j++){
+            p[j] /= sum;
+            out[j] = (1 - _alpha) * (p[j] - hard[j]) + _alpha * _temperature * (out[j] / soft_sum - soft[j]);
+        }
+    }
+}
+
 }
 }//namespace algorithm
 }//namespace ccma
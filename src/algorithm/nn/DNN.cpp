@@ -7,23 +7,46 @@
 **********************************************/
 
 #include "algorithm/nn/DNN.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
 #include <random>
+#include <string.h>
+#include "algebra/MatrixKernel.h"
+#include "utils/BatchPrefetcher.h"
 #include "utils/Shuffler.h"
 
 namespace ccma{
 namespace algorithm{
 namespace nn{
 
-int DNN::add_layer(int neural_size){
+int DNN::add_layer(int neural_size,
+                   ccma::algebra::Activation activation,
+                   real dropout,
+                   bool batch_norm){
 
     _sizes.push_back(neural_size);
+    _layers.push_back(DNNLayer(neural_size, activation, dropout, _num_layers > 0 && batch_norm));
     return ++_num_layers;
 }
 
 void DNN::init_networks_weights(){
+    _optimizer->reset();
+    _prune_masks.clear();
+    init_parameters();
+
     for(uint i = 1; i < _num_layers; i++){
-        _weights.push_back(new ccma::algebra::DenseRandomMatrixT<real>(_sizes[i-1], _sizes[i], 0, 0.5));
-        _biases.push_back(new ccma::algebra::DenseRandomMatrixT<real>(1, _sizes[i], 0, 0.5));
+        //He initialization for the relu family, the sigmoid default otherwise
+        real stddev = 0.5;
+        if(_layers[i].activation == ccma::algebra::Activation::RELU
+                || _layers[i].activation == ccma::algebra::Activation::LEAKY_RELU){
+            stddev = std::sqrt(2.0 / _sizes[i - 1]);
+        }
+        ccma::algebra::DenseRandomMatrixT<real> weight(_sizes[i-1], _sizes[i], 0, stddev);
+        ccma::algebra::DenseRandomMatrixT<real> bias(1, _sizes[i], 0, stddev);
+        _weights[i - 1]->set_data(&weight);
+        _biases[i - 1]->set_data(&bias);
     }
 }
 
@@ -42,21 +65,226 @@ bool DNN::sgd(ccma::algebra::BaseMatrixT<real>* train_data,
         num_test_data = test_data->get_rows();
     }
 
-    //check nn structure and data dims
-    if(_num_layers <= 1 || _sizes[0] != train_data->get_cols() 
-            || (num_test_data > 0 && _sizes[0] != test_data->get_cols())
-            || train_label->get_cols() != _weights[_weights.size() - 1]->get_cols()){
-        printf("DNN structure check failed.\n");
+    if(!check_structure(train_data->get_cols(), train_label->get_cols(),
+                        num_test_data > 0 ? test_data->get_cols() : _sizes[0])){
+        return false;
+    }
+
+    if(mini_batch_size == 0){
+        mini_batch_size = 1;
+    }
+
+    /*
+     * a replica trains on its own slice of the rows, all slices have
+     * the same size so every replica runs the same batches.
+     */
+    ccma::algebra::BaseMatrixT<real>* slice_data = train_data;
+    ccma::algebra::BaseMatrixT<real>* slice_label = train_label;
+    uint num_slice_data = num_train_data;
+    if(_communicator != nullptr && _communicator->get_size() > 1){
+        num_slice_data = num_train_data / _communicator->get_size();
+        if(num_slice_data == 0){
+            printf("DNN train data has fewer rows than replicas.\n");
+            return false;
+        }
+
+        uint start_idx = _communicator->get_rank() * num_slice_data;
+        auto slice = [&](ccma::algebra::BaseMatrixT<real>* src) -> ccma::algebra::BaseMatrixT<real>*{
+            uint cols = src->get_cols();
+            auto dst = new ccma::algebra::DenseMatrixT<real>(num_slice_data, cols);
+            memcpy(dst->get_data(), &src->get_data()[start_idx * cols], sizeof(real) * num_slice_data * cols);
+            return dst;
+        };
+        slice_data = slice(train_data);
+        slice_label = slice(train_label);
+
+        if(!broadcast_replicas()){
+            delete slice_data;
+            delete slice_label;
+            return false;
+        }
+    }
+
+    /*
+     * batches are gathered by a background thread into preallocated
+     * slots while the pool trains on the previous one.
+     */
+    auto shuffler           = _is_seeded ? new ccma::utils::Shuffler(num_slice_data, _seed)
+                                         : new ccma::utils::Shuffler(num_slice_data);
+    auto prefetcher         = new ccma::utils::BatchPrefetcher<real>(slice_data, slice_label, mini_batch_size,
+                                                                     epochs, shuffler, _prefetch_depth);
+
+    /*
+     * validation rows are sampled once, every validation of this run
+     * scores the same rows.
+     */
+    ccma::algebra::BaseMatrixT<real>* validation_data = test_data;
+    ccma::algebra::BaseMatrixT<real>* validation_label = test_label;
+    uint num_validation = _controller.get_validation_rows(num_test_data);
+    if(num_validation < num_test_data){
+        std::vector<uint> rows;
+        sample_validation(num_test_data, num_validation, &rows);
+
+        auto sample = [&](ccma::algebra::BaseMatrixT<real>* src) -> ccma::algebra::BaseMatrixT<real>*{
+            uint cols = src->get_cols();
+            auto dst = new ccma::algebra::DenseMatrixT<real>(num_validation, cols);
+            for(uint k = 0; k != num_validation; k++){
+                memcpy(&dst->get_data()[k * cols], &src->get_data()[rows[k] * cols], sizeof(real) * cols);
+            }
+            return dst;
+        };
+        validation_data = sample(test_data);
+        validation_label = sample(test_label);
+    }
+
+    auto train_batch = [&](uint epoch, uint batch, real batch_eta){
+        ccma::algebra::BaseMatrixT<real>* batch_data = nullptr;
+        ccma::algebra::BaseMatrixT<real>* batch_label = nullptr;
+        prefetcher->next(&batch_data, &batch_label);
+        return mini_batch_update(batch_data, nullptr, batch_label, batch_eta, lamda, num_train_data);
+    };
+    auto validate = [&]{ return evaluate(validation_data, validation_label);};
+
+    bool ret = train_epochs(num_slice_data, prefetcher->get_num_batches(), epochs, eta, mini_batch_size,
+                            num_validation, train_batch, validate);
+
+    if(validation_data != test_data){
+        delete validation_data;
+        delete validation_label;
+    }
+    delete prefetcher;
+    delete shuffler;
+    if(slice_data != train_data){
+        delete slice_data;
+        delete slice_label;
+    }
+
+    return ret;
+}
+
+bool DNN::sgd(ccma::algebra::SparseMatrixT<real>* train_data,
+              ccma::algebra::BaseMatrixT<real>* train_label,
+              uint epochs,
+              real eta,
+              real lamda,
+              uint mini_batch_size,
+              ccma::algebra::SparseMatrixT<real>* test_data,
+              ccma::algebra::BaseMatrixT<real>* test_label){
+
+    uint num_train_data = train_data->get_rows();
+    uint num_test_data = 0;
+    if(test_data != nullptr){
+        num_test_data = test_data->get_rows();
+    }
+
+    if(!check_structure(train_data->get_cols(), train_label->get_cols(),
+                        num_test_data > 0 ? test_data->get_cols() : _sizes[0])){
         return false;
     }
+    if(_layers[0].dropout > 0){
+        printf("DNN structure check failed, sparse input can not have dropout.\n");
+        return false;
+    }
+    if(_communicator != nullptr && _communicator->get_size() > 1){
+        printf("DNN sparse input sgd does not support replicas.\n");
+        return false;
+    }
+
+    if(mini_batch_size == 0){
+        mini_batch_size = 1;
+    }
+    mini_batch_size = std::min(mini_batch_size, num_train_data);
+
+    /*
+     * a sparse batch is a copy of the index/value lists of its rows,
+     * O(nnz) per batch, shuffled exactly like the dense prefetcher does.
+     */
+    auto shuffler           = _is_seeded ? new ccma::utils::Shuffler(num_train_data, _seed)
+                                         : new ccma::utils::Shuffler(num_train_data);
+    uint num_batches        = (num_train_data + mini_batch_size - 1) / mini_batch_size;
+    uint label_cols         = train_label->get_cols();
+
+    auto batch_data         = new ccma::algebra::SparseMatrixT<real>(train_data->get_cols());
+    ccma::algebra::BaseMatrixT<real>* batch_labels[2] = {
+        new ccma::algebra::DenseMatrixT<real>(mini_batch_size, label_cols),
+        new ccma::algebra::DenseMatrixT<real>(num_train_data % mini_batch_size, label_cols)
+    };
+
+    ccma::algebra::SparseMatrixT<real>* validation_data = test_data;
+    ccma::algebra::BaseMatrixT<real>* validation_label = test_label;
+    uint num_validation = _controller.get_validation_rows(num_test_data);
+    if(num_validation < num_test_data){
+        std::vector<uint> rows;
+        sample_validation(num_test_data, num_validation, &rows);
+
+        validation_data = new ccma::algebra::SparseMatrixT<real>(test_data->get_cols());
+        validation_label = new ccma::algebra::DenseMatrixT<real>(num_validation, test_label->get_cols());
+        uint cols = test_label->get_cols();
+        for(uint k = 0; k != num_validation; k++){
+            validation_data->add_row(test_data, rows[k]);
+            memcpy(&validation_label->get_data()[k * cols], &test_label->get_data()[rows[k] * cols], sizeof(real) * cols);
+        }
+    }
+
+    auto train_batch = [&](uint epoch, uint batch, real batch_eta){
+        if(batch == 0){
+            shuffler->shuffle();
+        }
+
+        uint start_idx = batch * mini_batch_size;
+        uint batch_rows = std::min(mini_batch_size, num_train_data - start_idx);
+        auto batch_label = batch_labels[batch_rows == mini_batch_size ? 0 : 1];
+
+        batch_data->clear(train_data->get_cols());
+        for(uint k = 0; k != batch_rows; k++){
+            uint row = shuffler->get_row(start_idx + k);
+            batch_data->add_row(train_data, row);
+            memcpy(&batch_label->get_data()[k * label_cols], &train_label->get_data()[row * label_cols], sizeof(real) * label_cols);
+        }
+        return mini_batch_update(nullptr, batch_data, batch_label, batch_eta, lamda, num_train_data);
+    };
+    auto validate = [&]{ return evaluate(validation_data, validation_label);};
+
+    bool ret = train_epochs(num_train_data, num_batches, epochs, eta, mini_batch_size,
+                            num_validation, train_batch, validate);
+
+    if(validation_data != test_data){
+        delete validation_data;
+        delete validation_label;
+    }
+    delete batch_data;
+    delete batch_labels[0];
+    delete batch_labels[1];
+    delete shuffler;
 
-    auto shuffler           = new ccma::utils::Shuffler(num_train_data);
+    return ret;
+}
 
-    auto mini_batch_data    = new ccma::algebra::DenseMatrixT<real>();
-    auto mini_batch_label   = new ccma::algebra::DenseMatrixT<real>();
+bool DNN::train_epochs(uint num_train_data,
+                       uint num_batches,
+                       uint epochs,
+                       real eta,
+                       uint mini_batch_size,
+                       uint num_validation,
+                       const std::function<bool(uint, uint, real)>& train_batch,
+                       const std::function<int()>& validate){
+
+    uint num_shards = (std::min(mini_batch_size, num_train_data) + _shard_size - 1) / _shard_size;
+    init_workspaces(num_shards);
+
+    uint interval = _workspaces[0]->get_checkpoint_interval();
+    //replicas train in lock step, rank 0 reports for all of them
+    bool is_verbose = is_root();
+
+    if(is_verbose && (interval > 1 || _memory_budget > 0)){
+        printf("Checkpoint every %u layers: activations %zu bytes(%zu without), recompute %zu flops per batch\n",
+               interval,
+               num_shards * DNNWorkspace::get_activation_bytes(_layers, _shard_size, interval),
+               num_shards * DNNWorkspace::get_activation_bytes(_layers, _shard_size, 1),
+               num_shards * DNNWorkspace::get_recompute_flops(_layers, _shard_size, interval));
+    }
 
-    auto row_data           = new ccma::algebra::DenseMatrixT<real>();
-    auto row_label          = new ccma::algebra::DenseMatrixT<real>();
+    _controller.start(epochs, num_batches);
 
     auto now = []{return std::chrono::system_clock::now();};
 
@@ -64,285 +292,1206 @@ bool DNN::sgd(ccma::algebra::BaseMatrixT<real>* train_data,
 
         auto start_time = now();
 
-        shuffler->shuffle();
+        for(uint j = 0; j < num_batches; j++){
 
-        for(uint j = 0; j < num_train_data; j++){
+            if(is_verbose && (j * mini_batch_size) % 100 < mini_batch_size){
+                printf("Epoch[%d][%d/%d]training...\r", i, j * mini_batch_size, num_train_data);
+            }
 
-            if( j % 100 == 0){
-                printf("Epoch[%d][%d/%d]training...\r", i, j, num_train_data);
+            if(!train_batch(i, j, _controller.get_eta(eta, i, j))){
+                return false;
             }
+        }
 
-            train_data->get_row_data(shuffler->get_row(j), row_data);
-            mini_batch_data->insert_row_data(j % mini_batch_size, row_data);
+        auto training_time = now();
+        if(is_verbose){
+            printf("Epoch %d train run time: %ld ms\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(training_time - start_time).count());
+        }
 
-            train_label->get_row_data(shuffler->get_row(j), row_label);
-            mini_batch_label->insert_row_data(j % mini_batch_size, row_label);
+        bool is_stop = false;
+        if(num_validation > 0 && _controller.should_validate(i)){
+            int num_correct = validate();
+            if(is_verbose){
+                printf("Epoch %d: %d / %d\n", i, num_correct, num_validation);
+                printf("Epoch %d predict run time: %ld ms\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(now() - training_time).count());
+            }
 
-            if( j % mini_batch_size == mini_batch_size - 1 || j == (num_train_data - 1) ){
-                mini_batch_update(mini_batch_data, mini_batch_label, eta, lamda, num_train_data);
+            //checkpoint on improvement only, replicas leave it to rank 0
+            if(_controller.report(i, (real)num_correct / num_validation) && _path != "" && is_root()){
+                write_model(_path);
+            }
+            is_stop = _controller.should_stop();
+        }else if(num_validation == 0 && i + 1 == epochs && _path != "" && is_root()){
+            write_model(_path);
+        }
+
+        if(is_verbose){
+            printf("Epoch %d run time: %ld ms\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(now() - start_time).count());
+        }
 
-                mini_batch_data->clear_matrix();
-                mini_batch_label->clear_matrix();
+        if(is_stop){
+            if(is_verbose){
+                printf("Early stopping at epoch %d, best accuracy %f at epoch %d\n",
+                       i, _controller.get_best_score(), _controller.get_best_epoch());
             }
+            break;
         }
+    }
+    return true;
+}
 
-        if(_path != ""){
-            write_model(_path);
+void DNN::sample_validation(uint num_rows, uint num_validation, std::vector<uint>* rows){
+    ccma::utils::Shuffler sampler = _is_seeded ? ccma::utils::Shuffler(num_rows, _seed + 1)
+                                               : ccma::utils::Shuffler(num_rows);
+    sampler.shuffle();
+
+    rows->resize(num_validation);
+    for(uint k = 0; k != num_validation; k++){
+        rows->at(k) = sampler.get_row(k);
+    }
+}
+
+bool DNN::train_async(ccma::algebra::BaseMatrixT<real>* train_data,
+                      ccma::algebra::BaseMatrixT<real>* train_label,
+                      uint epochs,
+                      real eta,
+                      real lamda,
+                      uint num_thread,
+                      uint staleness,
+                      ccma::algebra::BaseMatrixT<real>* test_data,
+                      ccma::algebra::BaseMatrixT<real>* test_label){
+
+    uint num_train_data = train_data->get_rows();
+    uint num_test_data = 0;
+    if(test_data != nullptr){
+        num_test_data = test_data->get_rows();
+    }
+
+    if(!check_structure(train_data->get_cols(), train_label->get_cols(),
+                        num_test_data > 0 ? test_data->get_cols() : _sizes[0])){
+        return false;
+    }
+
+    if(has_batch_norm()){
+        printf("DNN train_async does not support batch norm layers.\n");
+        return false;
+    }
+
+    if(staleness == 0){
+        staleness = 1;
+    }
+
+    auto pool       = new ccma::utils::ThreadPool(num_thread == 0 ? _num_hardware_concurrency : num_thread);
+    num_thread      = pool->get_num_thread();
+    auto shuffler   = _is_seeded ? new ccma::utils::Shuffler(num_train_data, _seed)
+                                 : new ccma::utils::Shuffler(num_train_data);
+    uint weight_size = _weights.size();
+
+    /*
+     * per worker: local copy of the weights and a one row workspace
+     */
+    std::vector<std::vector<ccma::algebra::BaseMatrixT<real>*> > local_weights(num_thread);
+    std::vector<std::vector<ccma::algebra::BaseMatrixT<real>*> > local_biases(num_thread);
+    std::vector<DNNWorkspace*> workspaces;
+    for(uint i = 0; i != num_thread; i++){
+        init_parameter(&local_weights[i], &local_biases[i]);
+        workspaces.push_back(new DNNWorkspace(_layers, 1));
+    }
+
+    real weight_decay = 1.0 - eta * (lamda / num_train_data);
+    uint data_cols  = train_data->get_cols();
+    uint label_cols = train_label->get_cols();
+
+    auto worker_task = [&](uint worker_id){
+        auto& weights   = local_weights[worker_id];
+        auto& biases    = local_biases[worker_id];
+        auto workspace  = workspaces[worker_id];
+
+        uint start_idx = (uint)((unsigned long long)num_train_data * worker_id / num_thread);
+        uint end_idx   = (uint)((unsigned long long)num_train_data * (worker_id + 1) / num_thread);
+
+        for(uint j = start_idx; j < end_idx; j++){
+            if((j - start_idx) % staleness == 0){
+                for(uint k = 0; k != weight_size; k++){
+                    relaxed_copy(_weights[k], weights[k]);
+                    relaxed_copy(_biases[k], biases[k]);
+                }
+            }
+
+            uint row = shuffler->get_row(j);
+            back_propagation(&train_data->get_data()[row * data_cols], nullptr, 0,
+                             &train_label->get_data()[row * label_cols],
+                             1, &weights, &biases, workspace, dropout_seed(j));
+
+            for(uint k = 0; k != weight_size; k++){
+                relaxed_update(_weights[k], workspace->get_grad_weight(k), weight_decay, eta);
+                relaxed_update(_biases[k], workspace->get_grad_bias(k), 1.0, eta);
+            }
         }
+    };
+
+    auto now = []{return std::chrono::system_clock::now();};
+
+    for(uint i = 0; i < epochs; i++){
+
+        auto start_time = now();
+
+        shuffler->shuffle();
+        _num_step++;
+        pool->parallel_for(num_thread, worker_task);
+        _is_folded = false;
 
         auto training_time = now();
-        printf("Epoch %d train run time: %ld ms\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(training_time - start_time).count());
+        long train_ms = std::chrono::duration_cast<std::chrono::milliseconds>(training_time - start_time).count();
+        printf("Epoch %d async train run time: %ld ms, threads[%d] staleness[%d], %.1f samples/s\n", i, train_ms, num_thread, staleness, train_ms > 0 ? num_train_data * 1000.0 / train_ms : 0.0);
 
         if(num_test_data > 0){
             printf("Epoch %d: %d / %d\n", i, evaluate(test_data, test_label), num_test_data);
             printf("Epoch %d predict run time: %ld ms\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(now() - training_time).count());
         }
-
-        printf("Epoch %d run time: %ld ms\n", i, std::chrono::duration_cast<std::chrono::milliseconds>(now() - start_time).count());
     }
 
-    delete row_data;
-    delete row_label;
+    //once after the last epoch like sgd without validation, outside the timed epochs
+    if(_path != "" && epochs > 0){
+        write_model(_path);
+    }
 
-    delete mini_batch_data;
-    delete mini_batch_label;
+    for(uint i = 0; i != num_thread; i++){
+        clear_parameter(&local_weights[i]);
+        clear_parameter(&local_biases[i]);
+        delete workspaces[i];
+    }
 
     delete shuffler;
+    delete pool;
+
+    return true;
+}
+
+/*
+ * Hogwild! reads and writes, other workers may update the same
+ * element at any time. the relaxed builtins keep every single float
+ * load/store atomic without ordering or locking, lost updates
+ * between workers are accepted by design.
+ */
+void DNN::relaxed_copy(ccma::algebra::BaseMatrixT<real>* src, ccma::algebra::BaseMatrixT<real>* dst){
+    real* src_data = src->get_data();
+    real* dst_data = dst->get_data();
+    uint size = src->get_size();
+    for(uint i = 0; i != size; i++){
+        __atomic_load(&src_data[i], &dst_data[i], __ATOMIC_RELAXED);
+    }
+}
+
+void DNN::relaxed_update(ccma::algebra::BaseMatrixT<real>* param,
+                         ccma::algebra::BaseMatrixT<real>* grad,
+                         real decay,
+                         real eta){
+    real* param_data = param->get_data();
+    real* grad_data = grad->get_data();
+    uint size = param->get_size();
+    real value;
+    for(uint i = 0; i != size; i++){
+        __atomic_load(&param_data[i], &value, __ATOMIC_RELAXED);
+        value = value * decay - eta * grad_data[i];
+        __atomic_store(&param_data[i], &value, __ATOMIC_RELAXED);
+    }
+}
+
+bool DNN::distill(DNN* teacher,
+                  ccma::algebra::BaseMatrixT<real>* train_data,
+                  ccma::algebra::BaseMatrixT<real>* train_label,
+                  uint epochs,
+                  real eta,
+                  real lamda,
+                  uint mini_batch_size,
+                  real temperature,
+                  real alpha,
+                  ccma::algebra::BaseMatrixT<real>* test_data,
+                  ccma::algebra::BaseMatrixT<real>* test_label,
+                  const std::string& soft_target_path){
+    auto softmax = ccma::algebra::Activation::SOFTMAX;
+    if(teacher == nullptr || teacher->_num_layers <= 1 || _num_layers <= 1
+            || teacher->_sizes[0] != _sizes[0] || teacher->_sizes.back() != _sizes.back()
+            || teacher->_layers.back().activation != softmax || _layers.back().activation != softmax
+            || train_label->get_cols() != _sizes.back() || temperature <= 0){
+        printf("DNN distill needs a teacher and a student with the same input and softmax output.\n");
+        return false;
+    }
+
+    auto probability = new ccma::algebra::DenseMatrixT<real>();
+    if(!soft_targets(teacher, train_data, soft_target_path, probability)){
+        delete probability;
+        return false;
+    }
+
+    /*
+     * label row = [y, q], q = softmax(log(p) / T) of the teacher
+     * probabilities p, the same as softmax(z_teacher / T) up to the
+     * probabilities that underflowed.
+     */
+    uint rows = train_data->get_rows();
+    uint cols = _sizes.back();
+    auto label = new ccma::algebra::DenseMatrixT<real>(rows, 2 * cols);
+    for(uint i = 0; i != rows; i++){
+        const real* p = &probability->get_data()[i * cols];
+        real* y = &label->get_data()[i * 2 * cols];
+        real* q = &y[cols];
+        memcpy(y, &train_label->get_data()[i * cols], sizeof(real) * cols);
+
+        real sum = 0;
+        for(uint j = 0; j != cols; j++){
+            q[j] = std::exp(std::log(std::max(p[j], std::numeric_limits<real>::min())) / temperature);
+            sum += q[j];
+        }
+        for(uint j = 0; j != cols; j++){
+            q[j] /= sum;
+        }
+    }
+    delete probability;
+
+    Cost* cost = _cost;
+    _cost = new DistillationCost(temperature, alpha);
+    bool ret = sgd(train_data, label, epochs, eta, lamda, mini_batch_size, test_data, test_label);
+    delete _cost;
+    _cost = cost;
+    delete label;
+
+    return ret;
+}
 
+bool DNN::soft_targets(DNN* teacher,
+                       ccma::algebra::BaseMatrixT<real>* train_data,
+                       const std::string& path,
+                       ccma::algebra::BaseMatrixT<real>* probability){
+    uint rows = train_data->get_rows();
+    uint cols = _sizes.back();
+    if(path != "" && loader.check_signature(path, "DNNSOFT")){
+        std::vector<ccma::algebra::BaseMatrixT<real>*> models;
+        if(loader.read<real>(path, &models, "DNNSOFT") && models.size() == 1
+                && models[0]->get_rows() == rows && models[0]->get_cols() == cols){
+            probability->set_data(models[0]);
+            delete models[0];
+            return true;
+        }
+        for(auto model : models){
+            delete model;
+        }
+    }
+
+    if(!teacher->predict_batch(train_data, probability)){
+        return false;
+    }
+    if(path != ""){
+        loader.write<real>(probability, path, false, "DNNSOFT");
+    }
+    return true;
+}
+
+bool DNN::check_structure(uint train_cols, uint label_cols, uint test_cols){
+    //check nn structure and data dims
+    if(_num_layers <= 1 || _sizes[0] != train_cols || _sizes[0] != test_cols
+            || label_cols != _cost->label_cols(_weights[_weights.size() - 1]->get_cols())){
+        printf("DNN structure check failed.\n");
+        return false;
+    }
+    for(uint i = 1; i + 1 < _num_layers; i++){
+        if(_layers[i].activation == ccma::algebra::Activation::SOFTMAX){
+            printf("DNN structure check failed, softmax is only supported on the output layer.\n");
+            return false;
+        }
+    }
     return true;
 }
 
 void DNN::feedforward(ccma::algebra::BaseMatrixT<real>* mat){
+    prepare_inference();
+
+    uint rows = mat->get_rows();
+    std::vector<real> buffer;
     for(uint i = 0; i < _weights.size(); i++){
-        mat->dot(_weights[i]);
-        mat->add(_biases[i]);
-        mat->sigmoid();
+        uint in_size = _weights[i]->get_rows();
+        uint out_size = _weights[i]->get_cols();
+
+        real* out = new real[rows * out_size];
+        auto sparse_weight = _sparse_weights[i];
+        if(sparse_weight != nullptr){
+            buffer.resize(in_size * SPARSE_FORWARD_BLOCK);
+            ccma::algebra::dense_sparse_forward(mat->get_data(), sparse_weight->get_row_ptr(), sparse_weight->get_col_idx(),
+                                                sparse_weight->get_values(), get_infer_bias(i)->get_data(),
+                                                (real*)nullptr, out, buffer.data(), rows, in_size, out_size, _layers[i + 1].activation);
+        }else{
+            ccma::algebra::dense_forward(mat->get_data(), get_infer_weight(i)->get_data(), get_infer_bias(i)->get_data(),
+                                         (real*)nullptr, out, rows, in_size, out_size, _layers[i + 1].activation);
+        }
+        mat->set_shallow_data(out, rows, out_size);
     }
 }
 
-int DNN::evaluate(ccma::algebra::BaseMatrixT<real>* test_data, ccma::algebra::BaseMatrixT<real>* test_label){
+bool DNN::predict_batch(ccma::algebra::BaseMatrixT<real>* data,
+                        ccma::algebra::BaseMatrixT<real>* out_probability,
+                        std::vector<uint>* out_label){
+    if(data->get_cols() != _sizes[0]){
+        printf("DNN predict data check failed.\n");
+        return false;
+    }
+    return predict(data->get_data(), nullptr, data->get_rows(), out_probability, out_label);
+}
 
-    uint num            = 0;
-    auto predict_mat    = new ccma::algebra::DenseMatrixT<real>();
-    uint num_test_data  = test_data->get_rows();
-    real max_value, value;
-    uint max_index;
+bool DNN::predict_batch(ccma::algebra::SparseMatrixT<real>* data,
+                        ccma::algebra::BaseMatrixT<real>* out_probability,
+                        std::vector<uint>* out_label){
+    if(data->get_cols() != _sizes[0]){
+        printf("DNN predict data check failed.\n");
+        return false;
+    }
+    return predict(nullptr, data, data->get_rows(), out_probability, out_label);
+}
 
-    for(uint i = 0; i < num_test_data; i++){
-        test_data->get_row_data(i, predict_mat);
+bool DNN::predict(const real* data,
+                  const ccma::algebra::SparseMatrixT<real>* sparse_data,
+                  uint rows,
+                  ccma::algebra::BaseMatrixT<real>* out_probability,
+                  std::vector<uint>* out_label){
 
-        feedforward(predict_mat);
+    uint weight_size = _weights.size();
+    if(weight_size == 0){
+        printf("DNN predict data check failed.\n");
+        return false;
+    }
 
-        max_value = 0;
-        max_index = 0;
+    prepare_inference();
 
-        uint size = predict_mat->get_cols();
-        for(uint j = 0; j < size; j++){
-            value = predict_mat->get_data(j);
-            if(value > max_value){
-                max_value = value;
-                max_index = j;
+    uint out_size = _sizes[_num_layers - 1];
+    if(out_probability->get_rows() != rows || out_probability->get_cols() != out_size){
+        out_probability->set_shallow_data(new real[rows * out_size], rows, out_size);
+    }
+    if(out_label != nullptr){
+        out_label->resize(rows);
+    }
+
+    uint max_size = 0;
+    for(uint i = 1; i < _num_layers - 1; i++){
+        max_size = std::max(max_size, _sizes[i]);
+    }
+    uint max_sparse_size = 0;
+    for(uint i = 0; i < weight_size; i++){
+        if(_sparse_weights[i] != nullptr){
+            max_sparse_size = std::max(max_sparse_size, _sizes[i]);
+        }
+    }
+
+    /*
+     * task t handles blocks t, t + num_task, ... with its own two buffers
+     * of (_predict_block, max_size), the hidden activations of a block
+     * never leave the cache before the next layer reads them.
+     * layer i only reads the output of layer i - 1, so two buffers used
+     * alternately cover any depth. dropout is off and batch norm is
+     * folded into the weights, every layer is one fused pass.
+     * a third buffer holds the transposed rows of sparse weight layers.
+     */
+    uint num_block = (rows + _predict_block - 1) / _predict_block;
+    uint num_task = std::min(num_block, _pool->get_num_thread());
+    uint buffer_size = _predict_block * max_size;
+    uint task_size = 2 * buffer_size + max_sparse_size * SPARSE_FORWARD_BLOCK;
+    if(_predict_buffer.size() < num_task * task_size){
+        _predict_buffer.resize(num_task * task_size);
+    }
+
+    real* probability = out_probability->get_data();
+    auto predict_task = [&](uint task_id){
+        real* task_buffer = &_predict_buffer[task_id * task_size];
+        real* buffer[3] = {task_buffer, &task_buffer[buffer_size], &task_buffer[2 * buffer_size]};
+
+        for(uint block_id = task_id; block_id < num_block; block_id += num_task){
+            uint start_idx = block_id * _predict_block;
+            uint block_rows = std::min(rows - start_idx, _predict_block);
+
+            const real* activation = (data == nullptr) ? nullptr : &data[start_idx * _sizes[0]];
+            for(uint i = 0; i < weight_size; i++){
+                real* out = (i == weight_size - 1) ? &probability[start_idx * out_size] : buffer[i % 2];
+                auto sparse_weight = _sparse_weights[i];
+                if(activation == nullptr){
+                    ccma::algebra::sparse_dense_forward(&sparse_data->get_row_ptr()[start_idx], sparse_data->get_col_idx(), sparse_data->get_values(),
+                                                        get_infer_weight(i)->get_data(), get_infer_bias(i)->get_data(), (real*)nullptr, out,
+                                                        block_rows, _sizes[i + 1], _layers[i + 1].activation);
+                }else if(sparse_weight != nullptr){
+                    ccma::algebra::dense_sparse_forward(activation, sparse_weight->get_row_ptr(), sparse_weight->get_col_idx(),
+                                                        sparse_weight->get_values(), get_infer_bias(i)->get_data(), (real*)nullptr, out,
+                                                        buffer[2], block_rows, _sizes[i], _sizes[i + 1], _layers[i + 1].activation);
+                }else{
+                    ccma::algebra::dense_forward(activation, get_infer_weight(i)->get_data(), get_infer_bias(i)->get_data(), (real*)nullptr, out,
+                                                 block_rows, _sizes[i], _sizes[i + 1], _layers[i + 1].activation);
+                }
+                activation = out;
+            }
+
+            if(out_label == nullptr){
+                continue;
+            }
+            for(uint k = start_idx; k != start_idx + block_rows; k++){
+                const real* row = &probability[k * out_size];
+                out_label->at(k) = std::max_element(row, row + out_size) - row;
             }
         }
+    };
+    _pool->parallel_for(num_task, predict_task);
+
+    return true;
+}
+
+int DNN::evaluate(ccma::algebra::BaseMatrixT<real>* test_data, ccma::algebra::BaseMatrixT<real>* test_label){
+
+    auto probability = new ccma::algebra::DenseMatrixT<real>();
+    std::vector<uint> predict_label;
+
+    int num = 0;
+    if(predict_batch(test_data, probability, &predict_label)){
+        num = num_correct(predict_label, test_label);
+    }
+    delete probability;
+
+    return num;
+}
+
+int DNN::evaluate(ccma::algebra::SparseMatrixT<real>* test_data, ccma::algebra::BaseMatrixT<real>* test_label){
+
+    auto probability = new ccma::algebra::DenseMatrixT<real>();
+    std::vector<uint> predict_label;
 
-        if(max_index == test_label->get_data(i)){
+    int num = 0;
+    if(predict_batch(test_data, probability, &predict_label)){
+        num = num_correct(predict_label, test_label);
+    }
+    delete probability;
+
+    return num;
+}
+
+int DNN::num_correct(const std::vector<uint>& predict_label, ccma::algebra::BaseMatrixT<real>* label){
+    real* label_data = label->get_data();
+    int num = 0;
+    for(uint i = 0; i != predict_label.size(); i++){
+        if(predict_label[i] == label_data[i]){
             num++;
         }
     }
-    delete predict_mat;
-
     return num;
 }
 
-void DNN::mini_batch_update(ccma::algebra::BaseMatrixT<real>* mini_batch_data,
+bool DNN::mini_batch_update(ccma::algebra::BaseMatrixT<real>* mini_batch_data,
+                            ccma::algebra::SparseMatrixT<real>* sparse_data,
                             ccma::algebra::BaseMatrixT<real>* mini_batch_label,
                             real eta,
                             real lamda,
                             uint n){
 
-    std::vector<ccma::algebra::BaseMatrixT<real>*> batch_weights;
-    std::vector<ccma::algebra::BaseMatrixT<real>*> batch_biases;
-    init_parameter(&batch_weights, &batch_biases);
-
-    uint row = mini_batch_data->get_rows();
+    bool is_sparse = (mini_batch_data == nullptr);
+    uint row = is_sparse ? sparse_data->get_rows() : mini_batch_data->get_rows();
     uint weight_size = _weights.size();
+    uint data_cols = _sizes[0];
+    uint label_cols = mini_batch_label->get_cols();
 
-    uint num_thread = _num_hardware_concurrency;
-    if(num_thread > row){
-        num_thread = row;
+    /*
+     * split the batch into contiguous shards of _shard_size rows,
+     * every shard runs on its own workspace, so the workers never
+     * write to shared matrices.
+     */
+    uint num_shards = (row + _shard_size - 1) / _shard_size;
+    init_workspaces(num_shards);
+    for(uint i = 0; i != num_shards; i++){
+        _workspaces[i]->set_sparse_input(is_sparse);
     }
+    _num_step++;
+
+    //rows of the other replicas draw other dropout masks
+    uint rank_offset = (_communicator == nullptr) ? 0 : _communicator->get_rank() * row;
+
+    real* data = is_sparse ? nullptr : mini_batch_data->get_data();
+    real* label = mini_batch_label->get_data();
+    auto shard_task = [&](uint shard_id){
+        uint start_idx = shard_id * _shard_size;
+        uint end_idx = std::min(row, start_idx + _shard_size);
+        back_propagation(is_sparse ? nullptr : &data[start_idx * data_cols], sparse_data, start_idx, &label[start_idx * label_cols], end_idx - start_idx,
+                         &_weights, &_biases, _workspaces[shard_id], dropout_seed(rank_offset + start_idx));
+    };
+    _pool->parallel_for(num_shards, shard_task);
+
+    all_reduce(num_shards);
+    if(!replica_all_reduce(_workspaces[0]->get_grads(), 1.0)){
+        return false;
+    }
+    if(_communicator != nullptr){
+        row *= _communicator->get_size();
+    }
+
+    /*
+     * one read only pass over the summed gradients for the global norm,
+     * a non-finite gradient skips the whole step(running statistics
+     * included), a clipped one only changes grad_scale. replicas see
+     * the same sums, so they all take the same decision.
+     */
+    real grad_scale = 1.0 / row;
+    if(_clip.is_enabled()){
+        real ratio = 1.0;
+        if(!_clip.check(grad_square_sum(is_sparse), grad_scale, &ratio)){
+            if(is_root()){
+                printf("DNN step %llu skipped, non-finite gradient.\n", _num_step);
+            }
+            return true;
+        }
+        grad_scale *= ratio;
+    }
+
+    update_running_stat(num_shards);
+    if(_communicator != nullptr && !replica_all_reduce(&_running_stats, 1.0 / _communicator->get_size())){
+        return false;
+    }
+
+    /*
+     * batch update with average grad and L2 weight decay
+     * g = batch_grad / m + lamda / n * w
+     * the parameters are one optimizer slot, updated in two streaming
+     * passes: the weights with decay, then biases and gamma/beta.
+     * a sparse input only updates the weight 0 rows of its nonzeros.
+     */
+    real decay = lamda / n;
+    real* params = _params.get_data();
+    real* grads = _workspaces[0]->get_grads()->get_data();
+    uint decay_start = 0;
+    uint decay_end = _params.get_offset(weight_size);
+    _optimizer->step(eta);
+    _optimizer->reserve(0, _params.get_size());
+    if(is_sparse){
+        auto active_rows = _workspaces[0]->get_active_rows();
+        _optimizer->update_rows(0, params, grads, _weights[0]->get_size(),
+                                active_rows->data(), active_rows->size(), _weights[0]->get_cols(),
+                                grad_scale, decay, _pool);
+        decay_start = _params.get_offset(1);
+    }
+    _optimizer->update_range(0, decay_start, &params[decay_start], &grads[decay_start],
+                             decay_end - decay_start, grad_scale, decay, _pool);
+    _optimizer->update_range(0, decay_end, &params[decay_end], &grads[decay_end],
+                             _params.get_size() - decay_end, grad_scale, 0.0, _pool);
+
+    apply_prune_masks();
+    _is_folded = false;
+    return true;
+}
+
+void DNN::set_optimizer(Optimizer* optimizer){
+    if(optimizer == nullptr || optimizer == _optimizer){
+        return;
+    }
+    delete _optimizer;
+    _optimizer = optimizer;
+}
+
+void DNN::init_workspaces(uint num_shards){
+    uint interval = checkpoint_interval(num_shards);
+
+    //network, shard size or checkpointing changed(e.g. load_model), drop the old buffers
+    if(_workspaces.size() > 0 && !_workspaces[0]->fit(_layers, _shard_size, interval)){
+        clear_workspaces();
+    }
+
+    while(_workspaces.size() < num_shards){
+        _workspaces.push_back(new DNNWorkspace(_layers, _shard_size, interval));
+    }
+}
 
-    auto train_data  = new ccma::algebra::DenseMatrixT<real>[num_thread];
-    auto train_label = new ccma::algebra::DenseMatrixT<real>[num_thread];
+/*
+ * the smallest interval whose activations fit the memory budget, the
+ * one with the fewest bytes if none does.
+ */
+uint DNN::checkpoint_interval(uint num_shards){
+    if(_memory_budget == 0){
+        return _checkpoint_interval;
+    }
 
-    if(num_thread > 1){
-        //multithread parallel training
-        uint thread_epochs = row / num_thread;
-        if(row % num_thread != 0){
-            thread_epochs += 1;
+    uint best_interval = 1;
+    size_t best_bytes = 0;
+    for(uint interval = 1; interval < _num_layers; interval++){
+        size_t bytes = num_shards * DNNWorkspace::get_activation_bytes(_layers, _shard_size, interval);
+        if(bytes <= _memory_budget){
+            return interval;
         }
+        if(interval == 1 || bytes < best_bytes){
+            best_interval = interval;
+            best_bytes = bytes;
+        }
+    }
+    return best_interval;
+}
 
-        std::vector<std::thread> threads(num_thread);
+void DNN::clear_workspaces(){
+    for(auto workspace : _workspaces){
+        delete workspace;
+    }
+    _workspaces.clear();
+}
 
-        for(uint i = 0; i < thread_epochs; i++){
-            uint thread_size = num_thread;
-            if(i == thread_epochs - 1){
-                thread_size = row - i * num_thread;
+/*
+ * pairwise tree reduction of the shard gradients into shard 0.
+ * the pairing only depends on num_shards, so the float summation
+ * order is the same whatever the number of threads is.
+ */
+void DNN::all_reduce(uint num_shards){
+
+    //sparse input: only the active rows of weight 0 are nonzero
+    auto add_rows = [](DNNWorkspace* dst, DNNWorkspace* src){
+        real* dst_data = dst->get_grad_weight(0)->get_data();
+        real* src_data = src->get_grad_weight(0)->get_data();
+        uint cols = dst->get_grad_weight(0)->get_cols();
+        for(auto row : *src->get_active_rows()){
+            dst->mark_active_row(row);
+            for(uint j = row * cols; j != (row + 1) * cols; j++){
+                dst_data[j] += src_data[j];
             }
-
-            for(uint j = 0; j < thread_size; j++){
-                mini_batch_data->get_row_data(i * num_thread + j, &train_data[j]);
-                mini_batch_label->get_row_data(i * num_thread + j, &train_label[j]);
-                threads[j] = std::thread(std::mem_fn(&DNN::back_propagation), this, &train_data[j], &train_label[j], &batch_weights, &batch_biases);
+        }
+    };
+
+    for(uint stride = 1; stride < num_shards; stride <<= 1){
+        auto reduce_task = [&](uint pair_id){
+            uint dst = pair_id * 2 * stride;
+            uint src = dst + stride;
+            if(src >= num_shards){
+                return;
+            }
+            auto dst_grads = _workspaces[dst]->get_grads();
+            auto src_grads = _workspaces[src]->get_grads();
+            uint start_idx = 0;
+            if(_workspaces[dst]->is_sparse_input()){
+                add_rows(_workspaces[dst], _workspaces[src]);
+                start_idx = dst_grads->get_offset(1);
             }
 
-            for(uint j = 0; j < thread_size; j++){
-                threads[j].join();
+            real* dst_data = dst_grads->get_data();
+            real* src_data = src_grads->get_data();
+            uint size = dst_grads->get_size();
+            for(uint j = start_idx; j < size; j++){
+                dst_data[j] += src_data[j];
             }
-        }
-    }else{
-        //main thread training
-        for(uint i = 0; i < row; i++){
-            mini_batch_data->get_row_data(i, &train_data[0]);
-            mini_batch_label->get_row_data(i, &train_label[0]);
+        };
+        _pool->parallel_for((num_shards + 2 * stride - 1) / (2 * stride), reduce_task);
+    }
+}
 
-            back_propagation(&train_data[0], &train_label[0], &batch_weights, &batch_biases);
+/*
+ * squared norm of the reduced gradients of workspace 0, summed over
+ * chunks in order so the result does not depend on the threads.
+ * a sparse input only reads the active rows of weight 0.
+ */
+double DNN::grad_square_sum(bool is_sparse){
+    auto grads = _workspaces[0]->get_grads();
+    real* data = grads->get_data();
+    uint start_idx = 0;
+    double sq_sum = 0;
+    if(is_sparse){
+        uint cols = _weights[0]->get_cols();
+        for(auto row : *_workspaces[0]->get_active_rows()){
+            sq_sum += ccma::algebra::sum_square(&data[row * cols], cols);
         }
+        start_idx = grads->get_offset(1);
     }
 
-    delete[] train_data;
-    delete[] train_label;
+    const uint chunk_size = 8192;
+    uint size = grads->get_size() - start_idx;
+    uint num_chunk = (size + chunk_size - 1) / chunk_size;
+    _grad_partials.resize(num_chunk);
+    auto chunk_task = [&](uint chunk_id){
+        uint offset = start_idx + chunk_id * chunk_size;
+        _grad_partials[chunk_id] = ccma::algebra::sum_square(&data[offset], std::min(chunk_size, grads->get_size() - offset));
+    };
+    _pool->parallel_for(num_chunk, chunk_task);
+    for(auto partial : _grad_partials){
+        sq_sum += partial;
+    }
+    return sq_sum;
+}
 
-    /*
-     * batch update with average grad
-     * w_k --> w'_k = w_k - eta/m * batch_weights
-     * b_k --> b'_k = b_k - eta/m * batch_biases
-    */
-    real weight_decay = 1.0 - eta * (lamda / n);
-    for(uint i = 0; i < weight_size; i++){
-        batch_weights[i]->multiply(eta);
-        batch_weights[i]->division(mini_batch_data->get_rows());
-        _weights[i]->multiply(weight_decay);
-        _weights[i]->subtract(batch_weights[i]);
+/*
+ * copies the parameters of rank 0 to every replica before training,
+ * the others start from zero so the sum is the root's values.
+ */
+bool DNN::broadcast_replicas(){
+    if(_communicator == nullptr || _communicator->get_size() == 1){
+        return true;
+    }
 
-        batch_biases[i]->multiply(eta);
-        batch_biases[i]->division(mini_batch_data->get_rows());
-        _biases[i]->subtract(batch_biases[i]);
+    if(!is_root()){
+        memset(_params.get_data(), 0, sizeof(real) * _params.get_size());
+        memset(_running_stats.get_data(), 0, sizeof(real) * _running_stats.get_size());
     }
+    return replica_all_reduce(&_params, 1.0) && replica_all_reduce(&_running_stats, 1.0);
+}
 
-    clear_parameter(&batch_weights);
-    clear_parameter(&batch_biases);
+/*
+ * buffer = scale * sum of buffer over the replicas, nothing to do
+ * without replicas.
+ */
+bool DNN::replica_all_reduce(ParameterBuffer* buffer, real scale){
+    if(_communicator == nullptr || _communicator->get_size() == 1 || buffer->get_size() == 0){
+        return true;
+    }
+    if(!_communicator->all_reduce(buffer->get_data(), buffer->get_size())){
+        printf("DNN all-reduce between replicas failed on rank %u.\n", _communicator->get_rank());
+        return false;
+    }
+
+    if(scale != 1.0){
+        real* data = buffer->get_data();
+        for(uint i = 0; i != buffer->get_size(); i++){
+            data[i] *= scale;
+        }
+    }
+    return true;
 }
 
-void DNN::back_propagation(ccma::algebra::BaseMatrixT<real>* train_data,
-                           ccma::algebra::BaseMatrixT<real>* train_label,
-                           std::vector<ccma::algebra::BaseMatrixT<real>*>* batch_weights,
-                           std::vector<ccma::algebra::BaseMatrixT<real>*>* batch_biases){
+void DNN::set_num_thread(uint num_thread){
+    delete _pool;
+    _pool = new ccma::utils::ThreadPool(num_thread);
+}
 
-    std::vector<ccma::algebra::BaseMatrixT<real>*> train_weights;
-    std::vector<ccma::algebra::BaseMatrixT<real>*> train_biases;
-    init_parameter(&train_weights, &train_biases);
+/*
+ * forward and backward pass of rows samples at once, data(rows, sizes[0])
+ * and label(rows, sizes[-1]) are row major.
+ * the weight/bias(and gamma/beta) gradients summed over the rows are
+ * written to the workspace, nothing is allocated.
+ * seed picks the dropout masks of these rows.
+ */
+void DNN::back_propagation(const real* data,
+                           const ccma::algebra::SparseMatrixT<real>* sparse_data,
+                           uint sparse_start,
+                           const real* label,
+                           uint rows,
+                           std::vector<ccma::algebra::BaseMatrixT<real>*>* weights,
+                           std::vector<ccma::algebra::BaseMatrixT<real>*>* biases,
+                           DNNWorkspace* workspace,
+                           unsigned long long seed){
+
+    uint weight_size = weights->size();
 
-    std::vector<ccma::algebra::BaseMatrixT<real>*> zs;
-    std::vector<ccma::algebra::BaseMatrixT<real>*> activations;
+    /*
+     * sparse input rows as a CSR view, the weight 0 gradient rows of
+     * their nonzeros are the active rows of this batch.
+     */
+    const uint* row_ptr = nullptr;
+    if(data == nullptr){
+        row_ptr = &sparse_data->get_row_ptr()[sparse_start];
+        const uint* col_idx = sparse_data->get_col_idx();
+        workspace->clear_active_rows();
+        for(uint p = row_ptr[0]; p != row_ptr[rows]; p++){
+            workspace->mark_active_row(col_idx[p]);
+        }
+    }
 
-    auto activation = new ccma::algebra::DenseMatrixT<real>();
-    train_data->clone(activation);
+    /*
+     * input of weight layer i, the dropped out activation if layer i
+     * has dropout
+     */
+    auto layer_input = [&](uint i) -> const real*{
+        if(_layers[i].dropout > 0){
+            return workspace->get_dropout_out(i);
+        }
+        return (i == 0) ? data : workspace->get_activation(i - 1);
+    };
 
-    auto as = new ccma::algebra::DenseMatrixT<real>();
-    activation->clone(as);
-    activations.push_back(as);//store all activation layer by layer
+    /*
+     * fused dense layer i, layer 0 gathers the weight rows of a sparse input
+     */
+    auto dense_layer = [&](uint i, real* z, real* out, ccma::algebra::Activation activation){
+        uint in_size = weights->at(i)->get_rows();
+        uint out_size = weights->at(i)->get_cols();
+        if(i == 0 && row_ptr != nullptr){
+            ccma::algebra::sparse_dense_forward(row_ptr, sparse_data->get_col_idx(), sparse_data->get_values(),
+                                                weights->at(i)->get_data(), biases->at(i)->get_data(),
+                                                z, out, rows, out_size, activation);
+        }else{
+            ccma::algebra::dense_forward(layer_input(i), weights->at(i)->get_data(), biases->at(i)->get_data(),
+                                         z, out, rows, in_size, out_size, activation);
+        }
+    };
 
     /*
      * feedforward
-     * a_l = sigmoid(w_l * a_l-1 + b_l)
+     * z_l = a_l-1 * w_l + b_l
+     * z_l = batch_norm(z_l)       if batch norm
+     * a_l = act(z_l)
+     * the dropout masks only depend on seed, so a recomputed layer
+     * gets exactly the values of the first pass.
      */
-    for(uint i = 0; i < _weights.size(); i++){
+    auto forward_layer = [&](uint i){
+        uint in_size = weights->at(i)->get_rows();
+        uint out_size = weights->at(i)->get_cols();
+
+        if(_layers[i].dropout > 0){
+            const real* activation = (i == 0) ? data : workspace->get_activation(i - 1);
+            ccma::algebra::dropout(activation, workspace->get_dropout_out(i), workspace->get_dropout_mask(i),
+                                   rows * in_size, _layers[i].dropout, seed + ((unsigned long long)i << 56));
+        }
 
-        activation->dot(_weights[i]);
-        activation->add(_biases[i]);
+        real* z = workspace->get_z(i);
+        real* a = workspace->get_activation(i);
+        auto activation = _layers[i + 1].activation;
 
-        auto a_clone = new ccma::algebra::DenseMatrixT<real>();
-        activation->clone(a_clone);
-        zs.push_back(a_clone);//store all z value(not sigmoid) layer by layer
+        //a softmax output is left as logits in a, it is fused with the cost below
+        bool is_logits = (i + 1 == weight_size && activation == ccma::algebra::Activation::SOFTMAX);
+        if(is_logits){
+            activation = ccma::algebra::Activation::LINEAR;
+        }
 
-        activation->sigmoid();
+        if(!_layers[i + 1].batch_norm){
+            dense_layer(i, is_logits ? (real*)nullptr : z, a, activation);
+        }else{
+            dense_layer(i, (real*)nullptr, z, ccma::algebra::Activation::LINEAR);
+            ccma::algebra::batch_norm_forward(z, a, _gammas[i]->get_data(), _betas[i]->get_data(),
+                                              workspace->get_batch_mean(i), workspace->get_batch_var(i),
+                                              workspace->get_batch_inv_std(i), rows, out_size, _batch_norm_epsilon);
+            ccma::algebra::activate(a, rows, out_size, activation);
+        }
+    };
 
-        auto as_clone = new ccma::algebra::DenseMatrixT<real>();
-        activation->clone(as_clone);
-        activations.push_back(as_clone);
+    for(uint i = 0; i < weight_size; i++){
+        forward_layer(i);
     }
-    delete activation;
 
     /*
      * backpropagation
      * L layer(last layer) Error
      * Error δL = cost->delta
      */
-    int last_layer = activations.size() - 1;
-    auto delta = new ccma::algebra::DenseMatrixT<real>();
+    int last_layer = weight_size - 1;
+    if(_layers.back().activation == ccma::algebra::Activation::SOFTMAX){
+        real* logits = workspace->get_activation(last_layer);
+        _cost->softmax_delta(logits, label, rows, weights->at(last_layer)->get_cols(),
+                             logits, workspace->get_delta(last_layer));
+    }else{
+        _cost->delta(workspace->get_z(last_layer),
+                     workspace->get_activation(last_layer),
+                     label,
+                     rows * weights->at(last_layer)->get_cols(),
+                     workspace->get_delta(last_layer));
+    }
 
-    _cost->delta(zs[last_layer -1], activations[last_layer], train_label, delta);
+    for(int i = last_layer; i >= 0; i--){
+        uint in_size = weights->at(i)->get_rows();
+        uint out_size = weights->at(i)->get_cols();
 
-    train_biases[last_layer - 1]->set_data(delta);
+        /*
+         * entering the segment below checkpoint i, its layers were
+         * overwritten by the segments above, recompute them from the
+         * checkpoint below.
+         */
+        if(i < last_layer && workspace->is_checkpoint(i)){
+            for(uint j = workspace->get_segment_start(i); j < (uint)i; j++){
+                forward_layer(j);
+            }
+        }
 
-    /*
-     * Derivative(Cw) = a_in * δ_out
-     * a_in = a_L-1, δ_out = delta
-     */
-    auto act = activations[last_layer - 1];
-    act->transpose();
-    act->dot(delta);
-    train_weights[last_layer - 1]->set_data(act);
+        real* delta = workspace->get_delta(i);
 
-    delete delta;
+        /*
+         * δ_z = batch_norm'(δ_y), gamma/beta gradients on the way
+         */
+        if(_layers[i + 1].batch_norm){
+            ccma::algebra::batch_norm_backward(delta, workspace->get_z(i), _gammas[i]->get_data(),
+                                               workspace->get_batch_inv_std(i),
+                                               workspace->get_grad_gamma(i)->get_data(),
+                                               workspace->get_grad_beta(i)->get_data(),
+                                               rows, out_size);
+        }
 
-    auto mat = new ccma::algebra::DenseMatrixT<real>();
-    auto delta_weight = new ccma::algebra::DenseMatrixT<real>();
-    auto delta_bias = new ccma::algebra::DenseMatrixT<real>();
+        /*
+         * Derivative(Cw) = a_in.T * δ_out
+         * Derivative(Cb) = sum of δ_out over rows
+         */
+        if(i == 0 && row_ptr != nullptr){
+            ccma::algebra::sparse_gemm_tn(row_ptr, sparse_data->get_col_idx(), sparse_data->get_values(),
+                                          delta, workspace->get_grad_weight(i)->get_data(), rows, out_size);
+        }else{
+            ccma::algebra::gemm_tn(layer_input(i), delta, workspace->get_grad_weight(i)->get_data(), rows, in_size, out_size);
+        }
+        ccma::algebra::col_sum(delta, workspace->get_grad_bias(i)->get_data(), rows, out_size);
 
-    /*
-     * δ_l = ( (w_l+1).T * δ_l+1 ) * Derivative(z_l)
-     */
-    for(int i = _weights.size() - 2; i >= 0; i--){
-        _weights[i + 1]->clone(delta_weight);//w_l+1
-        delta_weight->transpose();
+        /*
+         * δ_l = ( δ_l+1 * (w_l+1).T ) ⊙ mask_l ⊙ Derivative(a_l)
+         */
+        if(i > 0){
+            ccma::algebra::dense_backward(delta, weights->at(i)->get_data(), workspace->get_activation(i - 1),
+                                          workspace->get_delta(i - 1), rows, out_size, in_size,
+                                          _layers[i].activation, workspace->get_dropout_mask(i));
+        }
+    }
+}
 
-        train_biases[i + 1]->clone(delta_bias);//δ_l+1
+unsigned long long DNN::dropout_seed(uint start_row){
+    unsigned long long seed = _seed;
+    seed = seed * 0x9e3779b97f4a7c15ULL + _num_step;
+    seed = seed * 0x9e3779b97f4a7c15ULL + start_row;
+    return seed;
+}
 
-        helper.dot(delta_bias, delta_weight, mat);
+bool DNN::has_batch_norm(){
+    for(uint i = 1; i < _layers.size(); i++){
+        if(_layers[i].batch_norm){
+            return true;
+        }
+    }
+    return false;
+}
 
-        //_cost->derivative_sigmoid(zs[i]);//Derivative(z_l)
-        zs[i]->derivative_sigmoid();//Derivative(z_l)
-        mat->multiply(zs[i]);
+/*
+ * allocates the parameters of the layers, gamma and the running var
+ * of batch norm layers start at 1, everything else at 0.
+ */
+void DNN::init_parameters(){
+    clear_parameters();
+    if(_num_layers == 0){
+        return;
+    }
 
-        train_biases[i]->set_data(mat);//Derivative(Cb) = δ
+    layout_parameters(_layers, &_params, &_weights, &_biases, &_gammas, &_betas);
+    for(uint i = 1; i < _num_layers; i++){
+        if(_layers[i].batch_norm){
+            _running_stats.add(1, _sizes[i]);
+            _running_stats.add(1, _sizes[i]);
+        }
+    }
+    _running_stats.allocate();
 
-        /*
-         * Derivative(Cw) = a_in * δ_out
-         * a_in = a_l-1, δ_out = mat
-         * activations include input layer, so l-1 is i.
-         */
-        activations[i]->transpose();
-        helper.dot(activations[i], train_biases[i], mat);
-        train_weights[i]->set_data(mat);
+    uint idx = 0;
+    for(uint i = 1; i < _num_layers; i++){
+        if(!_layers[i].batch_norm){
+            _running_means.push_back(nullptr);
+            _running_vars.push_back(nullptr);
+            _folded_weights.push_back(nullptr);
+            _folded_biases.push_back(nullptr);
+            continue;
+        }
+        _running_means.push_back(_running_stats.get_view(idx++));
+        _running_vars.push_back(_running_stats.get_view(idx++));
+        std::fill_n(_gammas[i - 1]->get_data(), _sizes[i], 1);
+        std::fill_n(_running_vars[i - 1]->get_data(), _sizes[i], 1);
+        _folded_weights.push_back(new ccma::algebra::DenseMatrixT<real>(_sizes[i - 1], _sizes[i]));
+        _folded_biases.push_back(new ccma::algebra::DenseMatrixT<real>(1, _sizes[i]));
+    }
+    _is_folded = false;
+}
+
+void DNN::clear_parameters(){
+    _weights.clear();
+    _biases.clear();
+    _gammas.clear();
+    _betas.clear();
+    _running_means.clear();
+    _running_vars.clear();
+    _params.clear();
+    _running_stats.clear();
+    clear_parameter(&_folded_weights);
+    clear_parameter(&_folded_biases);
+}
+
+/*
+ * running = momentum * running + (1 - momentum) * shard statistic,
+ * shard by shard in order, so the result does not depend on threads.
+ */
+void DNN::update_running_stat(uint num_shards){
+    for(uint i = 0; i != _gammas.size(); i++){
+        if(_gammas[i] == nullptr){
+            continue;
+        }
+        real* running_mean = _running_means[i]->get_data();
+        real* running_var = _running_vars[i]->get_data();
+        uint size = _running_means[i]->get_size();
+        for(uint k = 0; k != num_shards; k++){
+            real* mean = _workspaces[k]->get_batch_mean(i);
+            real* var = _workspaces[k]->get_batch_var(i);
+            for(uint j = 0; j != size; j++){
+                running_mean[j] = _batch_norm_momentum * running_mean[j] + (1 - _batch_norm_momentum) * mean[j];
+                running_var[j] = _batch_norm_momentum * running_var[j] + (1 - _batch_norm_momentum) * var[j];
+            }
+        }
     }
+}
 
-    delete mat;
-    delete delta_weight;
-    delete delta_bias;
+/*
+ * y = gamma * (x * w + b - mean) / sqrt(var + epsilon) + beta
+ *   = x * (w * s) + (b - mean) * s + beta,  s = gamma / sqrt(var + epsilon)
+ */
+void DNN::fold_batch_norm(){
+    if(_is_folded){
+        return;
+    }
+    for(uint i = 0; i != _gammas.size(); i++){
+        if(_gammas[i] == nullptr){
+            continue;
+        }
+        fold_layer(_weights[i]->get_data(), _biases[i]->get_data(),
+                   _gammas[i]->get_data(), _betas[i]->get_data(),
+                   _running_means[i]->get_data(), _running_vars[i]->get_data(),
+                   _weights[i]->get_rows(), _weights[i]->get_cols(),
+                   _folded_weights[i]->get_data(), _folded_biases[i]->get_data());
+    }
+    _is_folded = true;
+}
 
-    clear_parameter(&zs);
-    clear_parameter(&activations);
+void DNN::fold_layer(const real* weight, const real* bias,
+                     const real* gamma, const real* beta,
+                     const real* mean, const real* var,
+                     uint rows, uint cols,
+                     real* folded_weight, real* folded_bias){
+    //the scales are kept in folded_bias until the weights are done
+    for(uint j = 0; j != cols; j++){
+        folded_bias[j] = gamma[j] / std::sqrt(var[j] + _batch_norm_epsilon);
+    }
+    for(uint p = 0; p != rows; p++){
+        for(uint j = 0; j != cols; j++){
+            folded_weight[p * cols + j] = weight[p * cols + j] * folded_bias[j];
+        }
+    }
+    for(uint j = 0; j != cols; j++){
+        folded_bias[j] = (bias[j] - mean[j]) * folded_bias[j] + beta[j];
+    }
+}
 
-    //sum weights & biases
-    for(uint i = 0; i < _weights.size(); i++){
-        batch_weights->at(i)->add(train_weights[i]);
-        batch_biases->at(i)->add(train_biases[i]);
+void DNN::prepare_inference(){
+    if(_is_folded){
+        return;
+    }
+    fold_batch_norm();
+    build_sparse_weights();
+}
+
+InferenceModel* DNN::export_model(){
+    if(_weights.size() == 0){
+        return nullptr;
+    }
+    prepare_inference();
+
+    auto model = new InferenceModel(_sizes[0]);
+    for(uint i = 0; i != _weights.size(); i++){
+        model->add_layer(get_infer_weight(i), get_infer_bias(i), _layers[i + 1].activation, _sparse_weights[i] != nullptr);
+    }
+    return model;
+}
+
+void DNN::build_sparse_weights(){
+    clear_sparse_weights();
+    for(uint i = 0; i != _weights.size(); i++){
+        auto weight = get_infer_weight(i);
+        uint size = weight->get_size();
+        uint nnz = size - std::count(weight->get_data(), weight->get_data() + size, (real)0);
+        if(nnz > _sparse_density * size){
+            _sparse_weights.push_back(nullptr);
+            continue;
+        }
+        auto sparse_weight = new ccma::algebra::SparseMatrixT<real>();
+        sparse_weight->from_dense(weight, true);
+        _sparse_weights.push_back(sparse_weight);
+    }
+}
+
+void DNN::clear_sparse_weights(){
+    for(auto sparse_weight : _sparse_weights){
+        delete sparse_weight;
     }
+    _sparse_weights.clear();
+}
+
+void DNN::prune(real sparsity){
+    for(auto weight : _weights){
+        real* data = weight->get_data();
+        uint size = weight->get_size();
+        uint num_pruned = std::min((uint)(sparsity * size), size);
 
-    clear_parameter(&train_weights);
-    clear_parameter(&train_biases);;
+        //indices of the num_pruned smallest |w|
+        std::vector<uint> idx(size);
+        for(uint j = 0; j != size; j++){
+            idx[j] = j;
+        }
+        std::nth_element(idx.begin(), idx.begin() + num_pruned, idx.end(), [data](uint a, uint b){
+            return std::abs(data[a]) < std::abs(data[b]);
+        });
+        for(uint j = 0; j != num_pruned; j++){
+            data[idx[j]] = 0;
+        }
+    }
+    update_prune_masks();
+}
+
+void DNN::prune_n_m(uint n, uint m){
+    if(m == 0 || n >= m){
+        return;
+    }
+
+    std::vector<uint> idx(m);
+    for(auto weight : _weights){
+        real* data = weight->get_data();
+        uint rows = weight->get_rows();
+        uint cols = weight->get_cols();
+
+        //groups of m consecutive input rows of every output column
+        for(uint j = 0; j != cols; j++){
+            for(uint start_row = 0; start_row < rows; start_row += m){
+                uint group_size = std::min(m, rows - start_row);
+                if(group_size <= n){
+                    continue;
+                }
+                for(uint k = 0; k != group_size; k++){
+                    idx[k] = (start_row + k) * cols + j;
+                }
+                std::nth_element(idx.begin(), idx.begin() + (group_size - n), idx.begin() + group_size, [data](uint a, uint b){
+                    return std::abs(data[a]) < std::abs(data[b]);
+                });
+                for(uint k = 0; k != group_size - n; k++){
+                    data[idx[k]] = 0;
+                }
+            }
+        }
+    }
+    update_prune_masks();
+}
+
+/*
+ * every zero weight is pruned, along with the ones of earlier prunes
+ */
+void DNN::update_prune_masks(){
+    _prune_masks.resize(_weights.size());
+    for(uint i = 0; i != _weights.size(); i++){
+        real* data = _weights[i]->get_data();
+        uint size = _weights[i]->get_size();
+        _prune_masks[i].resize(size, 0);
+        for(uint j = 0; j != size; j++){
+            if(data[j] == 0){
+                _prune_masks[i][j] = 1;
+            }
+        }
+    }
+    _is_folded = false;
+}
+
+void DNN::apply_prune_masks(){
+    for(uint i = 0; i != _prune_masks.size(); i++){
+        real* data = _weights[i]->get_data();
+        const char* mask = _prune_masks[i].data();
+        uint size = _prune_masks[i].size();
+        for(uint j = 0; j != size; j++){
+            if(mask[j]){
+                data[j] = 0;
+            }
+        }
+    }
+}
+
+real DNN::get_sparsity(){
+    size_t size = 0;
+    size_t num_zero = 0;
+    for(auto weight : _weights){
+        size += weight->get_size();
+        num_zero += std::count(weight->get_data(), weight->get_data() + weight->get_size(), (real)0);
+    }
+    return size == 0 ? 0 : (real)num_zero / size;
 }
 
 void DNN::init_parameter(std::vector<ccma::algebra::BaseMatrixT<real>*>* weight_parameter,
@@ -364,37 +1513,212 @@ void DNN::clear_parameter(std::vector<ccma::algebra::BaseMatrixT<real>*>* parame
     parameters->clear();
 }
 
+/*
+ * a plain sigmoid network is stored as "DNNMODEL": w_0, b_0, w_1, b_1...
+ * any other network as "DNNGRAPH": a (num_layers, 4) matrix of
+ * size/activation/dropout/batch_norm per layer, then w_i, b_i of every
+ * weight layer followed by gamma, beta, running mean and running var
+ * if the layer has batch norm.
+ */
+bool DNN::parse_model(const std::vector<ccma::algebra::BaseMatrixT<real>*>& models,
+                      bool is_graph,
+                      const std::string& path,
+                      std::vector<DNNLayer>* layers){
+    layers->clear();
+    bool is_ok = !models.empty();
+    uint idx = 0;
+    if(is_ok && !is_graph){
+        //a plain model is all sigmoid, the sizes are the ones of its weights
+        is_ok = models.size() % 2 == 0;
+        for(uint i = 0; is_ok && i != models.size(); i += 2){
+            if(i == 0){
+                layers->push_back(DNNLayer(models[i]->get_rows()));
+            }
+            layers->push_back(DNNLayer(models[i]->get_cols()));
+        }
+    }else if(is_ok){
+        auto config = models[idx++];
+        is_ok = config->get_cols() == 4;
+        for(uint i = 0; is_ok && i != config->get_rows(); i++){
+            real size = config->get_data(i, 0);
+            real activation = config->get_data(i, 1);
+            real dropout = config->get_data(i, 2);
+            //sizes are stored as real, exact up to 2^24 even in float
+            is_ok = size >= 1 && size <= (1 << 24) && size == (uint)size
+                 && activation >= 0 && activation <= (int)ccma::algebra::Activation::LEAKY_RELU && activation == (int)activation
+                 && dropout >= 0 && dropout < 1;
+            //the input layer has no batch norm(add_layer)
+            layers->push_back(DNNLayer((uint)size, (ccma::algebra::Activation)(int)activation, dropout,
+                                       i > 0 && config->get_data(i, 3) != 0));
+        }
+    }
+    is_ok = is_ok && layers->size() >= 2;
+
+    auto fits = [&](uint rows, uint cols){
+        bool is_fit = idx < models.size() && models[idx]->get_rows() == rows && models[idx]->get_cols() == cols;
+        idx++;
+        return is_fit;
+    };
+    for(uint i = 1; is_ok && i != layers->size(); i++){
+        uint rows = (*layers)[i - 1].size;
+        uint cols = (*layers)[i].size;
+        is_ok = fits(rows, cols) && fits(1, cols)
+             && (!(*layers)[i].batch_norm || (fits(1, cols) && fits(1, cols) && fits(1, cols) && fits(1, cols)));
+    }
+    is_ok = is_ok && idx == models.size();
+
+    if(!is_ok){
+        printf("DNN model %s does not match its layers.\n", path.c_str());
+        layers->clear();
+    }
+    return is_ok;
+}
+
 bool DNN::load_model(const std::string& path){
-    
+
+    bool is_graph = loader.check_signature(path, "DNNGRAPH");
+
+    //the file is only mapped, its matrices are copied once into the flat buffers
     std::vector<ccma::algebra::BaseMatrixT<real>*> models;
-    if(!loader.read<real>(path, &models, "DNNMODEL")){
+    std::shared_ptr<ccma::utils::MappedFile> mapping;
+    if(!loader.map<real>(path, &models, &mapping, is_graph ? "DNNGRAPH" : "DNNMODEL")){
         return false;
     }
-    
-    _weights.clear();
-    _biases.clear();
+
+    //the current network stays as it is unless the whole file fits
+    std::vector<DNNLayer> layers;
+    if(!parse_model(models, is_graph, path, &layers)){
+        clear_parameter(&models);
+        return false;
+    }
+
+    clear_parameters();
     _sizes.clear();
+    _layers.clear();
     _num_layers = 0;
+    _optimizer->reset();
+    _prune_masks.clear();
 
-    for(uint i = 0; i != models.size() / 2; i++){
-        _weights.push_back(models[i*2]);
-        _biases.push_back(models[i*2 + 1]);
-        if(i == 0){
-            add_layer(models[i * 2]->get_rows());
-        }else{
-            add_layer(models[i * 2]->get_cols());
+    for(auto& layer : layers){
+        add_layer(layer.size, layer.activation, layer.dropout, layer.batch_norm);
+    }
+    init_parameters();
+
+    uint idx = is_graph ? 1 : 0;
+    auto copy = [&](ccma::algebra::BaseMatrixT<real>* dst){
+        memcpy(dst->get_data(), models[idx++]->get_data(), sizeof(real) * dst->get_size());
+    };
+    for(uint i = 0; i != _weights.size(); i++){
+        copy(_weights[i]);
+        copy(_biases[i]);
+        if(_gammas[i] != nullptr){
+            copy(_gammas[i]);
+            copy(_betas[i]);
+            copy(_running_means[i]);
+            copy(_running_vars[i]);
         }
     }
+    clear_parameter(&models);
     return true;
 }
 
+InferenceModel* DNN::map_model(const std::string& path, real sparse_density){
+    ccma::utils::ModelLoader model_loader;
+    bool is_graph = model_loader.check_signature(path, "DNNGRAPH");
+
+    std::vector<ccma::algebra::BaseMatrixT<real>*> models;
+    std::shared_ptr<ccma::utils::MappedFile> mapping;
+    if(!model_loader.map<real>(path, &models, &mapping, is_graph ? "DNNGRAPH" : "DNNMODEL")){
+        return nullptr;
+    }
+
+    //same layers and checks as load_model
+    std::vector<DNNLayer> layers;
+    if(!parse_model(models, is_graph, path, &layers)){
+        for(auto mat : models){
+            delete mat;
+        }
+        return nullptr;
+    }
+
+    auto model = new InferenceModel(layers[0].size, mapping);
+    uint idx = is_graph ? 1 : 0;
+    for(uint i = 0; i + 1 != layers.size(); i++){
+        uint rows = layers[i].size;
+        uint cols = layers[i + 1].size;
+        uint first = idx;
+        idx += layers[i + 1].batch_norm ? 6 : 2;
+
+        auto weight = models[first];
+        auto bias = models[first + 1];
+        ccma::algebra::DenseMatrixT<real> folded_weight;
+        ccma::algebra::DenseMatrixT<real> folded_bias;
+        if(layers[i + 1].batch_norm){
+            folded_weight.set_shallow_data(new real[rows * cols], rows, cols);
+            folded_bias.set_shallow_data(new real[cols], 1, cols);
+            fold_layer(weight->get_data(), bias->get_data(),
+                       models[first + 2]->get_data(), models[first + 3]->get_data(),
+                       models[first + 4]->get_data(), models[first + 5]->get_data(),
+                       rows, cols, folded_weight.get_data(), folded_bias.get_data());
+            weight = &folded_weight;
+            bias = &folded_bias;
+        }
+
+        //weights used in place are not scanned, only copied ones may turn sparse
+        bool is_sparse = false;
+        if(dynamic_cast<ccma::algebra::DenseMatrixViewT<real>*>(weight) == nullptr){
+            uint size = weight->get_size();
+            is_sparse = size - std::count(weight->get_data(), weight->get_data() + size, (real)0) <= sparse_density * size;
+        }
+        model->add_layer(weight, bias, layers[i + 1].activation, is_sparse);
+    }
+
+    for(auto mat : models){
+        delete mat;
+    }
+    return model;
+}
+
 bool DNN::write_model(const std::string& path){
+    bool is_graph = _layers.size() > 0 && _layers[0].dropout > 0;
+    for(uint i = 1; i < _num_layers; i++){
+        if(_layers[i].activation != ccma::algebra::Activation::SIGMOID || _layers[i].dropout > 0 || _layers[i].batch_norm){
+            is_graph = true;
+        }
+    }
+
     std::vector<ccma::algebra::BaseMatrixT<real>*> models;
+    if(!is_graph){
+        for(uint i = 0; i != _weights.size(); i++){
+            models.push_back(_weights[i]);
+            models.push_back(_biases[i]);
+        }
+        return loader.write<real>(models, path, false, "DNNMODEL", true);
+    }
+
+    auto config = new ccma::algebra::DenseMatrixT<real>(_num_layers, 4);
+    for(uint i = 0; i != _num_layers; i++){
+        config->set_data(_layers[i].size, i, 0);
+        config->set_data((int)_layers[i].activation, i, 1);
+        config->set_data(_layers[i].dropout, i, 2);
+        config->set_data(_layers[i].batch_norm ? 1 : 0, i, 3);
+    }
+    models.push_back(config);
+
     for(uint i = 0; i != _weights.size(); i++){
         models.push_back(_weights[i]);
         models.push_back(_biases[i]);
+        if(_gammas[i] != nullptr){
+            models.push_back(_gammas[i]);
+            models.push_back(_betas[i]);
+            models.push_back(_running_means[i]);
+            models.push_back(_running_vars[i]);
+        }
     }
-    return loader.write<real>(models, path, "DNNMODEL");
+
+    bool ret = loader.write<real>(models, path, false, "DNNGRAPH", true);
+    delete config;
+    return ret;
 }
 
 }//namespace nn
@@ -0,0 +1,257 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 11:52
+ * Last modified : 2026-10-18 11:52
+ * Filename      : DNNWorkspace.cpp
+ * Description   : 
+ **********************************************/
+
+#include "algorithm/nn/DNNWorkspace.h"
+#include <algorithm>
+#include <string.h>
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+/*
+ * layer i keeps its own buffers if it is a checkpoint, otherwise it
+ * uses slot i % interval, for its output as well as for the dropped
+ * out input it reads. slot_sizes[p] is the widest output of slot p
+ * and drop_sizes[p] the widest input with dropout.
+ */
+static void checkpoint_layout(const std::vector<DNNLayer>& layers,
+                              uint interval,
+                              std::vector<bool>* is_checkpoint,
+                              std::vector<uint>* slot_sizes,
+                              std::vector<uint>* drop_sizes){
+    uint weight_size = layers.size() - 1;
+    is_checkpoint->assign(weight_size, true);
+    slot_sizes->assign(interval, 0);
+    drop_sizes->assign(interval, 0);
+
+    for(uint i = 0; i + 1 < weight_size; i++){
+        if((i + 1) % interval == 0){
+            continue;
+        }
+        uint p = i % interval;
+        is_checkpoint->at(i) = false;
+        slot_sizes->at(p) = std::max(slot_sizes->at(p), layers[i + 1].size);
+        if(layers[i].dropout > 0){
+            drop_sizes->at(p) = std::max(drop_sizes->at(p), layers[i].size);
+        }
+    }
+}
+
+void layout_parameters(const std::vector<DNNLayer>& layers,
+                       ParameterBuffer* buffer,
+                       std::vector<ccma::algebra::BaseMatrixT<real>*>* weights,
+                       std::vector<ccma::algebra::BaseMatrixT<real>*>* biases,
+                       std::vector<ccma::algebra::BaseMatrixT<real>*>* gammas,
+                       std::vector<ccma::algebra::BaseMatrixT<real>*>* betas){
+    buffer->clear();
+    uint weight_size = layers.size() - 1;
+    for(uint i = 0; i != weight_size; i++){
+        buffer->add(layers[i].size, layers[i + 1].size);
+    }
+    for(uint i = 0; i != weight_size; i++){
+        buffer->add(1, layers[i + 1].size);
+    }
+    for(uint i = 0; i != weight_size; i++){
+        if(layers[i + 1].batch_norm){
+            buffer->add(1, layers[i + 1].size);
+            buffer->add(1, layers[i + 1].size);
+        }
+    }
+    buffer->allocate();
+
+    uint idx = 0;
+    for(uint i = 0; i != weight_size; i++){
+        weights->push_back(buffer->get_view(idx++));
+    }
+    for(uint i = 0; i != weight_size; i++){
+        biases->push_back(buffer->get_view(idx++));
+    }
+    for(uint i = 0; i != weight_size; i++){
+        bool batch_norm = layers[i + 1].batch_norm;
+        gammas->push_back(batch_norm ? buffer->get_view(idx++) : nullptr);
+        betas->push_back(batch_norm ? buffer->get_view(idx++) : nullptr);
+    }
+}
+
+DNNWorkspace::DNNWorkspace(const std::vector<DNNLayer>& layers, uint max_rows, uint checkpoint_interval){
+    _layers = layers;
+    _max_rows = max_rows;
+    _checkpoint_interval = checkpoint_interval == 0 ? 1 : checkpoint_interval;
+
+    auto new_matrix = [](bool used, uint rows, uint cols) -> ccma::algebra::BaseMatrixT<real>*{
+        return used ? new ccma::algebra::DenseMatrixT<real>(rows, cols) : nullptr;
+    };
+
+    std::vector<bool> is_checkpoint;
+    std::vector<uint> slot_sizes;
+    std::vector<uint> drop_sizes;
+    checkpoint_layout(layers, _checkpoint_interval, &is_checkpoint, &slot_sizes, &drop_sizes);
+
+    std::vector<ccma::algebra::BaseMatrixT<real>*> slot_zs;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> slot_activations;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> slot_masks;
+    std::vector<ccma::algebra::BaseMatrixT<real>*> slot_outs;
+    for(uint p = 0; p != _checkpoint_interval; p++){
+        slot_zs.push_back(new_matrix(slot_sizes[p] > 0, max_rows, slot_sizes[p]));
+        slot_activations.push_back(new_matrix(slot_sizes[p] > 0, max_rows, slot_sizes[p]));
+        slot_masks.push_back(new_matrix(drop_sizes[p] > 0, max_rows, drop_sizes[p]));
+        slot_outs.push_back(new_matrix(drop_sizes[p] > 0, max_rows, drop_sizes[p]));
+    }
+
+    uint max_size = 0;
+    for(uint i = 1; i < layers.size(); i++){
+        uint in_size = layers[i - 1].size;
+        uint out_size = layers[i].size;
+        bool batch_norm = layers[i].batch_norm;
+        bool own = is_checkpoint[i - 1];
+        max_size = std::max(max_size, out_size);
+
+        _zs.push_back(new_matrix(own, max_rows, out_size));
+        _activations.push_back(new_matrix(own, max_rows, out_size));
+        _z_data.push_back(own ? _zs.back()->get_data() : slot_zs[(i - 1) % _checkpoint_interval]->get_data());
+        _activation_data.push_back(own ? _activations.back()->get_data()
+                                       : slot_activations[(i - 1) % _checkpoint_interval]->get_data());
+
+        bool dropout = layers[i - 1].dropout > 0;
+        _dropout_masks.push_back(new_matrix(dropout && own, max_rows, in_size));
+        _dropout_outs.push_back(new_matrix(dropout && own, max_rows, in_size));
+        if(!dropout){
+            _dropout_mask_data.push_back(nullptr);
+            _dropout_out_data.push_back(nullptr);
+        }else if(own){
+            _dropout_mask_data.push_back(_dropout_masks.back()->get_data());
+            _dropout_out_data.push_back(_dropout_outs.back()->get_data());
+        }else{
+            _dropout_mask_data.push_back(slot_masks[(i - 1) % _checkpoint_interval]->get_data());
+            _dropout_out_data.push_back(slot_outs[(i - 1) % _checkpoint_interval]->get_data());
+        }
+
+        _batch_means.push_back(new_matrix(batch_norm, 1, out_size));
+        _batch_vars.push_back(new_matrix(batch_norm, 1, out_size));
+        _batch_inv_stds.push_back(new_matrix(batch_norm, 1, out_size));
+    }
+    layout_parameters(layers, &_grads, &_grad_weights, &_grad_biases, &_grad_gammas, &_grad_betas);
+
+    _zs.insert(_zs.end(), slot_zs.begin(), slot_zs.end());
+    _activations.insert(_activations.end(), slot_activations.begin(), slot_activations.end());
+    _dropout_masks.insert(_dropout_masks.end(), slot_masks.begin(), slot_masks.end());
+    _dropout_outs.insert(_dropout_outs.end(), slot_outs.begin(), slot_outs.end());
+
+    _deltas.push_back(new ccma::algebra::DenseMatrixT<real>(max_rows, max_size));
+    _deltas.push_back(new ccma::algebra::DenseMatrixT<real>(max_rows, max_size));
+}
+
+DNNWorkspace::~DNNWorkspace(){
+    clear(&_zs);
+    clear(&_activations);
+    clear(&_deltas);
+    clear(&_dropout_masks);
+    clear(&_dropout_outs);
+    clear(&_batch_means);
+    clear(&_batch_vars);
+    clear(&_batch_inv_stds);
+}
+
+bool DNNWorkspace::fit(const std::vector<DNNLayer>& layers, uint max_rows, uint checkpoint_interval) const{
+    return _layers == layers && _max_rows >= max_rows
+        && _checkpoint_interval == (checkpoint_interval == 0 ? 1 : checkpoint_interval);
+}
+
+size_t DNNWorkspace::get_bytes() const{
+    size_t size = _grads.get_size();
+    std::vector<const std::vector<ccma::algebra::BaseMatrixT<real>*>*> buffers = {
+        &_zs, &_activations, &_deltas,
+        &_dropout_masks, &_dropout_outs,
+        &_batch_means, &_batch_vars, &_batch_inv_stds
+    };
+    for(auto mats : buffers){
+        for(auto mat : *mats){
+            if(mat != nullptr){
+                size += mat->get_size();
+            }
+        }
+    }
+    return size * sizeof(real);
+}
+
+void DNNWorkspace::set_sparse_input(bool sparse_input){
+    if(sparse_input == _is_sparse_input){
+        return;
+    }
+    _is_sparse_input = sparse_input;
+    _active_rows.clear();
+    _is_active.assign(sparse_input ? _layers[0].size : 0, 0);
+    if(sparse_input){
+        auto grad = _grad_weights[0];
+        memset(grad->get_data(), 0, sizeof(real) * grad->get_size());
+    }
+}
+
+void DNNWorkspace::clear_active_rows(){
+    real* grad = _grad_weights[0]->get_data();
+    uint cols = _grad_weights[0]->get_cols();
+    for(auto row : _active_rows){
+        memset(&grad[row * cols], 0, sizeof(real) * cols);
+        _is_active[row] = 0;
+    }
+    _active_rows.clear();
+}
+
+size_t DNNWorkspace::get_activation_bytes(const std::vector<DNNLayer>& layers, uint max_rows, uint checkpoint_interval){
+    uint interval = checkpoint_interval == 0 ? 1 : checkpoint_interval;
+    std::vector<bool> is_checkpoint;
+    std::vector<uint> slot_sizes;
+    std::vector<uint> drop_sizes;
+    checkpoint_layout(layers, interval, &is_checkpoint, &slot_sizes, &drop_sizes);
+
+    //z and a, mask and dropped output, in units of max_rows
+    size_t size = 0;
+    uint max_size = 0;
+    for(uint i = 1; i < layers.size(); i++){
+        if(is_checkpoint[i - 1]){
+            size += 2 * layers[i].size;
+            if(layers[i - 1].dropout > 0){
+                size += 2 * layers[i - 1].size;
+            }
+        }
+        max_size = std::max(max_size, layers[i].size);
+    }
+    for(uint p = 0; p != interval; p++){
+        size += 2 * slot_sizes[p] + 2 * drop_sizes[p];
+    }
+    size += 2 * max_size;
+
+    return size * max_rows * sizeof(real);
+}
+
+size_t DNNWorkspace::get_recompute_flops(const std::vector<DNNLayer>& layers, uint rows, uint checkpoint_interval){
+    uint interval = checkpoint_interval == 0 ? 1 : checkpoint_interval;
+    uint weight_size = layers.size() - 1;
+
+    //the top segment is still in place after the forward pass
+    size_t flops = 0;
+    uint top_start = (weight_size - 1) - (weight_size - 1) % interval;
+    for(uint i = 0; i < top_start; i++){
+        if((i + 1) % interval != 0){
+            flops += 2 * (size_t)rows * layers[i].size * layers[i + 1].size;
+        }
+    }
+    return flops;
+}
+
+void DNNWorkspace::clear(std::vector<ccma::algebra::BaseMatrixT<real>*>* mats){
+    for(auto mat : *mats){
+        delete mat;
+    }
+    mats->clear();
+}
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
@@ -0,0 +1,168 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-19 02:10
+ * Last modified : 2026-10-19 02:10
+ * Filename      : InferenceSession.cpp
+ * Description   : Implemention of the dnn serving snapshot
+ **********************************************/
+
+#include "algorithm/nn/InferenceSession.h"
+#include <algorithm>
+#include <stdio.h>
+#include "algorithm/nn/DNN.h"
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+void InferenceModel::add_layer(ccma::algebra::BaseMatrixT<real>* weight,
+                               ccma::algebra::BaseMatrixT<real>* bias,
+                               ccma::algebra::Activation activation,
+                               bool is_sparse){
+    _sizes.push_back(weight->get_cols());
+    _activations.push_back(activation);
+    _is_sparse.push_back(is_sparse);
+
+    _sparse_weights.push_back(ccma::algebra::SparseMatrixT<real>());
+    if(is_sparse){
+        _sparse_weights.back().from_dense(weight, true);
+    }
+
+    auto keep = [&](ccma::algebra::BaseMatrixT<real>* mat){
+        if(_mapping != nullptr && dynamic_cast<ccma::algebra::DenseMatrixViewT<real>*>(mat) != nullptr){
+            return (const real*)mat->get_data();
+        }
+        _buffers.push_back(std::vector<real>(mat->get_data(), mat->get_data() + mat->get_size()));
+        return (const real*)_buffers.back().data();
+    };
+    _biases.push_back(keep(bias));
+    //a sparse input gathers rows of the dense first weight
+    _weights.push_back((!is_sparse || _weights.empty()) ? keep(weight) : nullptr);
+}
+
+bool InferenceModel::predict(const real* data,
+                             const ccma::algebra::SparseMatrixT<real>* sparse_data,
+                             uint rows,
+                             real* out_probability,
+                             uint* out_label) const{
+    uint num_layers = _activations.size();
+    if(num_layers == 0){
+        return false;
+    }
+
+    /*
+     * same blocked pass as DNN::predict_batch, on one thread: two
+     * ping-pong buffers of (_block, max_size) and the transposed rows
+     * of the sparse weight layers. the scratch belongs to the calling
+     * thread and only grows, a serving thread stops allocating after
+     * its first requests.
+     */
+    uint max_size = 0;
+    uint max_sparse_size = 0;
+    for(uint i = 0; i != num_layers; i++){
+        if(i + 1 != num_layers){
+            max_size = std::max(max_size, _sizes[i + 1]);
+        }
+        if(_is_sparse[i]){
+            max_sparse_size = std::max(max_sparse_size, _sizes[i]);
+        }
+    }
+    uint buffer_size = _block * max_size;
+    static thread_local std::vector<real> scratch;
+    if(scratch.size() < 2 * buffer_size + max_sparse_size * SPARSE_FORWARD_BLOCK){
+        scratch.resize(2 * buffer_size + max_sparse_size * SPARSE_FORWARD_BLOCK);
+    }
+    real* buffer[3] = {scratch.data(), &scratch[buffer_size], &scratch[2 * buffer_size]};
+
+    uint out_size = _sizes.back();
+    for(uint start_idx = 0; start_idx < rows; start_idx += _block){
+        uint block_rows = std::min(rows - start_idx, _block);
+
+        const real* activation = (data == nullptr) ? nullptr : &data[start_idx * _sizes[0]];
+        for(uint i = 0; i != num_layers; i++){
+            real* out = (i + 1 == num_layers) ? &out_probability[start_idx * out_size] : buffer[i % 2];
+            if(activation == nullptr){
+                ccma::algebra::sparse_dense_forward(&sparse_data->get_row_ptr()[start_idx], sparse_data->get_col_idx(), sparse_data->get_values(),
+                                                    _weights[i], _biases[i], (real*)nullptr, out,
+                                                    block_rows, _sizes[i + 1], _activations[i]);
+            }else if(_is_sparse[i]){
+                auto& sparse_weight = _sparse_weights[i];
+                ccma::algebra::dense_sparse_forward(activation, sparse_weight.get_row_ptr(), sparse_weight.get_col_idx(),
+                                                    sparse_weight.get_values(), _biases[i], (real*)nullptr, out,
+                                                    buffer[2], block_rows, _sizes[i], _sizes[i + 1], _activations[i]);
+            }else{
+                ccma::algebra::dense_forward(activation, _weights[i], _biases[i], (real*)nullptr, out,
+                                             block_rows, _sizes[i], _sizes[i + 1], _activations[i]);
+            }
+            activation = out;
+        }
+
+        if(out_label == nullptr){
+            continue;
+        }
+        for(uint k = start_idx; k != start_idx + block_rows; k++){
+            const real* row = &out_probability[k * out_size];
+            out_label[k] = std::max_element(row, row + out_size) - row;
+        }
+    }
+    return true;
+}
+
+bool InferenceSession::predict(ccma::algebra::BaseMatrixT<real>* data,
+                               ccma::algebra::BaseMatrixT<real>* out_probability,
+                               std::vector<uint>* out_label) const{
+    return predict(data->get_data(), nullptr, data->get_rows(), data->get_cols(), out_probability, out_label);
+}
+
+bool InferenceSession::predict(const ccma::algebra::SparseMatrixT<real>* data,
+                               ccma::algebra::BaseMatrixT<real>* out_probability,
+                               std::vector<uint>* out_label) const{
+    return predict(nullptr, data, data->get_rows(), data->get_cols(), out_probability, out_label);
+}
+
+bool InferenceSession::predict(const real* data,
+                               const ccma::algebra::SparseMatrixT<real>* sparse_data,
+                               uint rows,
+                               uint cols,
+                               ccma::algebra::BaseMatrixT<real>* out_probability,
+                               std::vector<uint>* out_label) const{
+    //pins the model until the request is done, even across a swap
+    auto model = get_model();
+    if(model == nullptr || cols != model->get_input_size()){
+        printf("InferenceSession predict data check failed.\n");
+        return false;
+    }
+
+    uint out_size = model->get_output_size();
+    if(out_probability->get_rows() != rows || out_probability->get_cols() != out_size){
+        out_probability->set_shallow_data(new real[rows * out_size], rows, out_size);
+    }
+    if(out_label != nullptr){
+        out_label->resize(rows);
+    }
+    return model->predict(data, sparse_data, rows, out_probability->get_data(),
+                          out_label == nullptr ? nullptr : out_label->data());
+}
+
+bool InferenceSession::swap(DNN* dnn){
+    std::shared_ptr<const InferenceModel> model(dnn->export_model());
+    if(model == nullptr){
+        return false;
+    }
+    std::atomic_store(&_model, model);
+    return true;
+}
+
+bool InferenceSession::reload(const std::string& path){
+    std::shared_ptr<const InferenceModel> model(DNN::map_model(path));
+    if(model == nullptr){
+        printf("InferenceSession reload %s failed, keep the current model.\n", path.c_str());
+        return false;
+    }
+    std::atomic_store(&_model, model);
+    return true;
+}
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
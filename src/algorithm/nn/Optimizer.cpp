@@ -0,0 +1,249 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 14:10
+ * Last modified : 2026-10-18 14:10
+ * Filename      : Optimizer.cpp
+ * Description   : Implemention of nn optimizers
+ **********************************************/
+
+#include "algorithm/nn/Optimizer.h"
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+Optimizer::Optimizer(uint num_state){
+    _num_state = std::min(num_state, MAX_STATE);
+}
+
+Optimizer::~Optimizer(){
+    reset();
+}
+
+void Optimizer::step(real eta){
+    _eta = eta;
+    _num_step++;
+    prepare();
+}
+
+void Optimizer::reset(){
+    for(auto state : _states){
+        if(state != nullptr){
+            delete[] state;
+        }
+    }
+    _states.clear();
+    _slot_sizes.clear();
+    _num_step = 0;
+}
+
+real* Optimizer::get_state(uint slot, uint idx){
+    if(slot >= _slot_sizes.size() || idx >= _num_state){
+        return nullptr;
+    }
+    return _states[slot * _num_state + idx];
+}
+
+void Optimizer::reserve(uint slot, uint size){
+    if(slot >= _slot_sizes.size()){
+        _slot_sizes.resize(slot + 1, 0);
+        _states.resize((slot + 1) * _num_state, nullptr);
+    }
+    if(_slot_sizes[slot] == size){
+        return;
+    }
+
+    //first use of the slot or the parameter was resized
+    _slot_sizes[slot] = size;
+    for(uint i = 0; i != _num_state; i++){
+        real*& state = _states[slot * _num_state + i];
+        if(state != nullptr){
+            delete[] state;
+        }
+        state = new real[size];
+        memset(state, 0, sizeof(real) * size);
+    }
+}
+
+void Optimizer::update(uint slot,
+                       real* param,
+                       const real* grad,
+                       uint size,
+                       real grad_scale,
+                       real decay,
+                       ccma::utils::ThreadPool* pool){
+    reserve(slot, size);
+    update_range(slot, 0, param, grad, size, grad_scale, decay, pool);
+}
+
+void Optimizer::update_range(uint slot,
+                             uint offset,
+                             real* param,
+                             const real* grad,
+                             uint size,
+                             real grad_scale,
+                             real decay,
+                             ccma::utils::ThreadPool* pool){
+    real** slot_state = _num_state == 0 ? nullptr : &_states[slot * _num_state];
+    uint num_chunk = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    auto chunk_task = [&](uint chunk_id){
+        uint start_idx = chunk_id * CHUNK_SIZE;
+        uint chunk_size = std::min(size - start_idx, CHUNK_SIZE);
+
+        real* state[MAX_STATE];
+        for(uint i = 0; i != _num_state; i++){
+            state[i] = &slot_state[i][offset + start_idx];
+        }
+        apply(&param[start_idx], &grad[start_idx], state, chunk_size, grad_scale, decay);
+    };
+
+    if(pool == nullptr){
+        for(uint i = 0; i != num_chunk; i++){
+            chunk_task(i);
+        }
+    }else{
+        pool->parallel_for(num_chunk, chunk_task);
+    }
+}
+
+void Optimizer::update_rows(uint slot,
+                            real* param,
+                            const real* grad,
+                            uint size,
+                            const uint* rows,
+                            uint num_rows,
+                            uint cols,
+                            real grad_scale,
+                            real decay,
+                            ccma::utils::ThreadPool* pool){
+    if(slot >= _slot_sizes.size() || _slot_sizes[slot] < size){
+        reserve(slot, size);
+    }
+
+    real** slot_state = _num_state == 0 ? nullptr : &_states[slot * _num_state];
+    uint rows_per_chunk = std::max(1u, CHUNK_SIZE / std::max(1u, cols));
+    uint num_chunk = (num_rows + rows_per_chunk - 1) / rows_per_chunk;
+
+    auto chunk_task = [&](uint chunk_id){
+        uint start_idx = chunk_id * rows_per_chunk;
+        uint end_idx = std::min(num_rows, start_idx + rows_per_chunk);
+
+        real* state[MAX_STATE];
+        for(uint r = start_idx; r != end_idx; r++){
+            uint offset = rows[r] * cols;
+            for(uint i = 0; i != _num_state; i++){
+                state[i] = &slot_state[i][offset];
+            }
+            apply(&param[offset], &grad[offset], state, cols, grad_scale, decay);
+        }
+    };
+
+    if(pool == nullptr){
+        for(uint i = 0; i != num_chunk; i++){
+            chunk_task(i);
+        }
+    }else{
+        pool->parallel_for(num_chunk, chunk_task);
+    }
+}
+
+SGDOptimizer::SGDOptimizer() : Optimizer(0){}
+
+void SGDOptimizer::apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay){
+    real eta = _eta;
+    for(uint i = 0; i != size; i++){
+        real g = grad[i] * grad_scale + decay * param[i];
+        param[i] -= eta * g;
+    }
+}
+
+MomentumOptimizer::MomentumOptimizer(real momentum) : Optimizer(1), _momentum(momentum){}
+
+void MomentumOptimizer::apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay){
+    real eta = _eta;
+    real mu = _momentum;
+    real* velocity = state[0];
+    for(uint i = 0; i != size; i++){
+        real g = grad[i] * grad_scale + decay * param[i];
+        real v = mu * velocity[i] - eta * g;
+        velocity[i] = v;
+        param[i] += v;
+    }
+}
+
+NesterovOptimizer::NesterovOptimizer(real momentum) : Optimizer(1), _momentum(momentum){}
+
+void NesterovOptimizer::apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay){
+    real eta = _eta;
+    real mu = _momentum;
+    real* velocity = state[0];
+    for(uint i = 0; i != size; i++){
+        real g = grad[i] * grad_scale + decay * param[i];
+        real v_prev = velocity[i];
+        real v = mu * v_prev - eta * g;
+        velocity[i] = v;
+        param[i] += (1 + mu) * v - mu * v_prev;
+    }
+}
+
+AdaGradOptimizer::AdaGradOptimizer(real epsilon) : Optimizer(1), _epsilon(epsilon){}
+
+void AdaGradOptimizer::apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay){
+    real eta = _eta;
+    real epsilon = _epsilon;
+    real* square_sum = state[0];
+    for(uint i = 0; i != size; i++){
+        real g = grad[i] * grad_scale + decay * param[i];
+        real h = square_sum[i] + g * g;
+        square_sum[i] = h;
+        param[i] -= eta * g / (std::sqrt(h) + epsilon);
+    }
+}
+
+RMSPropOptimizer::RMSPropOptimizer(real rho, real epsilon) : Optimizer(1), _rho(rho), _epsilon(epsilon){}
+
+void RMSPropOptimizer::apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay){
+    real eta = _eta;
+    real rho = _rho;
+    real epsilon = _epsilon;
+    real* square_avg = state[0];
+    for(uint i = 0; i != size; i++){
+        real g = grad[i] * grad_scale + decay * param[i];
+        real h = rho * square_avg[i] + (1 - rho) * g * g;
+        square_avg[i] = h;
+        param[i] -= eta * g / (std::sqrt(h) + epsilon);
+    }
+}
+
+AdamOptimizer::AdamOptimizer(real beta1, real beta2, real epsilon) : Optimizer(2), _beta1(beta1), _beta2(beta2), _epsilon(epsilon){}
+
+void AdamOptimizer::prepare(){
+    real correction1 = 1 - std::pow(_beta1, (real)_num_step);
+    real correction2 = 1 - std::pow(_beta2, (real)_num_step);
+    _step_size = _eta * std::sqrt(correction2) / correction1;
+}
+
+void AdamOptimizer::apply(real* param, const real* grad, real** state, uint size, real grad_scale, real decay){
+    real step_size = _step_size;
+    real beta1 = _beta1;
+    real beta2 = _beta2;
+    real epsilon = _epsilon;
+    real* m = state[0];
+    real* v = state[1];
+    for(uint i = 0; i != size; i++){
+        real g = grad[i] * grad_scale + decay * param[i];
+        real m_i = beta1 * m[i] + (1 - beta1) * g;
+        real v_i = beta2 * v[i] + (1 - beta2) * g * g;
+        m[i] = m_i;
+        v[i] = v_i;
+        param[i] -= step_size * m_i / (std::sqrt(v_i) + epsilon);
+    }
+}
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
@@ -0,0 +1,66 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-19 00:20
+ * Last modified : 2026-10-19 00:20
+ * Filename      : ParameterBuffer.cpp
+ * Description   : Implemention of the flat parameter buffer
+ **********************************************/
+
+#include "algorithm/nn/ParameterBuffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+ParameterBuffer::~ParameterBuffer(){
+    clear();
+}
+
+uint ParameterBuffer::add(uint rows, uint cols){
+    _offsets.push_back(_size);
+    _rows.push_back(rows);
+    _cols.push_back(cols);
+    _size += (rows * cols + ALIGN - 1) / ALIGN * ALIGN;
+    return _offsets.size() - 1;
+}
+
+void ParameterBuffer::allocate(){
+    for(auto view : _views){
+        delete view;
+    }
+    _views.clear();
+    free(_data);
+    _data = nullptr;
+
+    void* data = nullptr;
+    if(posix_memalign(&data, ALIGN * sizeof(real), sizeof(real) * (_size == 0 ? ALIGN : _size)) != 0){
+        printf("ParameterBuffer allocation of %u elements failed.\n", _size);
+        return;
+    }
+    _data = (real*)data;
+    memset(_data, 0, sizeof(real) * _size);
+
+    for(uint i = 0; i != _offsets.size(); i++){
+        _views.push_back(new ccma::algebra::DenseMatrixViewT<real>(&_data[_offsets[i]], _rows[i], _cols[i]));
+    }
+}
+
+void ParameterBuffer::clear(){
+    for(auto view : _views){
+        delete view;
+    }
+    _views.clear();
+    free(_data);
+    _data = nullptr;
+    _size = 0;
+    _offsets.clear();
+    _rows.clear();
+    _cols.clear();
+}
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
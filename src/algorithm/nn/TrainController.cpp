@@ -0,0 +1,93 @@
+/***********************************************
+ * Author: Jun Jiang - jiangjun4@sina.com
+ * Create: 2026-10-18 18:40
+ * Last modified : 2026-10-18 18:40
+ * Filename      : TrainController.cpp
+ * Description   : Implemention of the nn training controller
+ **********************************************/
+
+#include "algorithm/nn/TrainController.h"
+#include <algorithm>
+#include <cmath>
+
+namespace ccma{
+namespace algorithm{
+namespace nn{
+
+StepSchedule::StepSchedule(uint step_size, real gamma){
+    _step_size = step_size == 0 ? 1 : step_size;
+    _gamma = gamma;
+}
+
+real StepSchedule::get_eta(real eta, real epoch) const{
+    return eta * std::pow(_gamma, std::floor(epoch / _step_size));
+}
+
+CosineSchedule::CosineSchedule(uint epochs, real min_ratio){
+    _epochs = epochs == 0 ? 1 : epochs;
+    _min_ratio = min_ratio;
+}
+
+real CosineSchedule::get_eta(real eta, real epoch) const{
+    real eta_min = eta * _min_ratio;
+    real t = std::min(epoch / _epochs, (real)1.0);
+    return eta_min + (eta - eta_min) * (1 + std::cos(M_PI * t)) / 2;
+}
+
+WarmRestartSchedule::WarmRestartSchedule(uint period, uint mult, real min_ratio){
+    _period = period == 0 ? 1 : period;
+    _mult = mult == 0 ? 1 : mult;
+    _min_ratio = min_ratio;
+}
+
+real WarmRestartSchedule::get_eta(real eta, real epoch) const{
+    //position inside the current cycle
+    real t = epoch;
+    real period = _period;
+    while(t >= period){
+        t -= period;
+        period *= _mult;
+    }
+
+    real eta_min = eta * _min_ratio;
+    return eta_min + (eta - eta_min) * (1 + std::cos(M_PI * t / period)) / 2;
+}
+
+TrainController::TrainController(){
+    _schedule = new ConstantSchedule();
+}
+
+TrainController::~TrainController(){
+    delete _schedule;
+}
+
+void TrainController::set_schedule(LRSchedule* schedule){
+    if(schedule == _schedule){
+        return;
+    }
+    delete _schedule;
+    _schedule = schedule == nullptr ? new ConstantSchedule() : schedule;
+}
+
+void TrainController::start(uint epochs, uint num_batches){
+    _epochs = epochs;
+    _num_batches = num_batches == 0 ? 1 : num_batches;
+    _best_score = 0.0;
+    _best_epoch = -1;
+    _num_bad = 0;
+}
+
+bool TrainController::report(uint epoch, real score){
+    if(_best_epoch < 0 || score > _best_score + _min_delta){
+        _best_score = score;
+        _best_epoch = epoch;
+        _num_bad = 0;
+        return true;
+    }
+    _num_bad++;
+    return false;
+}
+
+}//namespace nn
+}//namespace algorithm
+}//namespace ccma
@@ -7,6 +7,7 @@
  **********************************************/
 #include "algebra/BaseMatrix.h"
 #include "algorithm/rnn/Layer.h"
+#include "algebra/MatrixKernel.h"
 
 namespace ccma{
 namespace algorithm{
@@ -19,22 +20,35 @@ void Layer::feed_farward(ccma::algebra::BaseMatrixT<real>* train_seq_data,
 						 ccma::algebra::BaseMatrixT<real>* state,
 						 ccma::algebra::BaseMatrixT<real>* activation,
                          bool debug){
+	//o[t] = softmax(V* s[t]), all rows at once
+	forward_logits(train_seq_data, weight, pre_weight, act_weight, state, activation, debug);
+	ccma::algebra::activate(activation->get_data(), activation->get_rows(), activation->get_cols(),
+	                        ccma::algebra::Activation::SOFTMAX);
+}
+
+void Layer::forward_logits(ccma::algebra::BaseMatrixT<real>* train_seq_data,
+						   ccma::algebra::BaseMatrixT<real>* weight,
+						   ccma::algebra::BaseMatrixT<real>* pre_weight,
+						   ccma::algebra::BaseMatrixT<real>* act_weight,
+						   ccma::algebra::BaseMatrixT<real>* state,
+						   ccma::algebra::BaseMatrixT<real>* logits,
+                           bool debug){
 	
 	uint seq_rows = train_seq_data->get_rows();
 	uint seq_cols = train_seq_data->get_cols();
 	
 	state->reset(0, seq_rows, _hidden_dim);
-	activation->reset(0, seq_rows, seq_cols);
+	logits->reset(0, seq_rows, seq_cols);
 
 	auto state_t = new ccma::algebra::DenseMatrixT<real>();
-	auto activation_t = new ccma::algebra::DenseMatrixT<real>();
+	auto logits_t = new ccma::algebra::DenseMatrixT<real>();
 	auto seq_time_data = new ccma::algebra::DenseMatrixT<real>();
 	auto pre_state_t = new ccma::algebra::DenseMatrixT<real>();
 	auto pre_weight_t = new ccma::algebra::DenseMatrixT<real>();
 
 	for(uint t = 0; t != seq_rows; t++){
 		//s[t] = tanh(U*x[t] + W*s[t-1])
-		//o[t] = softmax(V* s[t])
+		//z[t] = V* s[t]
 		train_seq_data->get_row_data(t, seq_time_data);
 		weight->clone(state_t);
 		state_t->dot(seq_time_data->transpose());
@@ -49,49 +63,14 @@ void Layer::feed_farward(ccma::algebra::BaseMatrixT<real>* train_seq_data,
         state_t->tanh();
 		state->set_row_data(t, state_t->transpose());
 	
-		act_weight->clone(activation_t);
-		activation_t->dot(state_t->transpose());
-
-        auto m = new ccma::algebra::DenseMatrixT<real>();
-        activation_t->clone(m);
-
-		activation_t->softmax();
-
-		if(activation_t->isnan()){
-            uint size = activation_t->get_size();
-            uint max_idx = 0;
-            real max_value = 0.0;
-            for(uint i = 0; i != size; i++){
-                if(i == 0 || max_value < activation_t->get_data(i) || std::isnan(activation_t->get_data(i))){
-                    max_value = activation_t->get_data(i);
-                    max_idx = i;
-                }
-            }
-
-            uint rows = max_idx / activation_t->get_cols();
-            uint cols = (max_idx - rows * activation_t->get_cols());
-
-            printf("isnan[%d][%d][%f][%f][%f]\n", rows, cols, act_weight->get_data(rows, cols),m->get_data(rows, cols), max_value);
+		act_weight->clone(logits_t);
+		logits_t->dot(state_t->transpose());
 
-            auto max_mat = new ccma::algebra::DenseMatrixT<real>();
-            act_weight->get_row_data(rows, max_mat);
-            
-            printf("m_mat");
-            m->display();
-            printf("state_t");
-            state_t->transpose()->display();
-            state_t->transpose();
-
-            delete max_mat;
-        }
-
-        delete m;
-
-		activation->set_row_data(t, activation_t->transpose());
+		logits->set_row_data(t, logits_t->transpose());
 	}
 
 	delete state_t;
-	delete activation_t;
+	delete logits_t;
 	delete seq_time_data;
 	delete pre_state_t;
 	delete pre_weight_t;
@@ -108,15 +87,20 @@ void Layer::back_propagation(ccma::algebra::BaseMatrixT<real>* train_seq_data,
                              bool debug){
 
     auto now = []{return std::chrono::system_clock::now();};
-    auto time = [](long long int cnt){return std::chrono::duration_cast<std::chrono::milliseconds>(cnt).count();};
+    auto time = [](std::chrono::system_clock::duration cnt){return (long long int)std::chrono::duration_cast<std::chrono::milliseconds>(cnt).count();};
     auto start_time = now();
 
     auto state		     = new ccma::algebra::DenseMatrixT<real>();
 	auto derivate_output = new ccma::algebra::DenseMatrixT<real>();
 
-	feed_farward(train_seq_data, weight, pre_weight, act_weight, state, derivate_output, debug);
-
-	derivate_output->subtract(train_seq_label);
+	/*
+	 * d(loss)/d(z[t]) = softmax(z[t]) - y[t], fused with the softmax
+	 * over the logits in place
+	 */
+	forward_logits(train_seq_data, weight, pre_weight, act_weight, state, derivate_output, debug);
+	ccma::algebra::softmax_cross_entropy(derivate_output->get_data(), train_seq_label->get_data(),
+	                                     (real*)nullptr, derivate_output->get_data(),
+	                                     derivate_output->get_rows(), derivate_output->get_cols());
 
 	auto derivate_pre_weight_t  = new ccma::algebra::DenseMatrixT<real>();
 	auto derivate_output_t      = new ccma::algebra::DenseMatrixT<real>();
@@ -205,7 +189,9 @@ void Layer::back_propagation(ccma::algebra::BaseMatrixT<real>* train_seq_data,
 	delete train_data_t;
 
     auto end_time = now();
-    printf("thread[%lu][%lld-%lld][%lld].\n", std::this_thread::get_id(), start_time, end_time, time(end_time - start_time));
+    if(debug){
+        printf("back_propagation run time[%lld] ms.\n", time(end_time - start_time));
+    }
 }
 
 
@@ -8,6 +8,7 @@
 
 #include "algorithm/rnn/RNN.h"
 #include <functional>
+#include "algebra/MatrixKernel.h"
 
 namespace ccma{
 namespace algorithm{
@@ -108,13 +109,28 @@ void RNN::mini_batch_update(std::vector<ccma::algebra::BaseMatrixT<real>*> train
         derivate_act_weight[0]->add(derivate_act_weight[i]);
     }
 
-    derivate_weight[0]->multiply(alpha / num_train_data);
-    derivate_pre_weight[0]->multiply(alpha / num_train_data);
-    derivate_act_weight[0]->multiply(alpha / num_train_data);
+    //global norm of the averaged gradient, read only, before any update
+    real ratio = 1.0;
+    bool is_skipped = false;
+    if(_clip.is_enabled()){
+        double sq_sum = ccma::algebra::sum_square(derivate_weight[0]->get_data(), derivate_weight[0]->get_size())
+                      + ccma::algebra::sum_square(derivate_pre_weight[0]->get_data(), derivate_pre_weight[0]->get_size())
+                      + ccma::algebra::sum_square(derivate_act_weight[0]->get_data(), derivate_act_weight[0]->get_size());
+        is_skipped = !_clip.check(sq_sum, 1.0 / num_train_data, &ratio);
+        if(is_skipped){
+            printf("RNN mini batch %d skipped, non-finite gradient.\n", j);
+        }
+    }
+
+    if(!is_skipped){
+        derivate_weight[0]->multiply(alpha / num_train_data * ratio);
+        derivate_pre_weight[0]->multiply(alpha / num_train_data * ratio);
+        derivate_act_weight[0]->multiply(alpha / num_train_data * ratio);
 
-    _U->subtract(derivate_weight[0]);
-    _W->subtract(derivate_pre_weight[0]);
-    _V->subtract(derivate_act_weight[0]);
+        _U->subtract(derivate_weight[0]);
+        _W->subtract(derivate_pre_weight[0]);
+        _V->subtract(derivate_act_weight[0]);
+    }
 
     for(auto d : derivate_weight){
         delete d;
@@ -140,14 +156,11 @@ real RNN::total_loss(std::vector<ccma::algebra::BaseMatrixT<real>*>* train_seq_d
 	
     uint num_train_data = train_seq_data->size();
 	for(uint j = 0; j != num_train_data; j++){
-		_layer->feed_farward(train_seq_data->at(j), _U, _W, _V, state, activation, false);
-
-		auto mat_label = train_seq_label->at(j)->argmax(0);
-        uint rows = mat_label->get_rows();
-        for(uint row = 0; row != rows; row++){
-            loss_value -= std::log(activation->get_data(row, mat_label->get_data(row, 0)));
-        }
-        delete mat_label;
+		//-sum(y * log_softmax(z)), finite even when a probability underflows
+		_layer->forward_logits(train_seq_data->at(j), _U, _W, _V, state, activation, false);
+		loss_value += ccma::algebra::softmax_cross_entropy(activation->get_data(), train_seq_label->at(j)->get_data(),
+		                                                   (real*)nullptr, (real*)nullptr,
+		                                                   activation->get_rows(), activation->get_cols());
 	}
 
     delete state;
@@ -189,7 +202,8 @@ bool RNN::check_data(std::vector<ccma::algebra::BaseMatrixT<real>*>* train_seq_d
 
 bool RNN::load_model(const std::string& path){
     std::vector<ccma::algebra::BaseMatrixT<real>*> models;
-    if(!loader.read<real>(path, &models,"RNNMODEL") || models.size() != 3){
+    std::shared_ptr<ccma::utils::MappedFile> mapping;
+    if(!loader.map<real>(path, &models, &mapping, "RNNMODEL") || models.size() != 3){
         for(auto&& model : models){
             delete model;
         }
@@ -207,7 +221,8 @@ bool RNN::load_model(const std::string& path){
     if(_V != nullptr){
         delete _V;
     }
-    _U = models[2];
+    _V = models[2];
+    _mapping = mapping;
 
     _feature_dim    = _U->get_cols();
     _hidden_dim     = _U->get_rows();